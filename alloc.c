@@ -0,0 +1,58 @@
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void *system_alloc(void *data, size_t size) {
+    (void)data;
+    return malloc(size);
+}
+
+static void *system_resize(void *data, void *ptr, size_t size) {
+    (void)data;
+    return realloc(ptr, size);
+}
+
+static void system_release(void *data, void *ptr) {
+    (void)data;
+    free(ptr);
+}
+
+static const LineAllocator system_allocator = {system_alloc, system_resize, system_release, NULL};
+static const LineAllocator *default_allocator = &system_allocator;
+
+const LineAllocator *alloc_default(void) {
+    return default_allocator;
+}
+
+void alloc_set_default(const LineAllocator *a) {
+    default_allocator = a ? a : &system_allocator;
+}
+
+const LineAllocator *alloc_resolve(const LineAllocator *a) {
+    return a ? a : default_allocator;
+}
+
+void *mem_alloc(const LineAllocator *a, size_t size) {
+    return a->alloc(a->data, size);
+}
+
+void *mem_calloc(const LineAllocator *a, size_t size) {
+    void *p = a->alloc(a->data, size);
+    if (p) memset(p, 0, size);
+    return p;
+}
+
+void *mem_realloc(const LineAllocator *a, void *ptr, size_t size) {
+    return a->resize(a->data, ptr, size);
+}
+
+void mem_free(const LineAllocator *a, void *ptr) {
+    if (ptr) a->release(a->data, ptr);
+}
+
+char *mem_strdup(const LineAllocator *a, const char *s) {
+    size_t n = strlen(s) + 1;
+    char *copy = a->alloc(a->data, n);
+    if (copy) memcpy(copy, s, n);
+    return copy;
+}
@@ -0,0 +1,30 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+// Where a Line and the structures it owns get their memory.  The three
+// functions behave like malloc, realloc and free and get data as their
+// first argument.  An allocator is used from the thread that owns the
+// structure, so it needn't be thread safe.
+typedef struct {
+    void *(*alloc)(void *data, size_t size);
+    void *(*resize)(void *data, void *ptr, size_t size);
+    void (*release)(void *data, void *ptr);
+    void *data;
+} LineAllocator;
+
+// The allocator used where none is given, malloc unless set otherwise.
+// Structures keep the allocator they were made with, so set it before
+// making any, and not while another thread makes one.
+const LineAllocator *alloc_default(void);
+void alloc_set_default(const LineAllocator *a);     // NULL for malloc
+const LineAllocator *alloc_resolve(const LineAllocator *a);  // a, or the default if NULL
+
+void *mem_alloc(const LineAllocator *a, size_t size);
+void *mem_calloc(const LineAllocator *a, size_t size);  // Zeroed
+void *mem_realloc(const LineAllocator *a, void *ptr, size_t size);
+void mem_free(const LineAllocator *a, void *ptr);
+char *mem_strdup(const LineAllocator *a, const char *s);
+
+#endif // ALLOC_H
@@ -0,0 +1,187 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    ArenaBlock *prev;       // Only kept for large blocks
+    size_t size;            // Bytes after the header
+    size_t top;             // Bytes handed out
+};
+
+// Stored before every allocation
+typedef struct {
+    size_t size;            // Bytes asked for
+    ArenaBlock *large;      // Block of its own, or NULL
+} Chunk;
+
+static size_t round_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+#define BLOCK_HEADER round_up(sizeof(ArenaBlock))
+#define CHUNK_HEADER round_up(sizeof(Chunk))
+
+static char *block_data(ArenaBlock *b) {
+    return (char *)b + BLOCK_HEADER;
+}
+
+static Chunk *chunk_of(void *ptr) {
+    return (Chunk *)((char *)ptr - CHUNK_HEADER);
+}
+
+static void free_list(ArenaBlock *b) {
+    while (b) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+void arena_init(Arena *a, size_t block_size) {
+    memset(a, 0, sizeof(Arena));
+    a->block_size = round_up(block_size ? block_size : ARENA_DEFAULT_BLOCK);
+}
+
+void arena_free(Arena *a) {
+    free_list(a->blocks);
+    free_list(a->spare);
+    free_list(a->large);
+    a->blocks = a->spare = a->large = NULL;
+    a->last = NULL;
+}
+
+void arena_reset(Arena *a) {
+    while (a->blocks) {
+        ArenaBlock *b = a->blocks;
+        a->blocks = b->next;
+        b->top = 0;
+        b->next = a->spare;
+        a->spare = b;
+    }
+    free_list(a->large);
+    a->large = NULL;
+    a->last = NULL;
+}
+
+size_t arena_memory_usage(const Arena *a) {
+    size_t total = 0;
+    const ArenaBlock *lists[] = {a->blocks, a->spare, a->large};
+    for (int i = 0; i < 3; i++) {
+        for (const ArenaBlock *b = lists[i]; b; b = b->next) total += BLOCK_HEADER + b->size;
+    }
+    return total;
+}
+
+static void *alloc_large(Arena *a, size_t size) {
+    ArenaBlock *b = malloc(BLOCK_HEADER + CHUNK_HEADER + size);
+    if (!b) return NULL;
+    b->size = CHUNK_HEADER + size;
+    b->top = b->size;
+    b->prev = NULL;
+    b->next = a->large;
+    if (a->large) a->large->prev = b;
+    a->large = b;
+
+    Chunk *c = (Chunk *)block_data(b);
+    c->size = size;
+    c->large = b;
+    return (char *)c + CHUNK_HEADER;
+}
+
+static void unlink_large(Arena *a, ArenaBlock *b) {
+    if (b->prev) b->prev->next = b->next;
+    else a->large = b->next;
+    if (b->next) b->next->prev = b->prev;
+}
+
+static void *arena_alloc(void *data, size_t size) {
+    Arena *a = data;
+    if (size > a->block_size / 4) return alloc_large(a, size);
+
+    size_t need = CHUNK_HEADER + round_up(size);
+    ArenaBlock *b = a->blocks;
+    if (!b || b->top + need > b->size) {
+        if (a->spare) {
+            b = a->spare;
+            a->spare = b->next;
+        } else {
+            b = malloc(BLOCK_HEADER + a->block_size);
+            if (!b) return NULL;
+            b->size = a->block_size;
+            b->prev = NULL;
+        }
+        b->top = 0;
+        b->next = a->blocks;
+        a->blocks = b;
+    }
+
+    Chunk *c = (Chunk *)(block_data(b) + b->top);
+    c->size = size;
+    c->large = NULL;
+    b->top += need;
+    a->last = (char *)c + CHUNK_HEADER;
+    return a->last;
+}
+
+static void arena_release(void *data, void *ptr) {
+    Arena *a = data;
+    if (!ptr) return;
+    Chunk *c = chunk_of(ptr);
+    if (c->large) {
+        unlink_large(a, c->large);
+        free(c->large);
+    } else if (ptr == a->last) {
+        a->blocks->top = (char *)c - block_data(a->blocks);
+        a->last = NULL;
+    }
+}
+
+static void *arena_resize(void *data, void *ptr, size_t size) {
+    Arena *a = data;
+    if (!ptr) return arena_alloc(a, size);
+    Chunk *c = chunk_of(ptr);
+
+    if (c->large && size > a->block_size / 4) {
+        ArenaBlock *old = c->large;
+        ArenaBlock *prev = old->prev, *next = old->next;
+        ArenaBlock *b = realloc(old, BLOCK_HEADER + CHUNK_HEADER + size);
+        if (!b) return NULL;
+        b->size = b->top = CHUNK_HEADER + size;
+        if (prev) prev->next = b;
+        else a->large = b;
+        if (next) next->prev = b;
+        c = (Chunk *)block_data(b);
+        c->size = size;
+        c->large = b;
+        return (char *)c + CHUNK_HEADER;
+    }
+    if (!c->large) {
+        // The latest allocation moves the top of its block
+        if (ptr == a->last) {
+            size_t end = (char *)ptr - block_data(a->blocks) + round_up(size);
+            if (end <= a->blocks->size) {
+                a->blocks->top = end;
+                c->size = size;
+                return ptr;
+            }
+        }
+        if (size <= round_up(c->size)) {
+            c->size = size;
+            return ptr;
+        }
+    }
+
+    void *fresh = arena_alloc(a, size);
+    if (!fresh) return NULL;
+    memcpy(fresh, ptr, c->size < size ? c->size : size);
+    arena_release(a, ptr);
+    return fresh;
+}
+
+LineAllocator arena_allocator(Arena *a) {
+    LineAllocator allocator = {arena_alloc, arena_resize, arena_release, a};
+    return allocator;
+}
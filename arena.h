@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "alloc.h"
+
+#define ARENA_DEFAULT_BLOCK 65536
+
+typedef struct ArenaBlock ArenaBlock;
+
+// A bump allocator for memory that all goes away at once.  Allocations
+// are carved from blocks of block_size bytes and only given back by
+// arena_reset, except the most recent one, which frees and grows in
+// place.  Anything over a quarter of a block gets a block of its own,
+// freed or resized on its own, so a growing buffer leaves no copies
+// behind.  Blocks survive a reset to be filled again.
+typedef struct {
+    ArenaBlock *blocks;     // Block being filled, then the full ones
+    ArenaBlock *spare;      // Emptied by arena_reset
+    ArenaBlock *large;      // One allocation each
+    size_t block_size;
+    char *last;             // Most recent allocation in blocks, or NULL
+} Arena;
+
+void arena_init(Arena *a, size_t block_size);   // 0 for ARENA_DEFAULT_BLOCK
+void arena_free(Arena *a);      // Give every block back to the system
+void arena_reset(Arena *a);     // Forget every allocation at once
+// An allocator taking memory from a, valid as long as a is
+LineAllocator arena_allocator(Arena *a);
+size_t arena_memory_usage(const Arena *a);  // Bytes held, used or not
+
+#endif // ARENA_H
@@ -0,0 +1,16 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+// replay writes one record to this fd for each batch of input it handled
+#define BENCH_REPORT_FD 3
+
+typedef struct {
+    uint64_t ns;            // Time spent in the library
+    uint32_t in_bytes;      // Input bytes read from the terminal
+    uint32_t out_bytes;     // Bytes written to the terminal
+    uint32_t syscalls;      // read, write, ioctl, tcgetattr and tcsetattr calls
+} BenchRecord;
+
+#endif // BENCH_H
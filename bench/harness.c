@@ -0,0 +1,386 @@
+// Keystroke replay benchmark.
+//
+//     harness REPLAY [FILE...]
+//
+// Runs REPLAY under a pseudo-terminal for each corpus and sends it one
+// key at a time, waiting for its report before the next key.  The
+// built-in corpora cover typing, long pastes, word motions with big digit
+// arguments and kill/yank storms.  Each FILE is a recorded corpus of raw
+// terminal input, split into keys the way eline decodes them.
+//
+// For every corpus it prints the per-key time spent in the library as
+// p50/p99/max, and the bytes written to the terminal and syscalls made
+// per key.
+#include "bench.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BENCH_COLS 80
+#define BENCH_ROWS 24
+#define BENCH_TIMEOUT_MS 10000
+
+typedef struct {
+    const char *name;
+    char *bytes;
+    size_t len;
+    size_t cap;
+    size_t *ends;       // End offset of each key in bytes
+    size_t count;
+    size_t ends_cap;
+    size_t setup;       // Keys before this one only set up the buffer
+} Corpus;
+
+typedef struct {
+    pid_t pid;
+    int master;
+    int report;
+} Editor;
+
+static void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+static void corpus_key(Corpus *c, const char *bytes, size_t n) {
+    if (c->len + n > c->cap) {
+        while (c->len + n > c->cap) c->cap = c->cap ? c->cap * 2 : 4096;
+        c->bytes = xrealloc(c->bytes, c->cap);
+    }
+    if (c->count == c->ends_cap) {
+        c->ends_cap = c->ends_cap ? c->ends_cap * 2 : 256;
+        c->ends = xrealloc(c->ends, c->ends_cap * sizeof(size_t));
+    }
+    memcpy(c->bytes + c->len, bytes, n);
+    c->len += n;
+    c->ends[c->count++] = c->len;
+}
+
+// One key per character, as typed
+static void corpus_type(Corpus *c, const char *text) {
+    for (const char *p = text; *p; p++) corpus_key(c, p, 1);
+}
+
+// Text sent in writes of chunk bytes, as a terminal delivers a paste
+static void corpus_paste(Corpus *c, const char *text, size_t len, size_t chunk) {
+    for (size_t i = 0; i < len; i += chunk) {
+        corpus_key(c, text + i, len - i < chunk ? len - i : chunk);
+    }
+}
+
+// Everything added so far is set up, not measured
+static void corpus_mark_setup(Corpus *c) {
+    c->setup = c->count;
+}
+
+static void corpus_free(Corpus *c) {
+    free(c->bytes);
+    free(c->ends);
+}
+
+// A line of n words made of letters and a few brackets
+static char *make_words(size_t n, size_t *len) {
+    static const char *words[] = {
+        "line", "(point)", "buffer", "kill", "yank", "[region]", "mark",
+        "refresh", "{prompt}", "word", "history", "undo",
+    };
+    size_t count = sizeof(words) / sizeof(words[0]);
+    char *text = xrealloc(NULL, n * 16 + 1);
+    size_t pos = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0) text[pos++] = ' ';
+        size_t w = strlen(words[i % count]);
+        memcpy(text + pos, words[i % count], w);
+        pos += w;
+    }
+    text[pos] = '\0';
+    *len = pos;
+    return text;
+}
+
+static void build_typing(Corpus *c) {
+    c->name = "typing";
+    for (int i = 0; i < 50; i++) {
+        corpus_type(c, "git commit -m \"fix (refresh) of [wrapped] lines\" --amend");
+        // A typo and its correction
+        corpus_type(c, " --no-vrify");
+        for (int k = 0; k < 5; k++) corpus_key(c, "\x7f", 1);
+        corpus_type(c, "erify");
+        corpus_key(c, "\r", 1);
+    }
+}
+
+static void build_paste(Corpus *c) {
+    c->name = "paste";
+    size_t len;
+    char *text = make_words(2000, &len);
+    for (int i = 0; i < 8; i++) {
+        corpus_paste(c, text, len, 1024);
+        corpus_key(c, "\r", 1);
+    }
+    free(text);
+}
+
+static void build_words(Corpus *c) {
+    c->name = "word-motion";
+    size_t len;
+    char *text = make_words(2000, &len);
+    corpus_paste(c, text, len, 1024);
+    corpus_mark_setup(c);
+    for (int i = 0; i < 100; i++) {
+        corpus_key(c, "\033" "9", 2);
+        corpus_key(c, "\033" "9", 2);
+        corpus_key(c, "\033" "b", 2);
+        corpus_key(c, "\033" "5", 2);
+        corpus_key(c, "\033" "0", 2);
+        corpus_key(c, "\033" "0", 2);
+        corpus_key(c, "\033" "b", 2);
+        corpus_key(c, "\033" "9", 2);
+        corpus_key(c, "\033" "9", 2);
+        corpus_key(c, "\033" "f", 2);
+        corpus_key(c, "\001", 1);     // C-a
+        corpus_key(c, "\005", 1);     // C-e
+    }
+    corpus_key(c, "\r", 1);
+    free(text);
+}
+
+static void build_kill_yank(Corpus *c) {
+    c->name = "kill-yank";
+    size_t len;
+    char *text = make_words(500, &len);
+    corpus_paste(c, text, len, 1024);
+    corpus_key(c, "\001", 1);
+    corpus_mark_setup(c);
+    for (int i = 0; i < 100; i++) {
+        corpus_key(c, "\033" "d", 2); // M-d
+        corpus_key(c, "\033" "d", 2);
+        corpus_key(c, "\031", 1);     // C-y
+        corpus_key(c, "\031", 1);
+        corpus_key(c, "\000", 1);     // C-SPC
+        corpus_key(c, "\033" "f", 2);
+        corpus_key(c, "\033" "f", 2);
+        corpus_key(c, "\027", 1);     // C-w
+        corpus_key(c, "\005", 1);     // C-e
+        corpus_key(c, "\031", 1);
+        corpus_key(c, "\001", 1);
+        corpus_key(c, "\013", 1);     // C-k
+        corpus_key(c, "\031", 1);
+        corpus_key(c, "\001", 1);
+    }
+    corpus_key(c, "\r", 1);
+    free(text);
+}
+
+// Length of the key at the start of bytes, like eline's decoder
+static size_t key_length(const char *bytes, size_t n) {
+    if (bytes[0] != 27 || n == 1) return 1;
+    if (bytes[1] == 'O') return n >= 3 ? 3 : n;
+    if (bytes[1] != '[') return 2;
+    for (size_t i = 2; i < n; i++) {
+        if (bytes[i] >= 0x40 && bytes[i] <= 0x7e) return i + 1;
+    }
+    return n;
+}
+
+static int load_corpus(Corpus *c, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char *data = NULL;
+    size_t len = 0, cap = 0, n;
+    char chunk[4096];
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if (len + n > cap) {
+            while (len + n > cap) cap = cap ? cap * 2 : sizeof(chunk);
+            data = xrealloc(data, cap);
+        }
+        memcpy(data + len, chunk, n);
+        len += n;
+    }
+    fclose(f);
+
+    const char *slash = strrchr(path, '/');
+    c->name = slash ? slash + 1 : path;
+    for (size_t i = 0; i < len;) {
+        size_t k = key_length(data + i, len - i);
+        corpus_key(c, data + i, k);
+        i += k;
+    }
+    free(data);
+    return 0;
+}
+
+static int editor_start(Editor *e, const char *replay) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    struct winsize ws = {BENCH_ROWS, BENCH_COLS, 0, 0};
+    e->pid = forkpty(&e->master, NULL, NULL, &ws);
+    if (e->pid < 0) {
+        perror("forkpty");
+        return -1;
+    }
+    if (e->pid == 0) {
+        close(fds[0]);
+        if (fds[1] != BENCH_REPORT_FD) {
+            dup2(fds[1], BENCH_REPORT_FD);
+            close(fds[1]);
+        }
+        execl(replay, replay, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    e->report = fds[0];
+    fcntl(e->master, F_SETFL, fcntl(e->master, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+static void editor_stop(Editor *e) {
+    close(e->master);
+    close(e->report);
+    kill(e->pid, SIGTERM);
+    waitpid(e->pid, NULL, 0);
+}
+
+// Read and drop what the editor drew
+static void drain(Editor *e) {
+    char buf[65536];
+    while (read(e->master, buf, sizeof(buf)) > 0) {}
+}
+
+// Send n bytes and sum the reports until the editor has read them all
+static int send_key(Editor *e, const char *bytes, size_t n, BenchRecord *total) {
+    size_t sent = 0, handled = 0, records = 0;
+    *total = (BenchRecord){0};
+
+    while (records == 0 || handled < n) {
+        struct pollfd fds[2] = {
+            {e->master, POLLIN | (sent < n ? POLLOUT : 0), 0},
+            {e->report, POLLIN, 0},
+        };
+        int ready = poll(fds, 2, BENCH_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) {
+            fprintf(stderr, "harness: editor stopped responding\n");
+            return -1;
+        }
+
+        if (fds[0].revents & POLLIN) drain(e);
+        if ((fds[0].revents & POLLOUT) && sent < n) {
+            ssize_t w = write(e->master, bytes + sent, n - sent);
+            if (w > 0) sent += w;
+        }
+        if (fds[1].revents & POLLIN) {
+            BenchRecord r;
+            if (read(e->report, &r, sizeof(r)) != sizeof(r)) {
+                fprintf(stderr, "harness: editor exited\n");
+                return -1;
+            }
+            total->ns += r.ns;
+            total->in_bytes += r.in_bytes;
+            total->out_bytes += r.out_bytes;
+            total->syscalls += r.syscalls;
+            handled += r.in_bytes;
+            records++;
+        } else if (fds[1].revents & (POLLHUP | POLLERR)) {
+            fprintf(stderr, "harness: editor exited\n");
+            return -1;
+        }
+    }
+    drain(e);
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, int p) {
+    return sorted[(n - 1) * p / 100] / 1000.0;
+}
+
+static int run_corpus(const char *replay, const Corpus *c) {
+    Editor e;
+    if (editor_start(&e, replay) != 0) return -1;
+
+    // Wait for the first prompt
+    BenchRecord r;
+    if (send_key(&e, NULL, 0, &r) != 0) {
+        editor_stop(&e);
+        return -1;
+    }
+
+    size_t measured = c->count - c->setup;
+    uint64_t *times = xrealloc(NULL, (measured ? measured : 1) * sizeof(uint64_t));
+    uint64_t out_bytes = 0, syscalls = 0;
+    size_t start = 0;
+    for (size_t k = 0; k < c->count; k++) {
+        if (send_key(&e, c->bytes + start, c->ends[k] - start, &r) != 0) {
+            free(times);
+            editor_stop(&e);
+            return -1;
+        }
+        start = c->ends[k];
+        if (k < c->setup) continue;
+        times[k - c->setup] = r.ns;
+        out_bytes += r.out_bytes;
+        syscalls += r.syscalls;
+    }
+    editor_stop(&e);
+
+    if (measured > 0) {
+        qsort(times, measured, sizeof(uint64_t), compare_u64);
+        printf("%-14s %7zu %9.1f %9.1f %9.1f %11.1f %13.2f\n", c->name, measured,
+               percentile_us(times, measured, 50), percentile_us(times, measured, 99),
+               times[measured - 1] / 1000.0,
+               (double)out_bytes / measured, (double)syscalls / measured);
+    }
+    free(times);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s REPLAY [FILE...]\n", argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    void (*builders[])(Corpus *) = {build_typing, build_paste, build_words, build_kill_yank};
+    size_t builtin = sizeof(builders) / sizeof(builders[0]);
+    size_t files = argc - 2;
+    int status = 0;
+
+    printf("%-14s %7s %9s %9s %9s %11s %13s\n",
+           "corpus", "keys", "p50 us", "p99 us", "max us", "bytes/key", "syscalls/key");
+    for (size_t i = 0; i < builtin + files; i++) {
+        Corpus c = {0};
+        if (i < builtin) builders[i](&c);
+        else if (load_corpus(&c, argv[2 + i - builtin]) != 0) {
+            status = 1;
+            continue;
+        }
+        if (run_corpus(argv[1], &c) != 0) status = 1;
+        corpus_free(&c);
+    }
+    return status;
+}
@@ -0,0 +1,90 @@
+// Throughput of headless batch editing, in keys per second.
+//
+// Each corpus is applied with line_run_bytes in one call, so the numbers
+// cover decoding, lookup, the commands and the undo log but no terminal.
+// The +trace runs record a session trace to /dev/null as well.
+#include "eline.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEADLESS_KEYS 4000000
+
+typedef struct {
+    char *bytes;
+    size_t len;
+    size_t keys;
+} Script;
+
+static void add(Script *s, const char *bytes, size_t n) {
+    memcpy(s->bytes + s->len, bytes, n);
+    s->len += n;
+    s->keys++;
+}
+
+// Lines of 60 typed characters, each ended with Enter
+static void build_typing(Script *s) {
+    const char *text = "git commit -m \"fix (refresh) of [wrapped] lines\" --amend x ";
+    while (s->keys < HEADLESS_KEYS) {
+        for (const char *p = text; *p; p++) add(s, p, 1);
+        add(s, "\r", 1);
+    }
+}
+
+// Word motions and edits inside one line that is rebuilt every 100 keys
+static void build_editing(Script *s) {
+    const char *text = "the quick brown fox jumps over the lazy dog ";
+    while (s->keys < HEADLESS_KEYS) {
+        for (const char *p = text; *p; p++) add(s, p, 1);
+        add(s, "\001", 1);            // C-a
+        add(s, "\033" "f", 2);        // M-f
+        add(s, "\033" "f", 2);
+        add(s, "\033" "d", 2);        // M-d
+        add(s, "\005", 1);            // C-e
+        add(s, "\031", 1);            // C-y
+        add(s, "\033" "b", 2);        // M-b
+        add(s, "\002", 1);            // C-b
+        add(s, "\006", 1);            // C-f
+        add(s, "\033[D", 3);          // LEFT
+        add(s, "\033[C", 3);          // RIGHT
+        add(s, "\177", 1);            // DEL
+        add(s, "\001", 1);
+        add(s, "\013", 1);            // C-k
+        add(s, "\r", 1);
+    }
+}
+
+static double run(const char *name, void (*build)(Script *), bool traced) {
+    Script s = {malloc(HEADLESS_KEYS * 4), 0, 0};
+    build(&s);
+
+    Line line;
+    line_init_headless(&line);
+    int null = traced ? open("/dev/null", O_WRONLY) : -1;
+    if (null >= 0) line_trace_start(&line, null);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    LineStatus status = line_run_bytes(&line, s.bytes, s.len);
+    // Accepted lines leave the rest as typeahead for the next line
+    while (status == LINE_ACCEPTED) status = line_run_bytes(&line, "", 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    line_free(&line);
+    if (null >= 0) close(null);
+    free(s.bytes);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double rate = s.keys / secs;
+    printf("%-14s %9zu keys %8.3f s %8.2f Mkeys/s\n", name, s.keys, secs, rate / 1e6);
+    return rate;
+}
+
+int main(void) {
+    run("typing", build_typing, false);
+    run("typing+trace", build_typing, true);
+    run("editing", build_editing, false);
+    run("editing+trace", build_editing, true);
+    return 0;
+}
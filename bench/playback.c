@@ -0,0 +1,338 @@
+// Replays a session trace, recorded with ELINE_TRACE or line_trace_start,
+// on a fresh Line and compares what it did with what the session did.
+//
+//     playback [-r] trace
+//
+// The Line draws to /dev/null and is recorded as well.  Input, escape
+// timeouts, resizes, prompts, text printed above, history and the
+// answers of input_complete come from the trace, as fast as possible
+// or, with -r, at the times they were recorded.  Then the edits and line
+// ends of both are compared, and the time each spent per command and
+// from input to output is listed side by side.  The clipboard is off, a
+// yank from it can't be replayed.
+#include "eline.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PLAYBACK_COMMANDS 256
+
+typedef struct {
+    const char *key;
+    size_t key_len;
+    const char *name;
+    size_t name_len;
+    MetricsTimer time;
+} Command;
+
+// What one trace shows
+typedef struct {
+    Command commands[PLAYBACK_COMMANDS];    // By index, 0 is self-insert
+    size_t command_count;
+    MetricsTimer latency;       // Input until the output after it
+    unsigned long lines;
+    unsigned long inputs;
+    unsigned long long input_bytes;
+    unsigned long outputs;
+    unsigned long long output_bytes;
+    unsigned long long span;    // From the first record to the last
+    TraceRecord *results;       // TRACE_EDIT and TRACE_END, in order
+    size_t result_count;
+    size_t result_cap;
+    bool truncated;
+} Summary;
+
+// input_complete's answers, in the order it gave them
+typedef struct {
+    bool *answers;
+    size_t count;
+    size_t next;
+} Answers;
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    size_t cap = 65536;
+    char *buf = malloc(cap);
+    *len = 0;
+    size_t n;
+    while (buf && (n = fread(buf + *len, 1, cap - *len, f)) > 0) {
+        *len += n;
+        if (*len == cap) buf = realloc(buf, cap *= 2);
+    }
+    fclose(f);
+    return buf;
+}
+
+static void add_result(Summary *s, const TraceRecord *rec) {
+    if (s->result_count == s->result_cap) {
+        s->result_cap = s->result_cap ? s->result_cap * 2 : 256;
+        s->results = realloc(s->results, s->result_cap * sizeof(TraceRecord));
+    }
+    s->results[s->result_count++] = *rec;
+}
+
+static void add_command(Summary *s, const TraceRecord *rec) {
+    const char *p = rec->data, *end = rec->data + rec->len;
+    unsigned long long index, ns;
+    if (!trace_get_uint(&p, end, &index) || !trace_get_uint(&p, end, &ns)) return;
+    if (index >= PLAYBACK_COMMANDS) return;
+    if (index >= s->command_count) s->command_count = index + 1;
+    metrics_record(&s->commands[index].time, ns);
+}
+
+static bool summarize(const char *buf, size_t len, Summary *s) {
+    memset(s, 0, sizeof(Summary));
+    s->commands[TRACE_SELF_INSERT].key = "";
+    s->commands[TRACE_SELF_INSERT].name = "self-insert";
+    s->commands[TRACE_SELF_INSERT].name_len = strlen("self-insert");
+
+    TraceReader r;
+    if (!trace_reader_init(&r, buf, len)) return false;
+    TraceRecord rec;
+    size_t names = 0;
+    unsigned long long first = 0, input_at = 0;
+    bool any = false, waiting = false;
+    while (trace_next(&r, &rec)) {
+        if (!any) first = rec.at;
+        any = true;
+        s->span = rec.at - first;
+        const char *p = rec.data, *end = rec.data + rec.len;
+        Command *c;
+        switch (rec.kind) {
+            case TRACE_BEGIN:
+                s->lines++;
+                break;
+            case TRACE_INPUT:
+                s->inputs++;
+                s->input_bytes += rec.len;
+                if (!waiting) input_at = rec.at;
+                waiting = true;
+                break;
+            case TRACE_OUTPUT:
+                s->outputs++;
+                s->output_bytes += rec.len;
+                if (waiting) metrics_record(&s->latency, rec.at - input_at);
+                waiting = false;
+                break;
+            case TRACE_NAME:
+                if (++names >= PLAYBACK_COMMANDS) break;
+                c = &s->commands[names];
+                if (!trace_get_bytes(&p, end, &c->key, &c->key_len)) break;
+                trace_get_bytes(&p, end, &c->name, &c->name_len);
+                break;
+            case TRACE_COMMAND:
+                add_command(s, &rec);
+                break;
+            case TRACE_EDIT:
+            case TRACE_END:
+                add_result(s, &rec);
+                break;
+            default:
+                break;
+        }
+    }
+    s->truncated = r.p != r.end;
+    return true;
+}
+
+static bool load_answers(const char *buf, size_t len, Answers *a) {
+    memset(a, 0, sizeof(Answers));
+    TraceReader r;
+    if (!trace_reader_init(&r, buf, len)) return false;
+    TraceRecord rec;
+    size_t cap = 0;
+    while (trace_next(&r, &rec)) {
+        if (rec.kind != TRACE_COMPLETE) continue;
+        unsigned long long v = 1;
+        const char *p = rec.data;
+        trace_get_uint(&p, rec.data + rec.len, &v);
+        if (a->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            a->answers = realloc(a->answers, cap * sizeof(bool));
+        }
+        a->answers[a->count++] = v != 0;
+    }
+    return true;
+}
+
+static bool answer(const char *buf, size_t len, const LineEdit *edit, void *userdata) {
+    (void)buf;
+    (void)len;
+    (void)edit;
+    Answers *a = userdata;
+    return a->next < a->count ? a->answers[a->next++] : true;
+}
+
+static void sleep_until(unsigned long long ns) {
+    struct timespec ts = {ns / 1000000000ull, ns % 1000000000ull};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {}
+}
+
+// Drive a Line with the trace, recording it to out
+static bool replay(const char *buf, size_t len, bool real_time, FILE *out, double *secs) {
+    TraceReader r;
+    Answers answers;
+    if (!trace_reader_init(&r, buf, len) || !load_answers(buf, len, &answers)) return false;
+
+    // Nothing from the environment that the trace doesn't know of
+    unsetenv("ELINE_TRACE");
+    unsetenv("ELINE_PIPELINE");
+    unsetenv("ELINE_KILL_RING");
+    int in[2];
+    int null = open("/dev/null", O_WRONLY);
+    if (pipe(in) != 0 || null < 0) return false;
+
+    // The pipe stays empty, so input never looks like it is waiting
+    Line line;
+    line_init_fd(&line, in[0], null);
+    line.config.use_clipboard = false;
+    if (answers.count > 0) line_set_input_complete(&line, answer, &answers);
+    line_trace_start(&line, fileno(out));
+
+    TraceRecord rec;
+    unsigned long long start = metrics_now(), first = 0;
+    bool any = false;
+    while (trace_next(&r, &rec)) {
+        if (!any) first = rec.at;
+        any = true;
+        if (real_time) sleep_until(start + rec.at - first);
+        line_trace_replay(&line, &rec);
+        line_flush(&line);
+    }
+    *secs = (metrics_now() - start) / 1e9;
+
+    line_trace_stop(&line);
+    line_free(&line);
+    close(in[0]);
+    close(in[1]);
+    close(null);
+    free(answers.answers);
+    return true;
+}
+
+// "-" when it is past the last bucket, like metrics_dump
+static void print_percentile(const MetricsTimer *t, int p) {
+    unsigned long long us = metrics_percentile_us(t, p);
+    if (us) printf("p%d %llu us, ", p, us);
+    else printf("p%d -, ", p);
+}
+
+static void print_totals(const char *name, const Summary *s, double secs) {
+    printf("%-9s %lu lines, %lu inputs (%llu bytes), %lu outputs (%llu bytes), %.3f s%s\n",
+           name, s->lines, s->inputs, s->input_bytes, s->outputs, s->output_bytes, secs,
+           s->truncated ? ", truncated" : "");
+    printf("%-9s input to output: ", "");
+    print_percentile(&s->latency, 50);
+    print_percentile(&s->latency, 99);
+    printf("max %.1f us\n", s->latency.max_ns / 1e3);
+}
+
+static bool same_name(const Command *a, const Command *b) {
+    return a->name_len == b->name_len && a->key_len == b->key_len
+        && memcmp(a->name, b->name, a->name_len) == 0 && memcmp(a->key, b->key, a->key_len) == 0;
+}
+
+static void print_row(const char *key, size_t key_len, const char *name, size_t name_len,
+                      const MetricsTimer *rec, const MetricsTimer *rep) {
+    if (rec->count == 0 && rep->count == 0) return;
+    if (name_len > 32) name_len = 32;
+    printf("  %-8.*s %-32.*s %8lu %10.1f %8.2f %8lu %10.1f %8.2f\n",
+           (int)key_len, key, (int)name_len, name,
+           rec->count, rec->ns / 1e3, rec->count ? rec->ns / 1e3 / rec->count : 0.0,
+           rep->count, rep->ns / 1e3, rep->count ? rep->ns / 1e3 / rep->count : 0.0);
+}
+
+// Where each spent its time, by command and from input to output
+static void print_times(const Summary *rec, const Summary *rep) {
+    static const MetricsTimer none;
+    printf("  %-8s %-32s %8s %10s %8s %8s %10s %8s\n",
+           "key", "command", "recorded", "total us", "mean us", "replayed", "total us", "mean us");
+    print_row("", 0, "input to output", strlen("input to output"), &rec->latency, &rep->latency);
+    for (size_t i = 0; i < rec->command_count; i++) {
+        const Command *c = &rec->commands[i];
+        const MetricsTimer *other = &none;
+        for (size_t j = 0; j < rep->command_count; j++) {
+            if (same_name(c, &rep->commands[j])) other = &rep->commands[j].time;
+        }
+        print_row(c->key, c->key_len, c->name, c->name_len, &c->time, other);
+    }
+    // Commands only the replay ran
+    for (size_t j = 0; j < rep->command_count; j++) {
+        bool found = false;
+        for (size_t i = 0; i < rec->command_count; i++) found = found || same_name(&rec->commands[i], &rep->commands[j]);
+        const Command *c = &rep->commands[j];
+        if (!found) print_row(c->key, c->key_len, c->name, c->name_len, &none, &c->time);
+    }
+}
+
+// The first edit or line end that differs, if any
+static bool compare(const Summary *rec, const Summary *rep) {
+    size_t lines = 0;
+    for (size_t i = 0; i < rec->result_count && i < rep->result_count; i++) {
+        const TraceRecord *a = &rec->results[i], *b = &rep->results[i];
+        if (a->kind != b->kind || a->len != b->len || memcmp(a->data, b->data, a->len) != 0) {
+            printf("differs at %s %zu, in line %zu\n",
+                   a->kind == TRACE_END ? "line end" : "edit", i + 1, lines + 1);
+            return false;
+        }
+        if (a->kind == TRACE_END) lines++;
+    }
+    if (rec->result_count != rep->result_count) {
+        printf("differs: %zu edits and line ends recorded, %zu replayed\n",
+               rec->result_count, rep->result_count);
+        return false;
+    }
+    printf("same %zu edits and line ends\n", rec->result_count);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool real_time = argc == 3 && strcmp(argv[1], "-r") == 0;
+    if (argc != 2 && !real_time) {
+        fprintf(stderr, "usage: %s [-r] trace\n", argv[0]);
+        return 2;
+    }
+    const char *path = argv[argc - 1];
+    size_t len;
+    char *recorded = read_file(path, &len);
+    Summary rec;
+    if (!recorded || !summarize(recorded, len, &rec)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        free(recorded);
+        return 2;
+    }
+
+    FILE *out = tmpfile();
+    double secs;
+    if (!out || !replay(recorded, len, real_time, out, &secs)) {
+        fprintf(stderr, "%s: can't replay\n", path);
+        return 2;
+    }
+    fflush(out);
+    rewind(out);
+    size_t replayed_len = 0, cap = 65536;
+    char *replayed = malloc(cap);
+    size_t n;
+    while ((n = fread(replayed + replayed_len, 1, cap - replayed_len, out)) > 0) {
+        replayed_len += n;
+        if (replayed_len == cap) replayed = realloc(replayed, cap *= 2);
+    }
+    fclose(out);
+    Summary rep;
+    summarize(replayed, replayed_len, &rep);
+
+    print_totals("recorded", &rec, rec.span / 1e9);
+    print_totals("replayed", &rep, secs);
+    bool same = compare(&rec, &rep);
+    print_times(&rec, &rep);
+
+    free(rec.results);
+    free(rep.results);
+    free(recorded);
+    free(replayed);
+    return same ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+// Editor side of the benchmark, run by harness under a pseudo-terminal.
+//
+// Linked with -Wl,--wrap for the syscalls the library makes, so every
+// call can be counted.  After each batch of input it reports what
+// processing it took on fd 3, which keeps the harness in lockstep with it.
+#include "eline.h"
+#include "bench.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+ssize_t __real_read(int fd, void *buf, size_t n);
+ssize_t __real_write(int fd, const void *buf, size_t n);
+int __real_ioctl(int fd, unsigned long request, void *arg);
+int __real_tcsetattr(int fd, int actions, const struct termios *t);
+int __real_tcgetattr(int fd, struct termios *t);
+
+static BenchRecord counters;
+
+ssize_t __wrap_read(int fd, void *buf, size_t n) {
+    counters.syscalls++;
+    ssize_t r = __real_read(fd, buf, n);
+    if (r > 0 && fd == STDIN_FILENO) counters.in_bytes += r;
+    return r;
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t n) {
+    counters.syscalls++;
+    ssize_t r = __real_write(fd, buf, n);
+    if (r > 0 && fd == STDOUT_FILENO) counters.out_bytes += r;
+    return r;
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+    va_list ap;
+    va_start(ap, request);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+    counters.syscalls++;
+    return __real_ioctl(fd, request, arg);
+}
+
+int __wrap_tcsetattr(int fd, int actions, const struct termios *t) {
+    counters.syscalls++;
+    return __real_tcsetattr(fd, actions, t);
+}
+
+int __wrap_tcgetattr(int fd, struct termios *t) {
+    counters.syscalls++;
+    return __real_tcgetattr(fd, t);
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(unsigned long long start) {
+    counters.ns = now_ns() - start;
+    __real_write(BENCH_REPORT_FD, &counters, sizeof(counters));
+    counters = (BenchRecord){0};
+}
+
+int main(void) {
+    Line line;
+    line_init(&line);
+    // Spawning xclip on every kill would swamp what is measured
+    line.config.use_clipboard = false;
+
+    // The first report tells the harness that raw mode is on and the
+    // prompt is drawn, so no input gets flushed by line_begin
+    unsigned long long start = now_ns();
+    LineStatus status = line_begin(&line, ">> ");
+    report(start);
+
+    while (status != LINE_EOF) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        start = now_ns();
+        status = line_fd_ready(&line);
+        if (status == LINE_ACCEPTED) {
+            // The next prompt is part of the cost of Enter
+            line_history_add(&line, line.buffer);
+            status = line_begin(&line, ">> ");
+        }
+        report(start);
+    }
+
+    line_free(&line);
+    return 0;
+}
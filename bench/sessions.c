@@ -0,0 +1,81 @@
+// Cost of making, using and tearing down short headless sessions, with
+// the Line's memory from malloc and from an arena.
+//
+// Every session types a few lines, kills and yanks words and accepts
+// each line into the history, as one short request of a service would.
+// The arena runs are torn down with line_free and a reset, and with the
+// reset alone.
+#include "eline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SESSIONS 20000
+#define SESSION_LINES 4
+
+typedef enum { TEARDOWN_FREE, TEARDOWN_FREE_RESET, TEARDOWN_RESET } Teardown;
+
+static char script[4096];
+static size_t script_len;
+
+static void add(const char *bytes, size_t n) {
+    memcpy(script + script_len, bytes, n);
+    script_len += n;
+}
+
+static void build_script(void) {
+    const char *text = "select name, (price * 2) from [items] where id = 42 ";
+    for (int i = 0; i < SESSION_LINES; i++) {
+        add(text, strlen(text));
+        add("\033" "b", 2);        // M-b
+        add("\033" "d", 2);        // M-d
+        add("\031", 1);            // C-y
+        add("\001", 1);            // C-a
+        add("\013", 1);            // C-k
+        add("\031", 1);            // C-y
+        add("\r", 1);
+    }
+}
+
+static void session(Line *line, const LineAllocator *a) {
+    line_init_headless_with(line, a);
+    LineStatus status = line_run_bytes(line, script, script_len);
+    while (status == LINE_ACCEPTED) {
+        history_add(&line->history, line->buffer);
+        status = line_run_bytes(line, "", 0);
+    }
+}
+
+static double run(const char *name, Teardown teardown) {
+    Arena arena;
+    arena_init(&arena, 0);
+    LineAllocator allocator = arena_allocator(&arena);
+    const LineAllocator *a = teardown == TEARDOWN_FREE ? NULL : &allocator;
+    Line line;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < SESSIONS; i++) {
+        session(&line, a);
+        if (teardown != TEARDOWN_RESET) line_free(&line);
+        if (teardown != TEARDOWN_FREE) arena_reset(&arena);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    size_t held = arena_memory_usage(&arena);
+    arena_free(&arena);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double rate = SESSIONS / secs;
+    printf("%-12s %7d sessions %8.3f s %8.0f sessions/s %6.2f us/session %7zu arena bytes\n",
+           name, SESSIONS, secs, rate, 1e6 / rate, held);
+    return rate;
+}
+
+int main(void) {
+    build_script();
+    run("malloc", TEARDOWN_FREE);
+    run("arena+free", TEARDOWN_FREE_RESET);
+    run("arena", TEARDOWN_RESET);
+    return 0;
+}
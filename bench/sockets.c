@@ -0,0 +1,102 @@
+// Memory and latency of many sessions in one process, each a Line on
+// its own socketpair, as a console server would host them.
+//
+// Every session reads SOCKET_LINES lines typed by the peer end.  The
+// lines are typed one key per write, round-robin over the sessions, and
+// each session handles its key with line_fd_ready before the peer
+// drains the frame it wrote.
+#include "eline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SOCKET_SESSIONS 2000
+#define SOCKET_LINES 3
+
+typedef struct {
+    Line line;
+    int peer;
+} Session;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void drain(int fd) {
+    char buf[4096];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+}
+
+static size_t total_memory(const Session *s, int n) {
+    size_t total = 0;
+    for (int i = 0; i < n; i++) total += line_memory_usage(&s[i].line);
+    return total;
+}
+
+int main(void) {
+    // Two fds a session
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    int n = SOCKET_SESSIONS;
+    if (rl.rlim_cur < 2 * SOCKET_SESSIONS + 16) n = (rl.rlim_cur - 16) / 2;
+
+    Session *s = calloc(n, sizeof(Session));
+    double t0 = now();
+    for (int i = 0; i < n; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            perror("socketpair");
+            return 1;
+        }
+        line_init_fd(&s[i].line, sv[0], sv[0]);
+        s[i].line.config.use_clipboard = false;
+        s[i].peer = sv[1];
+    }
+    double t1 = now();
+    size_t fresh = total_memory(s, n);
+
+    const char *text = "show sessions where (idle > 30) ";
+    size_t len = strlen(text);
+    unsigned long keys = 0;
+    double t2 = now();
+    for (int l = 0; l < SOCKET_LINES; l++) {
+        for (int i = 0; i < n; i++) {
+            line_begin(&s[i].line, "> ");
+            drain(s[i].peer);
+        }
+        for (size_t k = 0; k <= len; k++) {
+            const char *key = k < len ? text + k : "\r";
+            for (int i = 0; i < n; i++) {
+                if (write(s[i].peer, key, 1) != 1) return 1;
+                line_fd_ready(&s[i].line);
+                drain(s[i].peer);
+                keys++;
+            }
+        }
+    }
+    double t3 = now();
+    size_t used = total_memory(s, n);
+
+    for (int i = 0; i < n; i++) {
+        int fd = s[i].line.io.in_fd;
+        line_free(&s[i].line);
+        close(fd);
+        close(s[i].peer);
+    }
+    free(s);
+
+    printf("%d sessions over socketpairs\n", n);
+    printf("  init        %8.2f us per session\n", (t1 - t0) * 1e6 / n);
+    printf("  fresh       %8zu bytes per session\n", fresh / n);
+    printf("  after %d lines %5zu bytes per session\n", SOCKET_LINES, used / n);
+    printf("  key         %8.2f us, read to frame written\n", (t3 - t2) * 1e6 / keys);
+    return 0;
+}
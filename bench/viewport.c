@@ -0,0 +1,66 @@
+// Cost of a redraw in a buffer much taller than the terminal.
+//
+// A 100 KB buffer of wrapping lines is edited on an 80x24 terminal:
+// point moves down and up through it a line or many at a time, and
+// types in the middle.  With the viewport a frame costs about one
+// screen, whatever the size of the buffer.
+#include "eline.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define VIEWPORT_BYTES 100000
+#define VIEWPORT_KEYS 20000
+
+int main(void) {
+    // Lines of 100 characters wrap once at 80 columns
+    char *text = malloc(VIEWPORT_BYTES + 128);
+    size_t len = 0;
+    for (int row = 0; len < VIEWPORT_BYTES; row++) {
+        len += snprintf(text + len, 128, "%05d the quick brown fox jumps over the lazy dog, "
+                        "then again over the sleepy dog and its cat\n", row);
+    }
+
+    // Input that never arrives, so every key is drawn
+    int in[2];
+    int null = open("/dev/null", O_WRONLY);
+    if (pipe(in) != 0 || null < 0) return 1;
+    Line line;
+    line_init_fd(&line, in[0], null);
+    line.config.use_clipboard = false;
+    line_set_columns(&line, 80);
+    line_set_rows(&line, 24);
+    line_set_terminal_caps(&line, TERM_CAP_ANSI | TERM_CAP_ICH_DCH);
+    line_begin(&line, "> ");
+    line_replace(&line, 0, 0, text, len);
+    line.point = len / 2;
+    line_flush(&line);
+    line_metrics_enable(&line, true);
+
+    static const char *keys[] = {
+        "\016", "\016", "\016", "\020", "\006", "x", "\177",  // C-n C-n C-n C-p C-f x DEL
+        "\0335\0330\016", "\0335\0330\020",                   // 50 lines down and back up
+        "\0339\0339\0339\016", "\0339\0339\0339\020",         // 999 lines down and back up
+    };
+    size_t nkeys = sizeof(keys) / sizeof(keys[0]);
+    for (int i = 0; i < VIEWPORT_KEYS; i++) {
+        line_feed(&line, keys[i % nkeys], strlen(keys[i % nkeys]));
+        line_flush(&line);
+    }
+
+    LineMetrics m;
+    line_metrics_snapshot(&line, &m);
+    unsigned long frames = m.refresh.count ? m.refresh.count : 1;
+    printf("viewport: %zu KB buffer at 80x24, %lu frames\n", len / 1000, m.refresh.count);
+    printf("  %8.1f bytes written per frame\n", (double)m.refresh_bytes / frames);
+    printf("  %8.2f us per frame, %.1f us at most\n", m.refresh.ns / 1e3 / frames, m.refresh.max_ns / 1e3);
+
+    line_free(&line);
+    close(in[0]);
+    close(in[1]);
+    close(null);
+    free(text);
+    return 0;
+}
@@ -1,16 +1,24 @@
 #include "eline.h"
 #include "keymap.h"
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 
 // TODO delete_backward_char doubles the line
 
 #define ELINES_INIT_CAP 128
+#define ELINE_HIGH_WATER_SHIFT 1    // The kept size halves with each line
+#define ELINE_TRIM_FACTOR 4         // Shrink buffers this much too big
+#define ELINE_DELTA_KEEP 65536      // Bytes of delta text kept between commands
 
 #define ANSI_CLEAR_LINE        "\033[2K"
 #define ANSI_MOVE_CURSOR_START "\033[G"
@@ -18,71 +26,550 @@
 #define ANSI_CURSOR_BACKWARD   "\033[1D"
 #define ANSI_SAVE_CURSOR       "\033[s"
 #define ANSI_RESTORE_CURSOR    "\033[u"
+#define ANSI_HINT              "\033[90m"
+#define ANSI_RESET             "\033[0m"
+#define ANSI_CLEAR_TO_END      "\033[J"
+
+#define ISEARCH_MATCH_STYLE    (LINE_STYLE_FG(36) | LINE_STYLE_REVERSE)
+#define ISEARCH_CURRENT_STYLE  (LINE_STYLE_FG(35) | LINE_STYLE_REVERSE)
+#define ISEARCH_SHOWN_QUERY    40   // Bytes of a long query shown, from its end
 
 #define MAX_ARG_DIGITS 6
 #define MAX_ARG_VALUE 999999
 
-bool mark_word_navigation = true;
-bool show_digit_argument  = true;
-bool mark_yank = true;
-bool electric_pair_mode  = true;
-bool electric_pair_mode_brackets = true;
-bool show_last_key = true; // TODO
+#define HISTORY_MAX 1000
+
+#define ELINE_OUT_INIT_CAP 256
+#define ELINE_DEFAULT_COLS 80
+#define ELINE_DEFAULT_ROWS 24
+
+const LineConfig line_default_config = {
+    .mark_word_navigation        = true,
+    .show_digit_argument         = true,
+    .mark_yank                   = true,
+    .electric_pair_mode          = true,
+    .electric_pair_mode_brackets = true,
+    .show_last_key               = true, // TODO
+    .show_paren_mode             = true,
+    .autosuggestion_mode         = true,
+    .use_clipboard               = true,
+    .undo_limit                  = 1 << 20,
+    .scroll_margin               = 2,
+    .max_fps                     = 0,
+};
+
+// Brackets of each kind, indexed like line->brackets
+static const char bracket_open[LINE_BRACKET_KINDS]  = {'(', '[', '{', '<'};
+static const char bracket_close[LINE_BRACKET_KINDS] = {')', ']', '}', '>'};
+
+// Index into line->brackets for c, or -1 if c isn't a bracket
+static int bracket_kind(Line *line, char c) {
+    for (int k = 0; k < LINE_BRACKET_KINDS; k++) {
+        if (c != bracket_open[k] && c != bracket_close[k]) continue;
+        if (c == '<' || c == '>') return line->config.electric_pair_mode_brackets ? k : -1;
+        return k;
+    }
+    return -1;
+}
+
+// Terminal output is collected per Line and written with a single write()
+static void out_append(Line *line, const char *s, size_t n) {
+    LineIO *io = &line->io;
+    if (n == 0) return;
+    if (io->out_len + n > io->out_cap) {
+        size_t cap = io->out_cap ? io->out_cap : ELINE_OUT_INIT_CAP;
+        while (cap < io->out_len + n) cap *= 2;
+        char *out = mem_realloc(&line->allocator, io->out, cap);
+        if (!out) return;
+        io->out = out;
+        io->out_cap = cap;
+    }
+    memcpy(io->out + io->out_len, s, n);
+    io->out_len += n;
+}
 
-static struct termios original_term;
+static void out_puts(Line *line, const char *s) {
+    out_append(line, s, strlen(s));
+}
 
-static int get_terminal_width() {
-    struct winsize w;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) {
-        return w.ws_col;
+static void out_printf(Line *line, const char *fmt, ...) {
+    char tmp[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(tmp)) {
+        out_append(line, tmp, n);
+        return;
     }
-    return 80; // fallback
+
+    char *big = mem_alloc(&line->allocator, n + 1);
+    if (!big) return;
+    va_start(ap, fmt);
+    vsnprintf(big, n + 1, fmt, ap);
+    va_end(ap);
+    out_append(line, big, n);
+    mem_free(&line->allocator, big);
 }
 
-// Calculate how many lines the current content takes
-static int calculate_lines_used(size_t prompt_len, size_t buffer_len) {
-    int term_width = get_terminal_width();
-    int total_chars = prompt_len + buffer_len;
-    return (total_chars + term_width - 1) / term_width; // ceiling division
+// Clock read for a trace record.  Records of one key share one read:
+// the next command starts at the last record and its edits end with it.
+static unsigned long long trace_now(Line *line) {
+    return line->trace_clock = metrics_now();
 }
 
-// Calculate cursor position in terminal coordinates
-static void calculate_cursor_position(const char *prompt, const char *buffer, size_t point, 
-                                    int *row, int *col) {
-    int term_width = get_terminal_width();
-    size_t prompt_len = strlen(prompt);
-    size_t total_pos = prompt_len + point;
-    
-    *row = total_pos / term_width;
-    *col = total_pos % term_width;
+// Record bytes read, before they are decoded.  None is the end of input.
+static void trace_input(Line *line, const char *bytes, size_t n, unsigned long long at) {
+    if (!line->trace) return;
+    if (at > line->trace_clock) line->trace_clock = at;
+    trace_begin(line->trace, TRACE_INPUT, at);
+    trace_raw(line->trace, bytes, n);
+    trace_end(line->trace);
+}
+
+static void trace_event(Line *line, TraceKind kind) {
+    if (!line->trace) return;
+    trace_begin(line->trace, kind, trace_now(line));
+    trace_end(line->trace);
+}
+
+static void trace_text(Line *line, TraceKind kind, const char *text, size_t len) {
+    if (!line->trace) return;
+    trace_begin(line->trace, kind, trace_now(line));
+    trace_raw(line->trace, text, len);
+    trace_end(line->trace);
+}
+
+static void trace_prompt(Line *line) {
+    trace_text(line, TRACE_PROMPT, line->prompt_layout.source, line->prompt_layout.source_len);
+}
+
+// Record the output added since the last time, before it is written
+static void trace_output(Line *line) {
+    LineIO *io = &line->io;
+    if (!line->trace || io->headless || io->out_traced >= io->out_len) return;
+    trace_text(line, TRACE_OUTPUT, io->out + io->out_traced, io->out_len - io->out_traced);
+    io->out_traced = io->out_len;
+}
+
+// Record a command that ran for ns from at, naming it the first time
+static void trace_command_ran(Line *line, KeyAction action, unsigned long long at, unsigned long long ns) {
+    Trace *t = line->trace;
+    bool fresh;
+    size_t index = trace_command(t, action, &fresh);
+    if (fresh) {
+        const char *key = "?", *name = "";
+        for (size_t b = 0; b < line->keymap.count; b++) {
+            if (line->keymap.bindings[b].action == action) {
+                key = line->keymap.bindings[b].notation;
+                name = line->keymap.bindings[b].description;
+                break;
+            }
+        }
+        trace_begin(t, TRACE_NAME, at);
+        trace_bytes(t, key, strlen(key));
+        trace_bytes(t, name, strlen(name));
+        trace_end(t);
+    }
+    trace_begin(t, TRACE_COMMAND, at);
+    trace_uint(t, index);
+    trace_uint(t, ns);
+    trace_end(t);
+}
+
+// Hand out to the writer thread if it is free, and time the write it
+// finished before and the keys shown by the frame handed over
+static bool pipe_send(Line *line) {
+    LineIO *io = &line->io;
+    Pipeline *p = line->pipeline;
+    LineMetrics *m = line->metrics;
+    PipelineWrite w;
+    bool had = io->out_len > 0;
+    bool handed = pipeline_send(p, &io->out, &io->out_len, &io->out_cap, &w);
+
+    if (w.done) {
+        if (m) {
+            m->writes += w.writes;
+            m->write_bytes += w.write_bytes;
+            metrics_record(&m->write, w.done_at - w.handed_at);
+            if (p->job_read_at) metrics_record(&m->key_to_screen, w.done_at - p->job_read_at);
+        }
+        p->job_read_at = 0;
+    }
+    if (handed && had) {
+        if (m && p->first_read_at) metrics_record(&m->frame_wait, metrics_now() - p->first_taken_at);
+        p->job_read_at = p->first_read_at;
+        p->first_read_at = 0;
+    }
+    return handed;
+}
+
+// Write as much of out as the fd takes without blocking.  True once all
+// of it is out, or dropped after a write error.
+static bool out_send(Line *line) {
+    LineIO *io = &line->io;
+    trace_output(line);
+    if (line->pipeline) {
+        bool idle = pipe_send(line);
+        if (io->out_len == 0) io->out_traced = 0;
+        return idle;
+    }
+    size_t start = io->out_sent;
+    bool failed = io->headless;
+    while (!failed && io->out_sent < io->out_len) {
+        ssize_t n = write(io->out_fd, io->out + io->out_sent, io->out_len - io->out_sent);
+        if (line->metrics) line->metrics->writes++;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) failed = true;
+            break;
+        }
+        io->out_sent += n;
+    }
+    if (line->metrics) line->metrics->write_bytes += io->out_sent - start;
+    if (!failed && io->out_sent < io->out_len) return false;
+    io->out_len = io->out_sent = io->out_traced = 0;
+    return true;
+}
+
+// Write all of out, waiting for the fd when it is backed up
+static void out_flush(Line *line) {
+    if (line->pipeline) {
+        while (!out_send(line)) pipeline_wait(line->pipeline);
+        pipeline_wait(line->pipeline);
+        out_send(line);
+        return;
+    }
+    while (!out_send(line)) {
+        struct pollfd p = {line->io.out_fd, POLLOUT, 0};
+        if (poll(&p, 1, -1) < 0 && errno != EINTR) {
+            line->io.out_len = line->io.out_sent = line->io.out_traced = 0;
+            break;
+        }
+    }
+}
+
+// A CSI sequence with a count, left out when it is the default of 1
+static void out_csi(Line *line, size_t n, char final) {
+    if (n == 1) out_printf(line, "\033[%c", final);
+    else out_printf(line, "\033[%zu%c", n, final);
+}
+
+// Start of a timed section, 0 when metrics are off
+static unsigned long long metrics_start(Line *line) {
+    return line->metrics ? metrics_now() : 0;
+}
+
+// Start of a command, timed for metrics and the trace.  The trace alone
+// takes it from its last record rather than reading the clock again.
+static unsigned long long command_start(Line *line) {
+    if (line->metrics) return metrics_now();
+    return line->trace ? line->trace_clock : 0;
+}
+
+// A command started at start ended, NULL for self-insert
+static void command_done(Line *line, KeyAction action, unsigned long long start) {
+    if (!start) return;
+    unsigned long long ns = (line->trace ? trace_now(line) : metrics_now()) - start;
+    if (line->metrics) {
+        metrics_record(action ? metrics_action(line->metrics, action) : &line->metrics->self_insert, ns);
+    }
+    if (line->trace) trace_command_ran(line, action, start, ns);
+}
+
+// Write out the frame of a refresh started at start, as far as the
+// terminal takes it
+static void flush_frame(Line *line, unsigned long long start) {
+    if (line->metrics) line->metrics->refresh_bytes += line->io.out_len - line->io.out_sent;
+    out_send(line);
+    if (line->metrics) metrics_stop(&line->metrics->refresh, start);
+}
+
+// Switch the terminal to a style, resetting whatever was set before
+static void out_style(Line *line, unsigned style) {
+    char sgr[32] = "\033[0";
+    size_t n = 3;
+    if (style & LINE_STYLE_BOLD)      n += snprintf(sgr + n, sizeof(sgr) - n, ";1");
+    if (style & LINE_STYLE_UNDERLINE) n += snprintf(sgr + n, sizeof(sgr) - n, ";4");
+    if (style & LINE_STYLE_REVERSE)   n += snprintf(sgr + n, sizeof(sgr) - n, ";7");
+    if (LINE_STYLE_FG(style))         n += snprintf(sgr + n, sizeof(sgr) - n, ";%u", LINE_STYLE_FG(style));
+    n += snprintf(sgr + n, sizeof(sgr) - n, "m");
+    out_append(line, sgr, n);
+}
+
+// With show_paren_mode, the bracket before or at point and its match.
+// Returns how many offsets it stored in parens.
+static size_t find_parens(Line *line, size_t parens[2], unsigned *style) {
+    if (!line->config.show_paren_mode) return 0;
+
+    // Prefer a closer just typed over an opener at point
+    size_t off = line->len;
+    int k;
+    if (line->point > 0 && (k = bracket_kind(line, line->buffer[line->point - 1])) >= 0
+        && line->buffer[line->point - 1] == bracket_close[k]) {
+        off = line->point - 1;
+    } else if (line->point < line->len && (k = bracket_kind(line, line->buffer[line->point])) >= 0
+               && line->buffer[line->point] == bracket_open[k]) {
+        off = line->point;
+    }
+    if (off == line->len) return 0;
+
+    size_t match;
+    if (!line_match_bracket(line, off, &match)) {
+        parens[0] = off;
+        *style = LINE_STYLE_FG(31) | LINE_STYLE_REVERSE;
+        return 1;
+    }
+    parens[0] = off < match ? off : match;
+    parens[1] = off < match ? match : off;
+    *style = LINE_STYLE_REVERSE;
+    return 2;
+}
+
+// Print buffer bytes in [from, to) with their highlight, emitting an SGR
+// sequence only where the style changes
+static void render_buffer(Line *line, size_t from, size_t to) {
+    Highlight *hl = &line->highlight;
+    size_t parens[2];
+    unsigned paren_style = LINE_STYLE_DEFAULT;
+    size_t paren_count = find_parens(line, parens, &paren_style);
+
+    // Search matches that overlap [from, to) start before limit
+    LineSearch *s = &line->search;
+    size_t k = s->active ? s->len : 0, m = SEARCH_NONE;
+    size_t limit = to + k > line->len + 1 ? line->len : to + k - 1;
+    if (k > 0) m = search_forward(line->buffer, limit, s->query, k, from >= k - 1 ? from - k + 1 : 0);
+
+    if (hl->count == 0 && paren_count == 0 && m == SEARCH_NONE) {
+        out_append(line, line->buffer + from, to - from);
+        return;
+    }
+
+    unsigned current = LINE_STYLE_DEFAULT;
+    size_t i = highlight_find(hl, from);
+    size_t pos = from;
+    while (pos < to) {
+        unsigned style = LINE_STYLE_DEFAULT;
+        size_t next = to;
+        while (i < hl->count && hl->spans[i].end <= pos) i++;
+        if (i < hl->count && hl->spans[i].start <= pos) {
+            style = hl->spans[i].style;
+            if (hl->spans[i].end < next) next = hl->spans[i].end;
+        } else if (i < hl->count && hl->spans[i].start < next) {
+            next = hl->spans[i].start;
+        }
+
+        // So are search matches, the current one in its own colour
+        while (m != SEARCH_NONE && m + k <= pos) m = search_forward(line->buffer, limit, s->query, k, m + k);
+        if (m != SEARCH_NONE && m <= pos) {
+            style = m == s->match && !s->failing ? ISEARCH_CURRENT_STYLE : ISEARCH_MATCH_STYLE;
+            if (m + k < next) next = m + k;
+        } else if (m != SEARCH_NONE && m < next) {
+            next = m;
+        }
+
+        // Matching brackets are drawn over the highlighter's style
+        for (size_t p = 0; p < paren_count; p++) {
+            if (parens[p] == pos) {
+                style = paren_style;
+                next = pos + 1;
+            } else if (parens[p] > pos && parens[p] < next) {
+                next = parens[p];
+            }
+        }
+
+        if (style != current) {
+            out_style(line, style);
+            current = style;
+        }
+        out_append(line, line->buffer + pos, next - pos);
+        pos = next;
+    }
+    if (current != LINE_STYLE_DEFAULT) out_puts(line, ANSI_RESET);
+}
+
+// Size used for the layout, from the terminal when there is one
+static void get_terminal_size(Line *line, int *cols, int *rows) {
+    struct winsize w;
+    *cols = line->io.cols;
+    *rows = line->io.rows;
+    if (line->io.is_tty && ioctl(line->io.out_fd, TIOCGWINSZ, &w) == 0) {
+        if (w.ws_col > 0) *cols = w.ws_col;
+        if (w.ws_row > 0) *rows = w.ws_row;
+    }
+    Trace *t = line->trace;
+    if (t && (*cols != t->cols || *rows != t->rows)) {
+        t->cols = *cols;
+        t->rows = *rows;
+        trace_begin(t, TRACE_SIZE, metrics_now());
+        trace_uint(t, *cols);
+        trace_uint(t, *rows);
+        trace_end(t);
+    }
 }
 
-static void enable_raw_mode() {
-    struct termios raw = original_term;
+static void enable_raw_mode(Line *line) {
+    LineIO *io = &line->io;
+    if (!io->is_tty || io->raw) return;
+    if (tcgetattr(io->in_fd, &io->original_term) != 0) return;
+
+    struct termios raw = io->original_term;
     raw.c_lflag &= ~(ECHO | ICANON);
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    raw.c_iflag &= ~IXON;   // C-s and C-q are keys, not flow control
+    tcsetattr(io->in_fd, TCSAFLUSH, &raw);
+    io->raw = true;
+}
+
+static void disable_raw_mode(Line *line) {
+    LineIO *io = &line->io;
+    if (!io->raw) return;
+    tcsetattr(io->in_fd, TCSAFLUSH, &io->original_term);
+    io->raw = false;
+}
+
+// Make out_fd non-blocking while a line is read, so a slow terminal
+// holds frames back instead of the editor.  end_read puts the flags back
+// after every line, they are shared with whoever else has the terminal.
+static void begin_output(Line *line) {
+    LineIO *io = &line->io;
+    if (io->headless || io->out_flags >= 0) return;
+    int flags = fcntl(io->out_fd, F_GETFL);
+    if (flags < 0 || (flags & O_NONBLOCK)) return;
+    if (fcntl(io->out_fd, F_SETFL, flags | O_NONBLOCK) == 0) io->out_flags = flags;
 }
 
-static void disable_raw_mode() {
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_term);
+static void end_output(Line *line) {
+    LineIO *io = &line->io;
+    out_flush(line);
+    if (io->out_flags < 0) return;
+    fcntl(io->out_fd, F_SETFL, io->out_flags);
+    io->out_flags = -1;
 }
 
 void line_init(Line *line) {
-    line->buffer = malloc(ELINES_INIT_CAP);
+    line_init_fd(line, STDIN_FILENO, STDOUT_FILENO);
+}
+
+// Value of an environment switch, NULL if it is unset, empty or 0
+static const char *env_switch(const char *name) {
+    const char *value = getenv(name);
+    return value && *value && strcmp(value, "0") != 0 ? value : NULL;
+}
+
+// ELINE_TRACE is a file to record to, replaced if it exists
+static void trace_to_file(Line *line, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    if (line_trace_start(line, fd)) line->trace->owns_fd = true;
+    else close(fd);
+}
+
+void line_init_fd(Line *line, int in_fd, int out_fd) {
+    line_init_with(line, in_fd, out_fd, NULL);
+}
+
+void line_init_with(Line *line, int in_fd, int out_fd, const LineAllocator *a) {
+    line->allocator = *alloc_resolve(a);
+    a = &line->allocator;
+    line->config = line_default_config;
+
+    line->io.in_fd = in_fd;
+    line->io.out_fd = out_fd;
+    line->io.is_tty = isatty(in_fd) && isatty(out_fd);
+    line->io.raw = false;
+    line->io.headless = false;
+    line->io.cols = ELINE_DEFAULT_COLS;
+    line->io.rows = ELINE_DEFAULT_ROWS;
+    line->io.lines_used = 1;
+    line->io.cursor_row = 0;
+    line->io.out = NULL;
+    line->io.out_len = line->io.out_cap = line->io.out_sent = line->io.out_traced = 0;
+    line->io.out_flags = -1;
+    line->io.frame_due = false;
+    line->io.last_frame = 0;
+    line->io.caps = termprobe_env(getenv("TERM"));
+    line->io.probed = false;
+    line->io.probe_late = false;
+    line->io.reply_len = 0;
+    line->io.shown_plain = false;
+    line->io.shown_cols = 0;
+
+    line->buffer = mem_alloc(&line->allocator, ELINES_INIT_CAP);
     line->buffer[0] = '\0';
     line->len = 0;
     line->point = 0;
     line->cap = ELINES_INIT_CAP;
+    line->high_water = 0;
     line->arg = 1;
     memset(&line->last_key, 0, sizeof(KeySequence));
 
-    initKillRing(&line->kr, 5000);
-    keymap_init(&line->keymap);
+    initKillRing(&line->kr, 5000, a);
+    memset(&line->shared_kr, 0, sizeof(SharedKillRing));
+    line->kill_unshared = false;
+    const char *ring = env_switch("ELINE_KILL_RING");
+    if (ring) line_set_shared_kill_ring(line, ring);
+    history_init(&line->history, HISTORY_MAX, a);
+    undo_init(&line->undo, a);
+    highlight_init(&line->highlight, a);
+    for (int k = 0; k < LINE_BRACKET_KINDS; k++) {
+        posindex_init(&line->brackets[k], bracket_open[k], bracket_close[k], a);
+    }
+    posindex_init(&line->newlines, '\n', -1, a);
+    line->hint = NULL;
+    line->hint_len = 0;
+    line->prompt = line->continuation_prompt = NULL;
+    prompt_init(&line->prompt_layout, a);
+    prompt_init(&line->cont_layout, a);
+    prompt_set(&line->prompt_layout, "");
+    prompt_set(&line->cont_layout, "");
+    line->prompt_fn = NULL;
+    line->prompt_data = NULL;
+    line->prompt_dirty = false;
+    line->input_complete = NULL;
+    line->input_complete_data = NULL;
+    line->edited = false;
+    line->screen_edited = false;
+    line->edit_observer = NULL;
+    line->edit_observer_data = NULL;
+    line->deltas = NULL;
+    line->delta_count = line->delta_cap = 0;
+    line->delta_text = NULL;
+    line->delta_text_len = line->delta_text_cap = 0;
+    line->reading = false;
+    line->building_arg = false;
+    line->negative_arg = false;
+    line->inserting = false;
+    line->last_command = NULL;
+    line->goal_column = 0;
+    line->view_line = line->view_row = 0;
+    line->pending_len = 0;
+    line->chord.length = 0;
+    macro_init(&line->macro, a);
+    memset(&line->search, 0, sizeof(LineSearch));
+    line->macro_status = LINE_PENDING;
+    line->typeahead = NULL;
+    line->typeahead_len = line->typeahead_pos = 0;
+    mailbox_init(&line->mailbox);
+    line->pipeline = NULL;
+    line->trace = NULL;
+    line->trace_clock = 0;
+    line->metrics = NULL;
+    if (env_switch("ELINE_METRICS")) line_metrics_enable(line, true);
+    if (env_switch("ELINE_PIPELINE")) line_pipeline_enable(line);
+    if (env_switch("ELINE_TRACE")) trace_to_file(line, getenv("ELINE_TRACE"));
+    keymap_init(&line->keymap, a);
     // Set up default key bindings
     keymap_bind(&line->keymap,	"C-a",	move_beginning_of_line, "Move to beginning of line");
     keymap_bind(&line->keymap,	"C-e",	move_end_of_line,		"Move to end of line");
     keymap_bind(&line->keymap,	"C-b",	backward_char,		    "Move backward one character");
     keymap_bind(&line->keymap,	"C-f",	forward_char,		    "Move forward one character");
+    keymap_bind(&line->keymap,	"LEFT",	backward_char,		    "Move backward one character");
+    keymap_bind(&line->keymap,	"RIGHT",	forward_char,		    "Move forward one character");
+    keymap_bind(&line->keymap,	"C-p",	previous_line,		    "Move cursor vertically up ARG lines.");
+    keymap_bind(&line->keymap,	"C-n",	next_line,		        "Move cursor vertically down ARG lines.");
+    keymap_bind(&line->keymap,	"UP",	previous_line,		    "Move cursor vertically up ARG lines.");
+    keymap_bind(&line->keymap,	"DOWN",	next_line,		        "Move cursor vertically down ARG lines.");
     keymap_bind(&line->keymap,	"C-d",	delete_char,		    "Delete character at point");
     keymap_bind(&line->keymap,	"DEL",	delete_backward_char,   "Delete backward character");
     keymap_bind(&line->keymap,	"C-h",	delete_backward_char,   "Delete backward character");
@@ -97,6 +584,13 @@ void line_init(Line *line) {
     keymap_bind(&line->keymap,	"M-d",	kill_word,		    "Kill characters forward until encountering the end of a word.");
     keymap_bind(&line->keymap,	"C-y",	yank,		        "Reinsert the last stretch of killed text.");
     keymap_bind(&line->keymap,	"C-k",	kill_line,		    "Kill the rest of the current line; if no nonblanks there, kill thru newline.");
+    keymap_bind(&line->keymap,	"C-_",	undo,		        "Undo some previous changes."); // Also C-/
+    keymap_bind(&line->keymap,	"C-M-_",	redo,		        "Redo the last undone changes.");
+    keymap_bind(&line->keymap,	"C-s",	isearch_forward,	"Search forward incrementally for a string.");
+    keymap_bind(&line->keymap,	"C-r",	isearch_backward,	"Search backward incrementally for a string.");
+    keymap_bind(&line->keymap,	"C-x (",	start_kbd_macro,	"Record subsequent keyboard input, defining a keyboard macro.");
+    keymap_bind(&line->keymap,	"C-x )",	end_kbd_macro,		"Finish defining a keyboard macro.");
+    keymap_bind(&line->keymap,	"C-x e",	call_last_kbd_macro,	"Call the last keyboard macro, ARG times.");
 
     keymap_bind(&line->keymap, "M-0", digit_argument, "Digit argument 0");
     keymap_bind(&line->keymap, "M-1", digit_argument, "Digit argument 1");
@@ -108,72 +602,339 @@ void line_init(Line *line) {
     keymap_bind(&line->keymap, "M-7", digit_argument, "Digit argument 7");
     keymap_bind(&line->keymap, "M-8", digit_argument, "Digit argument 8");
     keymap_bind(&line->keymap, "M-9", digit_argument, "Digit argument 9");
+}
+
+void line_init_headless(Line *line) {
+    line_init_headless_with(line, NULL);
+}
+
+void line_init_headless_with(Line *line, const LineAllocator *a) {
+    line_init_with(line, -1, -1, a);
+    line->io.headless = true;
+    // Batch edits must not touch the system clipboard
+    line->config.use_clipboard = false;
+}
 
-    keymap_print_bindings(&line->keymap);
+void line_set_default_allocator(const LineAllocator *a) {
+    alloc_set_default(a);
 }
 
 void line_free(Line *line) {
-    free(line->buffer);
+    // ELINE_METRICS is a file to append the metrics to, or 1 for stderr
+    const char *dest = env_switch("ELINE_METRICS");
+    if (line->metrics && dest) {
+        FILE *f = strcmp(dest, "1") == 0 ? stderr : fopen(dest, "a");
+        if (f) {
+            metrics_dump(line->metrics, &line->keymap, f);
+            if (f != stderr) fclose(f);
+        }
+    }
+    line_pipeline_disable(line);
+    // A line left unfinished still has the terminal
+    end_output(line);
+    disable_raw_mode(line);
+    line_trace_stop(line);
+    line_metrics_enable(line, false);
+    skr_close(&line->shared_kr);
+
+    mem_free(&line->allocator, line->buffer);
     line->buffer = NULL;
     line->len = line->point = line->cap = 0;
     keymap_free(&line->keymap);
+    history_free(&line->history);
+    line->hint = NULL;
+    line->hint_len = 0;
+    mem_free(&line->allocator, line->typeahead);
+    line->typeahead = NULL;
+    line->typeahead_len = line->typeahead_pos = 0;
+    freeKillRing(&line->kr);
+    undo_free(&line->undo);
+    macro_free(&line->macro);
+    mem_free(&line->allocator, line->search.query);
+    mem_free(&line->allocator, line->search.last);
+    mem_free(&line->allocator, line->search.steps);
+    memset(&line->search, 0, sizeof(LineSearch));
+    highlight_free(&line->highlight);
+    for (int k = 0; k < LINE_BRACKET_KINDS; k++) posindex_free(&line->brackets[k]);
+    posindex_free(&line->newlines);
+    prompt_free(&line->prompt_layout);
+    prompt_free(&line->cont_layout);
+    mailbox_free(&line->mailbox);
+    mem_free(&line->allocator, line->deltas);
+    mem_free(&line->allocator, line->delta_text);
+    line->deltas = NULL;
+    line->delta_text = NULL;
+    line->delta_count = line->delta_cap = line->delta_text_len = line->delta_text_cap = 0;
+    mem_free(&line->allocator, line->io.out);
+    line->io.out = NULL;
+    line->io.out_len = line->io.out_cap = 0;
+}
+
+size_t line_memory_usage(const Line *line) {
+    size_t brackets = 0;
+    for (int k = 0; k < LINE_BRACKET_KINDS; k++) brackets += posindex_memory_usage(&line->brackets[k]);
+    return sizeof(Line)
+        + (line->metrics ? sizeof(LineMetrics) : 0)
+        + (line->pipeline ? sizeof(Pipeline) + line->pipeline->job_cap : 0)
+        + (line->trace ? sizeof(Trace) + trace_memory_usage(line->trace) : 0)
+        + brackets
+        + posindex_memory_usage(&line->newlines)
+        + prompt_memory_usage(&line->prompt_layout)
+        + prompt_memory_usage(&line->cont_layout)
+        + line->cap
+        + line->io.out_cap
+        + line->typeahead_len
+        + keymap_memory_usage(&line->keymap)
+        + kr_memory_usage(&line->kr)
+        + history_memory_usage(&line->history)
+        + undo_memory_usage(&line->undo)
+        + macro_memory_usage(&line->macro)
+        + line->search.cap + line->search.last_len
+        + line->search.step_cap * sizeof(SearchStep)
+        + line->delta_cap * sizeof(LineDelta) + line->delta_text_cap
+        + highlight_memory_usage(&line->highlight);
+}
+
+void line_set_columns(Line *line, int cols) {
+    if (cols > 0) line->io.cols = cols;
+}
+
+void line_set_rows(Line *line, int rows) {
+    if (rows > 0) line->io.rows = rows;
+}
+
+unsigned line_terminal_caps(Line *line) {
+    return line->io.caps;
+}
+
+void line_set_terminal_caps(Line *line, unsigned caps) {
+    line->io.caps = caps;
+    line->io.probed = true;
+    line->io.shown_plain = false;
+}
+
+void line_metrics_enable(Line *line, bool enable) {
+    if (!enable) {
+        mem_free(&line->allocator, line->metrics);
+        line->metrics = NULL;
+    } else if (!line->metrics) {
+        line->metrics = mem_calloc(&line->allocator, sizeof(LineMetrics));
+    }
+}
+
+bool line_metrics_snapshot(const Line *line, LineMetrics *out) {
+    if (!line->metrics) return false;
+    *out = *line->metrics;
+    return true;
+}
+
+void line_set_highlighter(Line *line, LineHighlighter fn, void *userdata) {
+    highlight_set(&line->highlight, fn, userdata);
+}
+
+void line_set_input_complete(Line *line, LineInputComplete fn, void *userdata) {
+    line->input_complete = fn;
+    line->input_complete_data = userdata;
+}
+
+void line_set_edit_observer(Line *line, LineEditObserver fn, void *userdata) {
+    line->edit_observer = fn;
+    line->edit_observer_data = userdata;
+    line->delta_count = line->delta_text_len = 0;
+}
+
+void line_set_continuation_prompt(Line *line, const char *prompt) {
+    line->continuation_prompt = prompt;
+    prompt_set(&line->cont_layout, prompt);
+}
+
+bool line_set_shared_kill_ring(Line *line, const char *path) {
+    skr_close(&line->shared_kr);
+    line->kill_unshared = false;
+    return path ? skr_open(&line->shared_kr, path) : true;
+}
+
+void line_history_add(Line *line, const char *entry) {
+    if (entry) trace_text(line, TRACE_HISTORY, entry, strlen(entry));
+    history_add(&line->history, entry);
+}
+
+// Recompute the autosuggestion for the current buffer.  Like fish and
+// zsh, it is only offered with point at the end of the line.
+static void update_hint(Line *line) {
+    line->hint = NULL;
+    line->hint_len = 0;
+    if (!line->config.autosuggestion_mode || line->point != line->len) return;
+
+    const HistoryEntry *e = history_suggest(&line->history, line->buffer, line->len);
+    if (e) {
+        line->hint = e->text + line->len;
+        line->hint_len = e->len - line->len;
+    }
 }
 
 // Helper function to get the closing pair for a character
-char get_closing_pair(char c) {
+char get_closing_pair(Line *line, char c) {
     switch (c) {
         case '(': return ')';
         case '[': return ']';
         case '{': return '}';
-        case '<': return electric_pair_mode_brackets ? '>' : '\0';
+        case '<': return line->config.electric_pair_mode_brackets ? '>' : '\0';
         default: return '\0';
     }
 }
 
+// Pair an opening bracket unless a lone one fixes an unmatched closer
+// after point.  Writing P(k) for the depth after the k-th bracket, a
+// closer is unmatched when it takes P below every depth before it.
+bool should_insert_pair(Line *line, char c) {
+    if (!line->config.electric_pair_mode) return false;
+    int k = bracket_kind(line, c);
+    if (k < 0) return true;
+
+    PosIndex *x = &line->brackets[k];
+    size_t rank = posindex_rank(x, line->point);
+    return posindex_first_below(x, rank, posindex_min_prefix(x, rank)) == POSINDEX_NONE;
+}
 
-bool should_insert_pair() {
-    if (!electric_pair_mode) return false;
-    // TODO Check for unbalanced pairs and return false
-    return true;
+// Grow an edit range, the one handed to input_complete or the one the
+// next frame draws, to cover a replacement of [start, end) by len bytes.
+// Outside the range the buffer only moved, by the same amount since the
+// range was started.
+static void track_edit(LineEdit *e, bool *edited, size_t start, size_t end, size_t len) {
+    if (!*edited) {
+        *e = (LineEdit){start, end, start + len};
+        *edited = true;
+        return;
+    }
+    if (start < e->start) e->start = start;
+    if (end > e->new_end) {
+        // Bytes past the range are where they were, shifted by the same
+        e->old_end += end - e->new_end;
+        e->new_end = start + len;
+    } else {
+        e->new_end = e->new_end - (end - start) + len;
+    }
 }
 
-void insert(Line *line, char c) {
-    if (line->len + 1 >= line->cap) {
-        line->cap *= 2;
-        line->buffer = realloc(line->buffer, line->cap);
+// Keep a change for edit_observer.  An insertion right after the one
+// before it extends that one, so typed and yanked runs stay one delta.
+static void record_delta(Line *line, size_t start, size_t removed, const char *text, size_t len) {
+    if (removed == 0 && len == 0) return;
+    LineDelta *prev = line->delta_count > 0 ? &line->deltas[line->delta_count - 1] : NULL;
+    bool extend = prev && removed == 0 && start == prev->offset + prev->inserted_len;
+    if (!extend && line->delta_count == line->delta_cap) {
+        size_t cap = line->delta_cap ? line->delta_cap * 2 : 8;
+        LineDelta *grown = mem_realloc(&line->allocator, line->deltas, cap * sizeof(LineDelta));
+        if (!grown) return;
+        line->deltas = grown;
+        line->delta_cap = cap;
     }
-    
-    // Check if we should insert a pair
-    char closing_char = '\0';
-    if (should_insert_pair()) {
-        closing_char = get_closing_pair(c);
-        
-        // Make sure we have enough space for both characters
-        if (line->len + 2 >= line->cap) {
-            line->cap *= 2;
-            line->buffer = realloc(line->buffer, line->cap);
-        }
+    if (line->delta_text_len + len > line->delta_text_cap) {
+        size_t cap = line->delta_text_cap ? line->delta_text_cap : 64;
+        while (cap < line->delta_text_len + len) cap *= 2;
+        char *grown = mem_realloc(&line->allocator, line->delta_text, cap);
+        if (!grown) return;
+        line->delta_text = grown;
+        line->delta_text_cap = cap;
     }
-    
-    // Insert the opening character
-    memmove(line->buffer + line->point + 1, line->buffer + line->point, line->len - line->point);
-    line->buffer[line->point] = c;
-    line->len++;
-    line->point++;
-    
-    // Insert the closing character if needed
-    if (closing_char != '\0') {
-        memmove(line->buffer + line->point + 1, line->buffer + line->point, line->len - line->point);
-        line->buffer[line->point] = closing_char;
-        line->len++;
-        // Don't advance point - leave cursor between the pair
+    if (len > 0) memcpy(line->delta_text + line->delta_text_len, text, len);
+    line->delta_text_len += len;
+
+    if (extend) line->deltas[line->delta_count - 1].inserted_len += len;
+    else line->deltas[line->delta_count++] = (LineDelta){start, removed, NULL, len};
+}
+
+// At the end of the command that made them
+static void trace_edits(Trace *t, const LineEditBatch *batch, unsigned long long at) {
+    trace_begin(t, TRACE_EDIT, at);
+    trace_uint(t, batch->count);
+    for (size_t i = 0; i < batch->count; i++) {
+        const LineDelta *d = &batch->deltas[i];
+        trace_uint(t, d->offset);
+        trace_uint(t, d->removed);
+        trace_bytes(t, d->inserted, d->inserted_len);
     }
-    
+    trace_uint(t, batch->point);
+    trace_end(t);
+}
+
+// Hand the changes of the command that just ran to edit_observer
+static void notify_edits(Line *line) {
+    if (line->delta_count == 0 || line->macro.executing) return;
+
+    // The inserted texts are back to back in the order of the deltas
+    const char *text = line->delta_text;
+    for (size_t i = 0; i < line->delta_count; i++) {
+        line->deltas[i].inserted = text;
+        text += line->deltas[i].inserted_len;
+    }
+    LineEditBatch batch = {line->deltas, line->delta_count, line->point,
+                           line->region.mark, line->region.active};
+    line->delta_count = line->delta_text_len = 0;
+    if (line->trace) trace_edits(line->trace, &batch, line->trace_clock);
+    if (line->edit_observer) line->edit_observer(&batch, line->edit_observer_data);
+
+    if (line->delta_text_cap > ELINE_DELTA_KEEP) {
+        mem_free(&line->allocator, line->delta_text);
+        line->delta_text = NULL;
+        line->delta_text_cap = 0;
+    }
+}
+
+// Every change of the buffer goes through here.  Replaces the bytes in
+// [start, end) with len bytes of text, which must not point into the
+// buffer.  Point is left to the caller.
+void line_replace(Line *line, size_t start, size_t end, const char *text, size_t len) {
+    size_t removed = end - start;
+
+    undo_record(&line->undo, start, line->buffer + start, removed, len,
+                line->point, line->config.undo_limit);
+    highlight_edit(&line->highlight, start, end, len);
+    for (int k = 0; k < LINE_BRACKET_KINDS; k++) {
+        posindex_delete(&line->brackets[k], start, removed);
+        posindex_insert(&line->brackets[k], start, text, len);
+    }
+    posindex_delete(&line->newlines, start, removed);
+    posindex_insert(&line->newlines, start, text, len);
+    track_edit(&line->edit, &line->edited, start, end, len);
+    track_edit(&line->screen_edit, &line->screen_edited, start, end, len);
+    if (line->edit_observer || line->trace) record_delta(line, start, removed, text, len);
+
+    if (line->len - removed + len >= line->cap) {
+        while (line->len - removed + len >= line->cap) line->cap *= 2;
+        line->buffer = mem_realloc(&line->allocator, line->buffer, line->cap);
+    }
+
+    memmove(line->buffer + start + len, line->buffer + end, line->len - end);
+    if (len > 0) memcpy(line->buffer + start, text, len);
+    line->len = line->len - removed + len;
     line->buffer[line->len] = '\0';
 }
 
+void insert(Line *line, char c) {
+    char text[2] = {c, '\0'};
+    size_t len = 1;
+
+    // Check if we should insert a pair
+    if (should_insert_pair(line, c)) {
+        text[1] = get_closing_pair(line, c);
+        if (text[1] != '\0') len = 2;
+    }
+
+    // Don't advance point past a closing char - leave cursor between the pair
+    line_replace(line, line->point, line->point, text, len);
+    line->point++;
+}
+
+// Insert text at point as is, without electric pairs
+void insert_text(Line *line, const char *text, size_t len) {
+    line_replace(line, line->point, line->point, text, len);
+    line->point += len;
+}
+
 bool should_delete_pair(Line *line) {
-    if (!electric_pair_mode || line->point == 0 || line->point >= line->len) {
+    if (!line->config.electric_pair_mode || line->point == 0 || line->point >= line->len) {
         return false;
     }
     
@@ -181,18 +942,73 @@ bool should_delete_pair(Line *line) {
     char next_char = line->buffer[line->point];
     
     // Check if we have a matching pair
-    switch (prev_char) {
-        case '(':
-            return next_char == ')';
-        case '[':
-            return next_char == ']';
-        case '{':
-            return next_char == '}';
-        case '<':
-            return electric_pair_mode_brackets && next_char == '>';
-        default:
-            return false;
+    int k = bracket_kind(line, prev_char);
+    if (k < 0 || prev_char != bracket_open[k] || next_char != bracket_close[k]) return false;
+
+    // Deleting the opener alone is better when nothing after the pair
+    // goes back down to the depth before it, as the closer then matches
+    // an earlier opener that is unmatched now
+    PosIndex *x = &line->brackets[k];
+    size_t rank = posindex_rank(x, line->point - 1);
+    return posindex_first_below(x, rank + 1, posindex_min_prefix(x, rank) + 1) != POSINDEX_NONE;
+}
+
+bool line_match_bracket(Line *line, size_t off, size_t *match) {
+    if (off >= line->len) return false;
+    char c = line->buffer[off];
+    int k = bracket_kind(line, c);
+    if (k < 0) return false;
+
+    PosIndex *x = &line->brackets[k];
+    size_t rank = posindex_rank(x, off);
+    long before = posindex_prefix(x, rank);
+    size_t found;
+    if (c == bracket_open[k]) {
+        // First bracket after it that takes the depth back to before
+        found = posindex_first_below(x, rank + 1, before + 1);
+    } else {
+        // The opener right after the last bracket at or below its depth
+        long depth = before - 1;
+        found = posindex_last_at_most(x, rank, depth);
+        if (found != POSINDEX_NONE) found++;
+        else if (depth == 0) found = 0;
     }
+    if (found == POSINDEX_NONE) return false;
+    *match = posindex_select(x, found);
+    return true;
+}
+
+bool line_bracket_unbalanced(Line *line, size_t off) {
+    size_t match;
+    if (off >= line->len || bracket_kind(line, line->buffer[off]) < 0) return false;
+    return !line_match_bracket(line, off, &match);
+}
+
+size_t line_line_count(Line *line) {
+    return posindex_count(&line->newlines) + 1;
+}
+
+size_t line_line_start(Line *line, size_t lnum) {
+    return lnum == 0 ? 0 : posindex_select(&line->newlines, lnum - 1) + 1;
+}
+
+size_t line_line_end(Line *line, size_t lnum) {
+    if (lnum >= posindex_count(&line->newlines)) return line->len;
+    return posindex_select(&line->newlines, lnum);
+}
+
+void line_offset_to_line_col(Line *line, size_t off, size_t *lnum, size_t *col) {
+    if (off > line->len) off = line->len;
+    *lnum = posindex_rank(&line->newlines, off);
+    *col = off - line_line_start(line, *lnum);
+}
+
+size_t line_line_col_to_offset(Line *line, size_t lnum, size_t col) {
+    size_t count = line_line_count(line);
+    if (lnum >= count) lnum = count - 1;
+    size_t start = line_line_start(line, lnum);
+    size_t end = line_line_end(line, lnum);
+    return col < end - start ? start + col : end;
 }
 
 void delete_backward_char(Line *line) {
@@ -202,24 +1018,17 @@ void delete_backward_char(Line *line) {
     
     if (delete_pair) {
         // Delete both characters (opening and closing)
-        memmove(line->buffer + line->point - 1, line->buffer + line->point + 1, line->len - line->point - 1);
-        line->len -= 2;
-        line->point--;
+        line_replace(line, line->point - 1, line->point + 1, "", 0);
     } else {
         // Delete just the previous character
-        memmove(line->buffer + line->point - 1, line->buffer + line->point, line->len - line->point);
-        line->len--;
-        line->point--;
+        line_replace(line, line->point - 1, line->point, "", 0);
     }
-    
-    line->buffer[line->len] = '\0';
+    line->point--;
 }
 
 void delete_char(Line *line) {
     if (line->point == line->len) return;
-    memmove(line->buffer + line->point, line->buffer + line->point + 1, line->len - line->point - 1);
-    line->len--;
-    line->buffer[line->len] = '\0';
+    line_replace(line, line->point, line->point + 1, "", 0);
 }
 
 void backward_char(Line *line) {
@@ -229,6 +1038,13 @@ void backward_char(Line *line) {
 }
 
 void forward_char(Line *line) {
+    // At the end of the line, accept the autosuggestion.  The one on
+    // screen may be older than the buffer, look it up again.
+    if (line->point == line->len) update_hint(line);
+    if (line->point == line->len && line->hint_len > 0) {
+        insert_text(line, line->hint, line->hint_len);
+        return;
+    }
     for (int i = 0; i < line->arg; i++) {
         if (line->point < line->len) line->point++;
     }
@@ -295,7 +1111,7 @@ void forward_word(Line *line) {
     arg = abs(arg);
 
     // Precise word marking behavior
-    if (mark_word_navigation) {
+    if (line->config.mark_word_navigation) {
         if (direction > 0) {
             // Forward word marking:
             // 1. Find where we'll end up
@@ -337,29 +1153,38 @@ void backward_word(Line *line) {
     line->arg = abs(line->arg);
 }
 
-void kill_line(Line *line) {
-    if (line->point >= line->len) {
-        // If at end of line, do nothing (or could kill newline in multi-line context)
-        return;
+// Push killed text to the kill ring and, if enabled, the shared ring
+// and the system clipboard
+static void kill_text(Line *line, const char *text) {
+    kr_push(&line->kr, text);
+    if (line->shared_kr.map) {
+        // Too long to share, yank it from here until someone else kills
+        line->kill_unshared = !skr_push(&line->shared_kr, text, strlen(text));
+        line->kill_unshared_head = skr_head(&line->shared_kr);
     }
-    
-    // Calculate how much text to kill (from point to end of line)
-    size_t kill_length = line->len - line->point;
-    
-    if (kill_length > 0) {
-        // Copy the text that will be killed to kill ring
-        char* killed_text = malloc(kill_length + 1);
-        if (killed_text) {
-            memcpy(killed_text, line->buffer + line->point, kill_length);
-            killed_text[kill_length] = '\0';
-            kr_kill(&line->kr, killed_text);
-            free(killed_text);
-        }
-        
-        // Kill the line by truncating at point
-        line->buffer[line->point] = '\0';
-        line->len = line->point;
+    if (line->config.use_clipboard) {
+        if (line->metrics) line->metrics->clipboard_spawns++;
+        copy_to_clipboard(text);
+    }
+}
+
+// Kill to the end of the logical line, or the newline itself when point
+// is already there
+void kill_line(Line *line) {
+    if (line->point >= line->len) return;
+
+    size_t end = line_line_end(line, posindex_rank(&line->newlines, line->point));
+    if (end == line->point) end++;
+
+    size_t kill_length = end - line->point;
+    char* killed_text = mem_alloc(&line->allocator, kill_length + 1);
+    if (killed_text) {
+        memcpy(killed_text, line->buffer + line->point, kill_length);
+        killed_text[kill_length] = '\0';
+        kill_text(line, killed_text);
+        mem_free(&line->allocator, killed_text);
     }
+    line_replace(line, line->point, end, "", 0);
 }
 
 
@@ -383,25 +1208,37 @@ void kill_word(Line *line) {
     if (lengthToDelete == 0) return; // No word to delete if length is 0
     
     // Copy the word that will be killed
-    char* killed_text = malloc(lengthToDelete + 1);
+    char* killed_text = mem_alloc(&line->allocator, lengthToDelete + 1);
     if (killed_text) {
         memcpy(killed_text, line->buffer + start, lengthToDelete);
         killed_text[lengthToDelete] = '\0';
-        kr_kill(&line->kr, killed_text);
-        free(killed_text);
+        kill_text(line, killed_text);
+        mem_free(&line->allocator, killed_text);
     }
     
     // Remove the word from the buffer
-    memmove(line->buffer + start, line->buffer + end, line->len - end);
-    line->len -= lengthToDelete;
-    line->buffer[line->len] = '\0';
+    line_replace(line, start, end, "", 0);
 }
 
 // TODO Option to use ARG to yank N lines before or after point
 // Useful for relative lines users
 void yank(Line *line) {
-    char *clipboard_text = paste_from_clipboard();
-    if (!clipboard_text) return;
+    char *clipboard_text = NULL;
+    if (line->shared_kr.map) {
+        if (!line->kill_unshared || skr_head(&line->shared_kr) != line->kill_unshared_head) {
+            clipboard_text = skr_latest(&line->shared_kr, NULL, &line->allocator);
+        }
+    } else if (line->config.use_clipboard) {
+        if (line->metrics) line->metrics->clipboard_spawns++;
+        clipboard_text = paste_from_clipboard(&line->allocator);
+    }
+    if (!clipboard_text) {
+        // No clipboard, fall back to the last kill
+        const char *latest = kr_latest(&line->kr);
+        if (!latest) return;
+        clipboard_text = mem_strdup(&line->allocator, latest);
+        if (!clipboard_text) return;
+    }
 
     // Determine the actual text length, ignoring a trailing newline if present
     size_t len = strlen(clipboard_text);
@@ -411,16 +1248,14 @@ void yank(Line *line) {
 
     size_t original_point = line->point;
 
-    // Insert the text character by character, repeating if arg > 1
+    // Insert the text as is, repeating if arg > 1
     for (int count = 0; count < line->arg; count++) {
-        for (size_t i = 0; i < len; i++) {
-            insert(line, clipboard_text[i]);
-        }
+        insert_text(line, clipboard_text, len);
     }
 
-    if (mark_yank) line->region.mark = original_point;
+    if (line->config.mark_yank) line->region.mark = original_point;
 
-    free(clipboard_text);
+    mem_free(&line->allocator, clipboard_text);
 }
 
 
@@ -431,8 +1266,6 @@ void open_line(Line *line) {
 
 void keyboard_quit(Line *line) {
     line->arg = 1;
-    // Force a full refresh to remove any argument display
-    line_refresh(line, line->prompt);
 }
 
 void digit_argument(Line *line) {
@@ -482,12 +1315,71 @@ void digit_argument(Line *line) {
     }
 }
 
+// Undo or redo the top group of from, recording its inverse on to
+static void undo_apply(Line *line, UndoStack *from, UndoStack *to) {
+    if (from->count == 0) return;
+
+    unsigned long group = from->records[from->count - 1].group;
+    size_t point = line->point;
+    size_t new_point = point;
+    UndoRecord r;
+    const char *bytes;
+
+    line->undo.applying = true;
+    while (from->count > 0 && from->records[from->count - 1].group == group &&
+           undo_pop(from, &r, &bytes)) {
+        undo_push(to, r.offset, line->buffer + r.offset, r.inserted_len, r.removed_len, point, group);
+        line_replace(line, r.offset, r.offset + r.inserted_len, bytes, r.removed_len);
+        new_point = r.point;
+    }
+    line->undo.applying = false;
+
+    line->point = new_point;
+    if (line->region.mark > line->len) line->region.mark = line->len;
+}
+
+void undo(Line *line) {
+    for (int i = 0; i < line->arg; i++) {
+        undo_apply(line, &line->undo.undo, &line->undo.redo);
+    }
+}
+
+void redo(Line *line) {
+    for (int i = 0; i < line->arg; i++) {
+        undo_apply(line, &line->undo.redo, &line->undo.undo);
+    }
+}
+
 void move_beginning_of_line(Line *line) {
-    line->point = 0;
+    line->point = line_line_start(line, posindex_rank(&line->newlines, line->point));
 }
 
 void move_end_of_line(Line *line) {
-    line->point = line->len;
+    line->point = line_line_end(line, posindex_rank(&line->newlines, line->point));
+}
+
+// Move arg logical lines down, up if negative, keeping the column the
+// first of a run of vertical motions started from
+static void vertical_motion(Line *line, long lines) {
+    size_t lnum, col;
+    line_offset_to_line_col(line, line->point, &lnum, &col);
+    if (line->last_command != previous_line && line->last_command != next_line) {
+        line->goal_column = col;
+    }
+
+    long target = (long)lnum + lines;
+    long last = (long)line_line_count(line) - 1;
+    if (target < 0) target = 0;
+    if (target > last) target = last;
+    line->point = line_line_col_to_offset(line, target, line->goal_column);
+}
+
+void previous_line(Line *line) {
+    vertical_motion(line, -(long)line->arg);
+}
+
+void next_line(Line *line) {
+    vertical_motion(line, line->arg);
 }
 
 void set_mark(Line *line) {
@@ -512,20 +1404,18 @@ void kill_region(Line *line) {
     // Copy the killed text to kill ring
     size_t kill_length = end - start;
     if (kill_length > 0) {
-        char* killed_text = malloc(kill_length + 1);
+        char* killed_text = mem_alloc(&line->allocator, kill_length + 1);
         if (killed_text) {
             memcpy(killed_text, line->buffer + start, kill_length);
             killed_text[kill_length] = '\0';
-            kr_kill(&line->kr, killed_text);
-            free(killed_text);
+            kill_text(line, killed_text);
+            mem_free(&line->allocator, killed_text);
         }
     }
     
     // Remove the region from buffer
-    memmove(line->buffer + start, line->buffer + end, line->len - end);
-    line->len -= (end - start);
+    line_replace(line, start, end, "", 0);
     line->point = start;
-    line->buffer[line->len] = '\0';
     
     // Update mark to a valid position and deactivate region
     line->region.mark = line->point;
@@ -534,324 +1424,1610 @@ void kill_region(Line *line) {
 
 
 void clear_line(Line *line) {
+    track_edit(&line->edit, &line->edited, 0, line->len, 0);
+    track_edit(&line->screen_edit, &line->screen_edited, 0, line->len, 0);
+    if (line->edit_observer || line->trace) record_delta(line, 0, line->len, "", 0);
+    undo_clear(&line->undo);
+    highlight_reset(&line->highlight);
+    for (int k = 0; k < LINE_BRACKET_KINDS; k++) posindex_clear(&line->brackets[k]);
+    posindex_clear(&line->newlines);
     line->buffer[0] = '\0';
     line->len = 0;
     line->point = 0;
     line->region.active = false;
+    line->hint = NULL;
+    line->hint_len = 0;
 }
 
 
 
-// Handles multi-line display and wrapping
-void line_refresh(Line *line, const char *prompt) {
-    int term_width = get_terminal_width();
-    size_t prompt_len = strlen(prompt);
-    
-    // Calculate how many lines we need to clear
-    static int last_lines_used = 1;
-    
-    // Move cursor to beginning of first line and clear all lines we used before
-    printf("\r");
-    for (int i = 0; i < last_lines_used; i++) {
-        printf(ANSI_CLEAR_LINE);
-        if (i < last_lines_used - 1) {
-            printf("\033[1B"); // move down one line
-        }
-    }
-    
-    // Move back to first line
-    if (last_lines_used > 1) {
-        printf("\033[%dA", last_lines_used - 1);
+// How the buffer is laid out on screen: the prompt and digit argument
+// come before the first logical line, the continuation prompt before
+// each of the others
+typedef struct {
+    int width;
+    int height;
+    size_t lead;        // Width of the prompt and digit argument
+    size_t cont;        // Width of the continuation prompt
+} Layout;
+
+// A screen row of the layout: a logical line and a row of its wrapping
+typedef struct {
+    size_t line;
+    size_t row;
+} ViewPos;
+
+static size_t line_lead(const Layout *lay, size_t l) {
+    return l == 0 ? lay->lead : lay->cont;
+}
+
+static size_t line_rows(Line *line, const Layout *lay, size_t l) {
+    size_t n = line_line_end(line, l) - line_line_start(line, l) + line_lead(lay, l);
+    return n / lay->width + 1;
+}
+
+static bool view_before(ViewPos a, ViewPos b) {
+    return a.line < b.line || (a.line == b.line && a.row < b.row);
+}
+
+// n rows above p, stopping at the first row
+static ViewPos view_back(Line *line, const Layout *lay, ViewPos p, size_t n) {
+    while (n > p.row && p.line > 0) {
+        n -= p.row + 1;
+        p.line--;
+        p.row = line_rows(line, lay, p.line) - 1;
     }
-    printf("\r");
-    
-    // Print prompt and buffer
-    printf("%s%s", prompt, line->buffer);
-    
-    // Calculate new lines used
-    int current_lines_used = calculate_lines_used(prompt_len, line->len);
-    last_lines_used = current_lines_used;
-    
-    // After printing the content, we're at the end of all content
-    // Calculate where we actually are now
-    size_t end_pos = prompt_len + line->len;
-    int actual_row = (end_pos > 0) ? (end_pos - 1) / term_width : 0;
-    int actual_col = (end_pos > 0) ? (end_pos - 1) % term_width + 1 : 0;
-    
-    // Handle the case where we're exactly at the end of a line
-    if (end_pos > 0 && end_pos % term_width == 0) {
-        actual_row--;
-        actual_col = term_width;
+    p.row = n > p.row ? 0 : p.row - n;
+    return p;
+}
+
+// Rows from a to b, with b not before a, or limit if there are more
+static size_t view_distance(Line *line, const Layout *lay, ViewPos a, ViewPos b, size_t limit) {
+    size_t d = 0;
+    while (a.line < b.line && d < limit) {
+        d += line_rows(line, lay, a.line) - a.row;
+        a.line++;
+        a.row = 0;
     }
-    
-    // Calculate where cursor should be
-    int cursor_row, cursor_col;
-    calculate_cursor_position(prompt, line->buffer, line->point, &cursor_row, &cursor_col);
-    
-    // Move from where we are to where we need to be
-    int row_diff = actual_row - cursor_row;
-    int col_diff = actual_col - cursor_col;
-    
-    // Move vertically first
-    if (row_diff > 0) {
-        printf("\033[%dA", row_diff); // Move up
-    } else if (row_diff < 0) {
-        printf("\033[%dB", -row_diff); // Move down
+    if (a.line == b.line) d += b.row - a.row;
+    return d < limit ? d : limit;
+}
+
+// Rows from p to the end of the buffer, p's included, at most limit
+static size_t view_rows_after(Line *line, const Layout *lay, ViewPos p, size_t limit) {
+    size_t lines = line_line_count(line), d = 0;
+    for (; p.line < lines && d < limit; p.line++, p.row = 0) {
+        d += line_rows(line, lay, p.line) - p.row;
     }
-    
-    // Move horizontally
-    if (col_diff > 0) {
-        printf("\033[%dD", col_diff); // Move left
-    } else if (col_diff < 0) {
-        printf("\033[%dC", -col_diff); // Move right
+    return d < limit ? d : limit;
+}
+
+// Scroll the viewport so point is on screen with scroll_margin rows
+// around it where the buffer has them.  Only rows near the old top and
+// point are looked at, so this costs the terminal height, not the buffer.
+static ViewPos scroll_view(Line *line, const Layout *lay) {
+    size_t lines = line_line_count(line);
+    ViewPos top = {line->view_line, line->view_row};
+    if (top.line >= lines) top = (ViewPos){lines - 1, 0};
+    size_t rows = line_rows(line, lay, top.line);
+    if (top.row >= rows) top.row = rows - 1;
+
+    ViewPos point;
+    point.line = posindex_rank(&line->newlines, line->point);
+    point.row = (line_lead(lay, point.line) + line->point
+                 - line_line_start(line, point.line)) / lay->width;
+
+    size_t h = lay->height, margin = line->config.scroll_margin;
+    if (margin > (h - 1) / 2) margin = (h - 1) / 2;
+    size_t below = view_rows_after(line, lay, point, margin + 1) - 1;
+    size_t bottom = h - 1 - below;
+
+    if (view_before(point, top)) {
+        top = view_back(line, lay, point, margin);
+    } else {
+        size_t d = view_distance(line, lay, top, point, h);
+        if (d < margin) top = view_back(line, lay, point, margin);
+        else if (d > bottom) top = view_back(line, lay, point, bottom);
     }
-    
-    fflush(stdout);
+
+    // Use the whole screen when the end of the buffer is in view
+    size_t shown = view_rows_after(line, lay, top, h);
+    if (shown < h) top = view_back(line, lay, top, h - shown);
+
+    // Never start in the middle of a prompt
+    if (top.row * lay->width < line_lead(lay, top.line)) top.row = 0;
+    line->view_line = top.line;
+    line->view_row = top.row;
+    return top;
 }
 
-// Special refresh for showing digit arguments that preserves cursor position
-void line_refresh_with_arg(Line *line, const char *prompt, int arg, bool negative) {
-    // We need to do a full refresh since the argument display changes the layout
-    int term_width = get_terminal_width();
-    size_t prompt_len = strlen(prompt);
-    
-    // Calculate how many lines we need to clear
-    static int last_lines_used_arg = 1;
-    
-    // Move cursor to beginning of first line and clear all lines we used before
-    printf("\r");
-    for (int i = 0; i < last_lines_used_arg; i++) {
-        printf(ANSI_CLEAR_LINE);
-        if (i < last_lines_used_arg - 1) {
-            printf("\033[1B"); // move down one line
+// Move the cursor along the row of a plain frame from buffer offset
+// from to offset to, each byte a column.  Short moves right print the
+// bytes that are already there, short moves left use backspaces.
+static void move_cursor(Line *line, size_t from, size_t to) {
+    if (to < from) {
+        if (from - to <= 4) {
+            for (size_t i = from; i > to; i--) out_puts(line, "\b");
+        } else {
+            out_csi(line, from - to, 'D');
         }
+    } else if (to > from) {
+        if (to - from <= 4) out_append(line, line->buffer + from, to - from);
+        else out_csi(line, to - from, 'C');
     }
-    
-    // Move back to first line
-    if (last_lines_used_arg > 1) {
-        printf("\033[%dA", last_lines_used_arg - 1);
+}
+
+// Whether the frame fits one row with nothing but the prompt and the
+// buffer's bytes, which is what draw_edit can update in place
+static bool frame_plain(Line *line, size_t lead, int width, const char *arg_display, bool show_hint) {
+    size_t parens[2];
+    unsigned style;
+    return !arg_display && !(show_hint && line->hint_len > 0)
+        && lead + line->len < (size_t)width
+        && posindex_count(&line->newlines) == 0
+        && line->highlight.count == 0
+        && find_parens(line, parens, &style) == 0;
+}
+
+// Turn the last frame into this one with the edit since then.  The
+// bytes after the edit are shifted with ICH or DCH where the terminal
+// has them and reprinted where it doesn't, text added at the end is
+// just echoed.
+static void draw_edit(Line *line) {
+    LineIO *io = &line->io;
+    size_t at = io->shown_point;
+    if (line->screen_edited) {
+        LineEdit e = line->screen_edit;
+        size_t removed = e.old_end - e.start, added = e.new_end - e.start;
+        size_t same = removed < added ? removed : added;
+        bool tail = e.old_end < io->shown_len;
+        bool shift = io->caps & TERM_CAP_ICH_DCH;
+
+        move_cursor(line, at, e.start);
+        out_append(line, line->buffer + e.start, same);
+        at = e.start + same;
+        if (added > removed) {
+            size_t n = added - removed;
+            if (tail && shift) out_csi(line, n, '@');
+            if (tail && !shift) n = line->len - at;
+            out_append(line, line->buffer + at, n);
+            at += n;
+        } else if (removed > added) {
+            if (!tail) {
+                out_puts(line, "\033[K");
+            } else if (shift) {
+                out_csi(line, removed - added, 'P');
+            } else {
+                out_append(line, line->buffer + at, line->len - at);
+                out_puts(line, "\033[K");
+                at = line->len;
+            }
+        }
     }
-    printf("\r");
-    
-    // Create the argument display string
+    move_cursor(line, at, line->point);
+}
+
+// A terminal without cursor addressing only gets CR, BS and text: the
+// logical line at point on one row, scrolled sideways to keep point in
+// view, with spaces over what the last frame had past its end
+static void draw_dumb(Line *line, const char *arg_display, int width) {
+    LineIO *io = &line->io;
+    size_t l = posindex_rank(&line->newlines, line->point);
+    size_t from = line_line_start(line, l), to = line_line_end(line, l);
+    out_puts(line, "\r");
+
+    // Only the last row of a prompt wider than the terminal, without escapes
+    PromptLayout *p = l == 0 ? &line->prompt_layout : &line->cont_layout;
+    size_t skip = prompt_last_row(p, width);
+    out_append(line, p->visible + skip, p->visible_len - skip);
+    size_t cols = p->width % width;
+    if (l == 0 && arg_display) {
+        out_puts(line, arg_display);
+        cols += strlen(arg_display);
+    }
+
+    // Leave the last column alone, writing there wraps on some terminals
+    size_t room = (size_t)width > cols + 1 ? width - cols - 1 : 1;
+    size_t first = line->point - from >= room ? line->point - room + 1 : from;
+    size_t last = to - first > room ? first + room : to;
+    out_append(line, line->buffer + first, last - first);
+    cols += last - first;
+
+    size_t end = cols;
+    for (; end < io->shown_cols; end++) out_puts(line, " ");
+    for (; end > cols - (last - line->point); end--) out_puts(line, "\b");
+    io->shown_cols = cols;
+}
+
+// Draw the rows of the viewport from the first row of the last frame:
+// the prompts that are in view, the buffer with its newlines as row
+// breaks and the hint after it, then put the cursor at point.  A logical
+// line of x columns takes x / width + 1 rows, the last one empty after an
+// exactly full row so the cursor has somewhere to go.
+static void draw_rows(Line *line, const char *arg_display, bool show_hint, const Layout *lay) {
+    LineIO *io = &line->io;
+    size_t width = lay->width;
+
+    // Clear the last frame from its first row down
+    if (io->cursor_row > 0) out_printf(line, "\033[%dA", io->cursor_row);
+    out_puts(line, "\r" ANSI_CLEAR_TO_END);
+
+    ViewPos top = scroll_view(line, lay);
+
+    size_t lines = line_line_count(line);
+    size_t point_line = posindex_rank(&line->newlines, line->point);
+    int row = 0, cursor_row = 0, cursor_col = 0;
+    size_t l = top.line, k = top.row, x = 0;
+    bool at_end = false;
+    for (; l < lines && row < lay->height; l++, k = 0) {
+        size_t from = line_line_start(line, l);
+        size_t to = line_line_end(line, l);
+        size_t lead = line_lead(lay, l);
+        size_t total = lead + (to - from);
+        size_t rows = total / width + 1;
+        if (l == point_line) {
+            size_t cx = lead + (line->point - from);
+            cursor_row = row + (int)(cx / width - k);
+            cursor_col = cx % width;
+        }
+
+        for (; k < rows && row < lay->height; k++, row++) {
+            if (row > 0) out_puts(line, "\r\n");
+            size_t c0 = k * width;
+            if (k == 0 && lead > 0) {
+                if (l == 0) {
+                    out_append(line, line->prompt_layout.text, line->prompt_layout.len);
+                    if (arg_display) out_puts(line, arg_display);
+                } else {
+                    out_append(line, line->cont_layout.text, line->cont_layout.len);
+                }
+                if (lead % width == 0) out_puts(line, "\r\n");
+                k = lead / width;
+                row += k;
+                c0 = lead;
+            }
+            size_t c1 = (k + 1) * width < total ? (k + 1) * width : total;
+            render_buffer(line, from + c0 - lead, from + c1 - lead);
+            x = c1 - k * width;
+        }
+        at_end = l + 1 == lines && k == rows;
+    }
+    if (cursor_row >= lay->height) cursor_row = lay->height - 1;
+
+    // The autosuggestion carries on from the end of the buffer, clipped
+    // to the screen like the rest
+    if (at_end && show_hint && line->hint_len > 0) {
+        const char *hint = line->hint, *end = line->hint + line->hint_len;
+        out_puts(line, ANSI_HINT);
+        while (hint < end) {
+            if (*hint == '\n' || x == width) {
+                if (row == lay->height) break;
+                out_puts(line, "\r\n");
+                row++;
+                x = 0;
+                if (*hint == '\n') hint++;
+                continue;
+            }
+            const char *nl = memchr(hint, '\n', end - hint);
+            size_t n = (nl ? nl : end) - hint;
+            if (n > width - x) n = width - x;
+            out_append(line, hint, n);
+            x += n;
+            hint += n;
+        }
+        out_puts(line, ANSI_RESET);
+    }
+
+    int end_row = row - 1;
+    if (end_row > cursor_row) out_printf(line, "\033[%dA", end_row - cursor_row);
+    out_puts(line, "\r");
+    if (cursor_col > 0) out_printf(line, "\033[%dC", cursor_col);
+
+    io->lines_used = row;
+    io->cursor_row = cursor_row;
+}
+
+// Draw a frame with the cheapest output the terminal allows: the edit
+// since the last frame when both are plain, all the rows otherwise
+static void draw(Line *line, const char *arg_display, bool show_hint) {
+    LineIO *io = &line->io;
+    unsigned long long start = metrics_start(line);
+    Layout lay;
+    get_terminal_size(line, &lay.width, &lay.height);
+    lay.lead = line->prompt_layout.width + (arg_display ? strlen(arg_display) : 0);
+    lay.cont = line->cont_layout.width;
+
+    highlight_update(&line->highlight, line->buffer, line->len);
+    bool plain = frame_plain(line, lay.lead, lay.width, arg_display, show_hint);
+    // line_begin leaves a width of 0, its prompt fits any that it is shorter than
+    bool in_place = plain && io->shown_plain && io->shown_lead == lay.lead
+                    && (io->shown_width == lay.width || io->shown_width == 0);
+    if (!(io->caps & TERM_CAP_ANSI)) {
+        draw_dumb(line, arg_display, lay.width);
+    } else if (in_place) {
+        draw_edit(line);
+    } else {
+        draw_rows(line, arg_display, show_hint, &lay);
+    }
+
+    io->shown_plain = plain;
+    io->shown_lead = lay.lead;
+    io->shown_width = lay.width;
+    io->shown_len = line->len;
+    io->shown_point = line->point;
+    line->screen_edited = false;
+    flush_frame(line, start);
+}
+
+// Make prompt the one drawn, measuring it if it is new
+// prompt_set compares the text, so a caller may rewrite the same buffer.
+// line->prompt stays the layout's copy, the old one if the new one
+// couldn't be allocated.
+static void use_prompt(Line *line, const char *prompt) {
+    // The screen has the old one, the next frame can't be an edit
+    if (prompt_set(&line->prompt_layout, prompt)) {
+        line->io.shown_plain = false;
+        if (line->reading) trace_prompt(line);
+    }
+    line->prompt = line->prompt_layout.source;
+}
+
+void line_refresh(Line *line, const char *prompt) {
+    if (line->io.headless || line->macro.executing) return;
+    use_prompt(line, prompt);
+    draw(line, NULL, true);
+}
+
+// Refresh showing the digit argument being typed after the prompt
+void line_refresh_with_arg(Line *line, const char *prompt, int arg, bool negative) {
+    if (line->io.headless || line->macro.executing) return;
+    use_prompt(line, prompt);
+
     char arg_display[32];
     if (negative && arg == 0) {
         snprintf(arg_display, sizeof(arg_display), "(arg: -) ");
     } else {
         snprintf(arg_display, sizeof(arg_display), "(arg: %s%d) ", negative ? "-" : "", arg);
     }
-    
-    // Print prompt with argument display and buffer
-    printf("%s%s%s", prompt, arg_display, line->buffer);
-    
-    // Calculate new lines used with argument display
-    size_t total_len = prompt_len + strlen(arg_display) + line->len;
-    int current_lines_used = (total_len + term_width - 1) / term_width;
-    if (current_lines_used == 0) current_lines_used = 1;
-    last_lines_used_arg = current_lines_used;
-    
-    // Calculate where cursor should be (accounting for argument display)
-    size_t cursor_total_pos = prompt_len + strlen(arg_display) + line->point;
-    int cursor_row = cursor_total_pos / term_width;
-    int cursor_col = cursor_total_pos % term_width;
-    
-    // After printing the content, we're at the end of all content
-    size_t end_pos = total_len;
-    int actual_row = (end_pos > 0) ? (end_pos - 1) / term_width : 0;
-    int actual_col = (end_pos > 0) ? (end_pos - 1) % term_width + 1 : 0;
-    
-    // Handle the case where we're exactly at the end of a line
-    if (end_pos > 0 && end_pos % term_width == 0) {
-        actual_row--;
-        actual_col = term_width;
+    draw(line, arg_display, false);
+}
+
+// Refresh showing the search query after the prompt
+static void refresh_search(Line *line) {
+    if (line->io.headless || line->macro.executing) return;
+    LineSearch *s = &line->search;
+    size_t shown = s->len > ISEARCH_SHOWN_QUERY ? ISEARCH_SHOWN_QUERY : s->len;
+    char display[ISEARCH_SHOWN_QUERY + 48];
+    snprintf(display, sizeof(display), "(%s%si-search `%s%.*s') ",
+             s->failing ? "failing " : "", s->backward ? "reverse-" : "",
+             s->len > shown ? "..." : "", (int)shown, s->query ? s->query + s->len - shown : "");
+    draw(line, display, false);
+}
+
+// Draw the final state if the screen is behind, then move below it so
+// whatever comes next starts on a fresh row
+static void end_frame(Line *line) {
+    // Drop the autosuggestion from the screen
+    if (line->hint_len > 0) {
+        line->hint = NULL;
+        line->hint_len = 0;
+        line->io.frame_due = true;
     }
-    
-    // Move from where we are to where we need to be
-    int row_diff = actual_row - cursor_row;
-    int col_diff = actual_col - cursor_col;
-    
-    // Move vertically first
-    if (row_diff > 0) {
-        printf("\033[%dA", row_diff); // Move up
-    } else if (row_diff < 0) {
-        printf("\033[%dB", -row_diff); // Move down
+    if (line->io.frame_due) {
+        line->io.frame_due = false;
+        line_refresh(line, line->prompt);
     }
-    
-    // Move horizontally
-    if (col_diff > 0) {
-        printf("\033[%dD", col_diff); // Move left
-    } else if (col_diff < 0) {
-        printf("\033[%dC", -col_diff); // Move right
+    int below = line->io.lines_used - 1 - line->io.cursor_row;
+    if (below > 0) out_printf(line, "\033[%dB", below);
+    out_puts(line, "\n");
+    line->io.lines_used = 1;
+    line->io.cursor_row = 0;
+}
+
+static void end_read(Line *line) {
+    if (line->pipeline) {
+        pipeline_pause(line->pipeline);
+        unsigned long reads;
+        unsigned long long bytes;
+        pipeline_reads(line->pipeline, &reads, &bytes);
+        if (line->metrics) {
+            line->metrics->reads += reads;
+            line->metrics->read_bytes += bytes;
+        }
     }
-    
-    fflush(stdout);
+    line->reading = false;
+    line->io.frame_due = false;
+    end_output(line);
+    disable_raw_mode(line);
+    if (line->trace) {
+        trace_begin(line->trace, TRACE_END, metrics_now());
+        trace_uint(line->trace, line->len);
+        trace_uint(line->trace, trace_hash(line->buffer, line->len));
+        trace_end(line->trace);
+        trace_flush(line->trace);
+    }
+
+    // Recent lines decide how much buffer is kept, a peak counts for
+    // less with every line after it
+    size_t decayed = line->high_water >> ELINE_HIGH_WATER_SHIFT;
+    line->high_water = line->len > decayed ? line->len : decayed;
 }
 
-bool line_read(Line *line, const char *prompt) {
-    line->prompt = prompt;
-    tcgetattr(STDIN_FILENO, &original_term);
-    enable_raw_mode();
+// Buffer capacity that fits the recent lines
+static size_t retained_cap(Line *line) {
+    size_t cap = ELINES_INIT_CAP;
+    while (cap <= line->high_water) cap *= 2;
+    return cap;
+}
 
+// Give back the memory of a big line once lines are small again.  The
+// buffer, indexes and undo log must be empty.
+static void trim_buffers(Line *line) {
+    size_t cap = retained_cap(line);
+    if (line->cap >= cap * ELINE_TRIM_FACTOR) {
+        char *buffer = mem_realloc(&line->allocator, line->buffer, cap);
+        if (buffer) {
+            line->buffer = buffer;
+            line->cap = cap;
+        }
+    }
+    for (int k = 0; k < LINE_BRACKET_KINDS; k++) {
+        if (line->brackets[k].capacity >= cap * ELINE_TRIM_FACTOR) posindex_trim(&line->brackets[k], cap);
+    }
+    if (line->newlines.capacity >= cap * ELINE_TRIM_FACTOR) posindex_trim(&line->newlines, cap);
+    if (undo_memory_usage(&line->undo) >= cap * ELINE_TRIM_FACTOR) undo_shrink(&line->undo, cap);
+}
+
+char *line_take_buffer(Line *line, size_t *len) {
+    char *fresh = mem_alloc(&line->allocator, ELINES_INIT_CAP);
+    if (!fresh) return NULL;
+
+    char *taken = line->buffer;
+    if (len) *len = line->len;
+    line->buffer = fresh;
+    line->cap = ELINES_INIT_CAP;
     clear_line(line);
-    line->arg = 1; // Reset argument for each new line
-    memset(&line->last_key, 0, sizeof(KeySequence));
+    // No command ran, the edit record needs a time of its own
+    if (line->trace) trace_now(line);
+    notify_edits(line);
+    return taken;
+}
+
+// Note that the screen is behind the buffer.  The frame is drawn by
+// update_screen once the input already there has been handled, so a
+// paste or a burst of typeahead costs one frame and one autosuggestion
+// lookup instead of one per key.
+static void schedule_frame(Line *line) {
+    if (line->io.headless || line->macro.executing) return;
+    if (line->io.frame_due && line->metrics) line->metrics->skipped_frames++;
+    line->io.frame_due = true;
+}
 
-    printf("%s", prompt);
-    fflush(stdout);
+// Take the prompt from prompt_fn if it said it changed
+static void update_prompt(Line *line) {
+    if (!line->prompt_dirty || !line->prompt_fn) return;
+    line->prompt_dirty = false;
+    if (prompt_set(&line->prompt_layout, line->prompt_fn(line->prompt_data))) {
+        line->io.shown_plain = false;
+        if (line->reading) trace_prompt(line);
+    }
+    line->prompt = line->prompt_layout.source;
+}
 
-    KeySequence seq;
-    char c;
-    bool building_arg = false;
-    bool negative_arg = false;
-
-    while (read(STDIN_FILENO, &c, 1) == 1) {
-        // Handle escape sequences and special keys
-        if (c == 27) { // ESC - could be start of escape sequence or Meta key
-            char esc_seq[8] = {27};
-            size_t esc_len = 1;
-            
-            // Set a small timeout for reading the rest of the sequence
-            struct timeval tv = {0, 10000}; // 10ms timeout
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(STDIN_FILENO, &fds);
-            
-            while (select(1, &fds, NULL, NULL, &tv) > 0 && esc_len < sizeof(esc_seq)) {
-                if (read(STDIN_FILENO, &esc_seq[esc_len], 1) == 1) {
-                    esc_len++;
-                }
+void line_set_prompt(Line *line, const char *prompt) {
+    use_prompt(line, prompt);
+    if (line->reading) schedule_frame(line);
+}
+
+void line_set_prompt_fn(Line *line, LinePromptFn fn, void *userdata) {
+    line->prompt_fn = fn;
+    line->prompt_data = userdata;
+    line->prompt_dirty = fn != NULL;
+}
+
+void line_prompt_changed(Line *line) {
+    line->prompt_dirty = true;
+    if (line->reading) schedule_frame(line);
+}
+
+static bool input_waiting(Line *line) {
+    if (line->pipeline) return pipeline_keys_waiting(line->pipeline);
+    struct pollfd p = {line->io.in_fd, POLLIN, 0};
+    return poll(&p, 1, 0) > 0 && (p.revents & POLLIN);
+}
+
+// Nanoseconds max_fps still holds the next frame back
+static unsigned long long frame_wait(Line *line) {
+    if (line->config.max_fps <= 0) return 0;
+    unsigned long long gap = 1000000000ull / line->config.max_fps;
+    unsigned long long since = metrics_now() - line->io.last_frame;
+    return since >= gap ? 0 : gap - since;
+}
+
+// Draw the latest state if a frame is due, the terminal took the last
+// one, no input is waiting and max_fps allows it
+static void update_screen(Line *line) {
+    LineIO *io = &line->io;
+    if (!io->frame_due || !line->reading) return;
+    if (!out_send(line) || frame_wait(line) > 0 || input_waiting(line)) return;
+
+    io->frame_due = false;
+    if (line->config.max_fps > 0) io->last_frame = metrics_now();
+    update_prompt(line);
+    update_hint(line);
+    if (line->search.active) {
+        refresh_search(line);
+    } else if (line->building_arg && line->config.show_digit_argument) {
+        line_refresh_with_arg(line, line->prompt, abs(line->arg), line->arg < 0);
+    } else {
+        line_refresh(line, line->prompt);
+    }
+}
+
+bool line_async_enable(Line *line) {
+    return mailbox_open(&line->mailbox);
+}
+
+int line_wakeup_fd(Line *line) {
+    return mailbox_fd(&line->mailbox);
+}
+
+bool line_print_above(Line *line, const char *text, size_t len) {
+    return mailbox_print(&line->mailbox, text, len);
+}
+
+bool line_post_prompt(Line *line, const char *prompt) {
+    return mailbox_prompt(&line->mailbox, prompt);
+}
+
+// Whether posts from other threads can be applied now.  Like frames
+// they wait for the terminal and max_fps, so a flood of log lines is
+// printed in a few big batches.
+static bool mailbox_due(Line *line) {
+    return mailbox_fd(&line->mailbox) >= 0 && !line_output_pending(line) && frame_wait(line) == 0;
+}
+
+// Print the text other threads posted, above the frame if a line is
+// being read, and take the prompt they posted.  A line that starts
+// after it was posted takes it over the one line_read was given.  The
+// frame is drawn again by the next update_screen.
+static void apply_mailbox(Line *line) {
+    LineIO *io = &line->io;
+    MailboxBatch batch;
+    if (!mailbox_due(line) || !mailbox_take(&line->mailbox, &batch)) return;
+
+    if (batch.prompt) {
+        if (prompt_set(&line->prompt_layout, batch.prompt)) {
+            io->shown_plain = false;
+            if (line->reading) trace_prompt(line);
+        }
+        line->prompt = line->prompt_layout.source;
+    } else if (batch.refetch) {
+        line->prompt_dirty = true;
+    }
+    if (batch.len > 0 && line->reading) {
+        if (io->caps & TERM_CAP_ANSI) {
+            if (io->cursor_row > 0) out_printf(line, "\033[%dA", io->cursor_row);
+            out_puts(line, "\r" ANSI_CLEAR_TO_END);
+        } else {
+            out_puts(line, "\r");
+            for (size_t i = 0; i < io->shown_cols; i++) out_puts(line, " ");
+            out_puts(line, "\r");
+        }
+        io->lines_used = 1;
+        io->cursor_row = 0;
+        io->shown_plain = false;
+        io->shown_cols = 0;
+    }
+    if (batch.len > 0) trace_text(line, TRACE_ABOVE, batch.text, batch.len);
+    out_append(line, batch.text, batch.len);
+    if (line->reading) schedule_frame(line);
+    free(batch.text);
+    free(batch.prompt);
+}
+
+bool line_output_pending(Line *line) {
+    if (line->pipeline && pipeline_busy(line->pipeline)) return true;
+    return line->io.out_sent < line->io.out_len;
+}
+
+int line_frame_delay(Line *line) {
+    if (!line->io.frame_due || !line->reading || line_output_pending(line)) return -1;
+    return (frame_wait(line) + 999999) / 1000000;
+}
+
+void line_flush(Line *line) {
+    out_send(line);
+    apply_mailbox(line);
+    update_screen(line);
+}
+
+// Ask the host whether Enter should submit, handing it what changed
+static bool input_complete(Line *line) {
+    if (!line->input_complete) return true;
+    LineEdit edit = line->edited ? line->edit : (LineEdit){line->len, line->len, line->len};
+    line->edited = false;
+    bool complete = line->input_complete(line->buffer, line->len, &edit, line->input_complete_data);
+    if (line->trace) {
+        trace_begin(line->trace, TRACE_COMPLETE, metrics_now());
+        trace_uint(line->trace, complete);
+        trace_end(line->trace);
+    }
+    return complete;
+}
+
+// Incremental search.  While it is on, printable keys extend the query
+// and C-s and C-r go to the next and previous match.  Each search starts
+// at the current match rather than an end of the buffer, so a growing
+// query only looks at text it hasn't ruled out.  DEL takes back the last
+// of those steps, Enter leaves point at the match and C-g goes back to
+// where the search started.  Any other key ends the search and then
+// runs as usual.
+static void isearch_start(Line *line, bool backward) {
+    LineSearch *s = &line->search;
+    s->active = true;
+    s->backward = backward;
+    s->failing = false;
+    s->len = 0;
+    s->step_count = 0;
+    s->origin = line->point;
+    s->match = SEARCH_NONE;
+}
+
+void isearch_forward(Line *line) {
+    isearch_start(line, false);
+}
+
+void isearch_backward(Line *line) {
+    isearch_start(line, true);
+}
+
+static void isearch_end(Line *line, bool cancel) {
+    LineSearch *s = &line->search;
+    if (cancel) line->point = s->origin;
+    if (s->len > 0) {
+        char *last = mem_realloc(&line->allocator, s->last, s->len);
+        if (last) {
+            memcpy(last, s->query, s->len);
+            s->last = last;
+            s->last_len = s->len;
+        }
+    }
+    s->active = false;
+}
+
+// Remember where the search is before a step DEL can take back
+static bool isearch_push(Line *line) {
+    LineSearch *s = &line->search;
+    if (s->step_count == s->step_cap) {
+        size_t cap = s->step_cap ? s->step_cap * 2 : 16;
+        SearchStep *steps = mem_realloc(&line->allocator, s->steps, cap * sizeof(SearchStep));
+        if (!steps) return false;
+        s->steps = steps;
+        s->step_cap = cap;
+    }
+    s->steps[s->step_count++] = (SearchStep){s->len, s->match, line->point, s->failing, s->backward};
+    return true;
+}
+
+static void isearch_pop(Line *line) {
+    LineSearch *s = &line->search;
+    if (s->step_count == 0) return;
+    SearchStep *step = &s->steps[--s->step_count];
+    s->len = step->len;
+    s->match = step->match;
+    line->point = step->point;
+    s->failing = step->failing;
+    s->backward = step->backward;
+}
+
+static bool isearch_append(Line *line, const char *text, size_t len) {
+    LineSearch *s = &line->search;
+    if (s->len + len > s->cap) {
+        size_t cap = s->cap ? s->cap : 32;
+        while (cap < s->len + len) cap *= 2;
+        char *query = mem_realloc(&line->allocator, s->query, cap);
+        if (!query) return false;
+        s->query = query;
+        s->cap = cap;
+    }
+    memcpy(s->query + s->len, text, len);
+    s->len += len;
+    return true;
+}
+
+// Look for the query at the current match after it grew, or past the
+// match for the next one.  Going on after a failure wraps around.
+static void isearch_find(Line *line, bool next) {
+    LineSearch *s = &line->search;
+    size_t k = s->len, found;
+    if (!s->backward) {
+        size_t from = s->match == SEARCH_NONE ? s->origin : s->match + (next ? 1 : 0);
+        if (next && s->failing) from = 0;
+        found = search_forward(line->buffer, line->len, s->query, k, from);
+    } else {
+        // Before point, a match must end by it
+        size_t at = s->match;
+        if (next && s->failing) at = line->len;
+        else if (s->match == SEARCH_NONE) at = s->origin >= k ? s->origin - k : SEARCH_NONE;
+        else if (next) at = s->match > 0 ? s->match - 1 : SEARCH_NONE;
+        found = at == SEARCH_NONE ? SEARCH_NONE : search_backward(line->buffer, line->len, s->query, k, at);
+    }
+
+    s->failing = found == SEARCH_NONE;
+    if (s->failing) return;
+    s->match = found;
+    line->point = s->backward ? found : found + k;
+}
+
+// Handle a key during incremental search, false if it ended the search
+// and is left to run as usual
+static bool isearch_key(Line *line, const KeySequence *seq) {
+    LineSearch *s = &line->search;
+    unsigned char c = seq->sequence[0];
+    if (seq->length != 1) {
+        isearch_end(line, false);
+        return false;
+    }
+
+    if (c == 19 || c == 18) {  // C-s and C-r
+        if (!isearch_push(line)) return true;
+        s->backward = c == 18;
+        if (s->len == 0 && s->last_len > 0) {
+            // Search again for the last query
+            if (isearch_append(line, s->last, s->last_len)) isearch_find(line, false);
+        } else if (s->len > 0) {
+            isearch_find(line, true);
+        }
+    } else if (c == 127 || c == 8) {  // DEL and C-h
+        isearch_pop(line);
+    } else if (c == 7) {  // C-g
+        isearch_end(line, true);
+    } else if (c == '\r' || c == '\n') {
+        isearch_end(line, false);
+    } else if (isprint(c)) {
+        if (isearch_push(line) && isearch_append(line, (const char *)&c, 1)) isearch_find(line, false);
+    } else {
+        isearch_end(line, false);
+        return false;
+    }
+    return true;
+}
+
+// Run one decoded key through the keymap, the return value tells whether
+// the line was accepted or ended
+static LineStatus dispatch_key(Line *line, const KeySequence *key) {
+    if (line->metrics) line->metrics->keys++;
+
+    // The keys of a chord like C-x ( are held until they make a binding
+    KeySequence chord;
+    const KeySequence *seq = key;
+    if (line->chord.length > 0) {
+        chord = line->chord;
+        line->chord.length = 0;
+        if (chord.length + key->length >= sizeof(chord.sequence)) return LINE_PENDING;
+        memcpy(chord.sequence + chord.length, key->sequence, key->length);
+        chord.length += key->length;
+        seq = &chord;
+    }
+
+    if (line->search.active && isearch_key(line, seq)) {
+        macro_record(&line->macro, seq);
+        line->last_key = *seq;
+        schedule_frame(line);
+        return LINE_PENDING;
+    }
+
+    // Look up action
+    unsigned long long start = metrics_start(line);
+    KeyAction action = keymap_lookup(&line->keymap, seq);
+    if (line->metrics) metrics_stop(&line->metrics->lookup, start);
+
+    if (!action && keymap_is_prefix(&line->keymap, seq)) {
+        line->chord = *seq;
+        return LINE_PENDING;
+    }
+    macro_record(&line->macro, seq);
+
+    // Check for Meta+digit (numeric argument)
+    if (seq->length == 2 && seq->sequence[0] == 27 && isdigit((unsigned char)seq->sequence[1])) {
+        if (!line->building_arg) {
+            line->building_arg = true;
+            line->arg = 0;
+        }
+
+        // Count current digits to check for overflow
+        int temp_arg = line->arg;
+        int digit_count = 0;
+        if (temp_arg > 0) {
+            while (temp_arg > 0) {
+                temp_arg /= 10;
+                digit_count++;
             }
+        }
 
-            // Check for Meta+digit (numeric argument)
-            if (esc_len == 2 && isdigit(esc_seq[1])) {
-                if (!building_arg) {
-                    building_arg = true;
-                    line->arg = 0;
-                }
-                
-                // Count current digits to check for overflow
-                int temp_arg = line->arg;
-                int digit_count = 0;
-                if (temp_arg > 0) {
-                    while (temp_arg > 0) {
-                        temp_arg /= 10;
-                        digit_count++;
-                    }
-                }
-                
-                if (digit_count >= MAX_ARG_DIGITS) {
-                    // Reset and stop showing digit argument
-                    line->arg = 1;
-                    building_arg = false;
-                    negative_arg = false;
-                    // Force full refresh to clear any wrapped argument display
-                    line_refresh(line, prompt);
-                    continue;
-                }
-                
-                int digit = esc_seq[1] - '0';
-                line->arg = line->arg * 10 + digit;
-                if (negative_arg) {
-                    line->arg = -line->arg;
-                    negative_arg = false; // Apply negative only once
-                }
-                
-                make_key_sequence(esc_seq, esc_len, &seq);
-                line->last_key = seq;
-                
-                if (show_digit_argument) {
-                    line_refresh_with_arg(line, prompt, abs(line->arg), line->arg < 0);
-                }
+        if (digit_count >= MAX_ARG_DIGITS) {
+            // Reset and stop showing digit argument
+            line->arg = 1;
+            line->building_arg = false;
+            line->negative_arg = false;
+            // Redraw without the argument display
+            schedule_frame(line);
+            return LINE_PENDING;
+        }
+
+        int digit = seq->sequence[1] - '0';
+        line->arg = line->arg * 10 + digit;
+        if (line->negative_arg) {
+            line->arg = -line->arg;
+            line->negative_arg = false; // Apply negative only once
+        }
+
+        line->last_key = *seq;
+
+        if (line->config.show_digit_argument) schedule_frame(line);
+        return LINE_PENDING;
+    }
+
+    // Check for Meta+- (negative argument)
+    if (seq->length == 2 && seq->sequence[0] == 27 && seq->sequence[1] == '-') {
+        line->negative_arg = true;
+        line->building_arg = true;
+        line->arg = 0;
+
+        line->last_key = *seq;
+
+        if (line->config.show_digit_argument) schedule_frame(line);
+        return LINE_PENDING;
+    }
+
+    // Store the last key
+    line->last_key = *seq;
+
+    if (seq->sequence[0] == 4) {  // Ctrl-D (EOF)
+        if (line->len == 0) {
+            end_frame(line);
+            end_read(line);
+            return LINE_EOF;
+        }
+    }
+
+    if (action) {
+        // Each command is its own undo group
+        undo_boundary(&line->undo);
+        line->inserting = false;
+
+        // Execute the bound action
+        start = command_start(line);
+        action(line);
+        command_done(line, action, start);
+        line->last_command = action;
+
+        // A macro that pressed Enter or C-d ended the line
+        if (line->macro_status != LINE_PENDING) {
+            LineStatus status = line->macro_status;
+            line->macro_status = LINE_PENDING;
+            return status;
+        }
+
+        // Reset argument after command execution unless it's a digit argument
+        if (action != digit_argument) {
+            line->building_arg = false;
+            line->negative_arg = false;
+            line->arg = 1;
+        }
+
+        // Special handling for keyboard_quit to reset building_arg state
+        if (action == keyboard_quit) {
+            line->building_arg = false;
+            line->negative_arg = false;
+        }
+    } else if ((seq->sequence[0] == '\n' || seq->sequence[0] == '\r') && !input_complete(line)) {
+        // Enter in an unfinished input continues it on a new line
+        undo_boundary(&line->undo);
+        line->inserting = false;
+        line->last_command = NULL;
+        insert_text(line, "\n", 1);
+        line->building_arg = false;
+        line->negative_arg = false;
+        line->arg = 1;
+    } else if (seq->sequence[0] == '\n' || seq->sequence[0] == '\r') {
+        // Enter key.  A macro ends here, show what it did.
+        if (line->macro.executing) {
+            line->macro.executing = false;
+            line->io.frame_due = true;
+        }
+        end_frame(line);
+        out_flush(line);
+        end_read(line);
+        return LINE_ACCEPTED;
+    } else if (seq->length == 1 && isprint((unsigned char)seq->sequence[0])) {  // Printable characters
+        // A run of self-inserted characters is undone at once
+        if (!line->inserting) undo_boundary(&line->undo);
+        line->inserting = true;
+        line->last_command = NULL;
+        start = command_start(line);
+        insert(line, seq->sequence[0]);
+        command_done(line, NULL, start);
+        line->building_arg = false;
+        line->negative_arg = false;
+        line->arg = 1;
+    }
+
+    schedule_frame(line);
+    return LINE_PENDING;
+}
+
+static LineStatus process_key(Line *line, const KeySequence *key) {
+    LineStatus status = dispatch_key(line, key);
+    notify_edits(line);
+    return status;
+}
+
+void start_kbd_macro(Line *line) {
+    macro_start(&line->macro);
+}
+
+void end_kbd_macro(Line *line) {
+    macro_end(&line->macro);
+}
+
+// Run the last macro arg times, ending its definition first if need be.
+// Its keys are dispatched with no refresh in between, the command that
+// called it draws the result once.
+void call_last_kbd_macro(Line *line) {
+    KeyMacro *m = &line->macro;
+    if (m->executing) return;
+    macro_end(m);
+
+    int count = line->arg > 0 ? line->arg : 1;
+    line->arg = 1;
+    line->building_arg = false;
+    line->negative_arg = false;
+
+    m->executing = true;
+    for (int i = 0; i < count && m->executing; i++) {
+        size_t pos = 0;
+        KeySequence seq;
+        while (m->executing && macro_next(m, &pos, &seq)) {
+            LineStatus status = process_key(line, &seq);
+            // The line ended, the rest of the keys have nothing to run on
+            if (status != LINE_PENDING) {
+                if (line->macro_status == LINE_PENDING) line->macro_status = status;
+                m->executing = false;
+            }
+        }
+    }
+    m->executing = false;
+}
+
+// Keep bytes that arrived after the line ended for the next line_begin
+static void save_typeahead(Line *line, const char *bytes, size_t n) {
+    if (n == 0) return;
+    if (line->typeahead_pos == line->typeahead_len) line->typeahead_len = line->typeahead_pos = 0;
+    char *typeahead = mem_realloc(&line->allocator, line->typeahead, line->typeahead_len + n);
+    if (!typeahead) return;
+    memcpy(typeahead + line->typeahead_len, bytes, n);
+    line->typeahead = typeahead;
+    line->typeahead_len += n;
+}
+
+// Take a late probe reply from the start of bytes.  Bytes that may
+// begin one are held in io->reply until the rest comes.  Returns how
+// many bytes it took, 0 if they aren't a reply, and then whatever is
+// still held are keys.
+static size_t take_reply(Line *line, const char *bytes, size_t n) {
+    LineIO *io = &line->io;
+    size_t held = io->reply_len;
+    size_t add = n < sizeof(io->reply) - held ? n : sizeof(io->reply) - held;
+    memcpy(io->reply + held, bytes, add);
+    unsigned caps;
+    bool partial;
+    size_t len = termprobe_reply(io->reply, held + add, &caps, &partial);
+    if (len > 0) {
+        io->caps = caps;
+        io->probe_late = false;
+        io->reply_len = 0;
+        return len - held;
+    }
+    if (partial && add == n) {
+        io->reply_len = held + add;
+        return n;
+    }
+    return 0;
+}
+
+static LineStatus decode(Line *line, const char *bytes, size_t n, size_t *used, bool replies);
+
+// Run what take_reply held back as keys after all
+static LineStatus release_reply(Line *line) {
+    char keys[TERMPROBE_REPLY_MAX];
+    size_t held = line->io.reply_len;
+    memcpy(keys, line->io.reply, held);
+    line->io.reply_len = 0;
+    size_t used;
+    LineStatus status = decode(line, keys, held, &used, false);
+    if (status != LINE_PENDING) save_typeahead(line, keys + used, held - used);
+    return status;
+}
+
+// Decode and run keys from bytes until the line ends, used tells how
+// many bytes that took.  With replies, a late probe reply is taken out.
+static LineStatus decode(Line *line, const char *bytes, size_t n, size_t *used, bool replies) {
+    size_t i = 0;
+    while (i < n) {
+        // Complete a partial sequence from an earlier feed first
+        if (line->pending_len > 0) {
+            while (i < n && line->pending_len < sizeof(line->pending)) {
+                line->pending[line->pending_len++] = bytes[i++];
+                if (key_sequence_length(line->pending, line->pending_len) != 0) break;
+            }
+            size_t klen = key_sequence_length(line->pending, line->pending_len);
+            if (klen == 0) {
+                *used = n;
+                return LINE_PENDING;
+            }
+
+            KeySequence seq;
+            unsigned long long start = metrics_start(line);
+            make_key_sequence(line->pending, klen, &seq);
+            if (line->metrics) metrics_stop(&line->metrics->decode, start);
+            // Give back anything the sequence didn't use
+            size_t extra = line->pending_len - klen;
+            i -= extra;
+            line->pending_len = 0;
+
+            LineStatus status = process_key(line, &seq);
+            if (status != LINE_PENDING) {
+                *used = i;
+                return status;
+            }
+            continue;
+        }
+
+        if (replies && line->io.probe_late && (line->io.reply_len > 0 || bytes[i] == '\033')) {
+            size_t taken = take_reply(line, bytes + i, n - i);
+            if (taken > 0) {
+                i += taken;
                 continue;
             }
-            
-            // Check for Meta+- (negative argument)
-            if (esc_len == 2 && esc_seq[1] == '-') {
-                negative_arg = true;
-                building_arg = true;
-                line->arg = 0;
-                
-                make_key_sequence(esc_seq, esc_len, &seq);
-                line->last_key = seq;
-                
-                if (show_digit_argument) {
-                    line_refresh_with_arg(line, prompt, 0, true);
+            if (line->io.reply_len > 0) {
+                LineStatus status = release_reply(line);
+                if (status != LINE_PENDING) {
+                    *used = i;
+                    return status;
                 }
                 continue;
             }
-            
-            // Special case for DEL key which might be sent as \e[3~
-            if (esc_len == 3 && esc_seq[1] == '[' && esc_seq[2] == '3' &&
-                read(STDIN_FILENO, &esc_seq[3], 1) == 1 && esc_seq[3] == '~') {
-                esc_len = 4;
-            }
-            
-            if (!make_key_sequence(esc_seq, esc_len, &seq)) {
-                // If we can't make a sequence, treat it as a Meta key
-                seq.sequence[0] = 27;
-                seq.sequence[1] = esc_seq[1];
-                seq.length = 2;
-            }
         }
-        else if (c == 127) { // DEL key
-            seq.sequence[0] = c;
-            seq.length = 1;
+
+        unsigned long long start = metrics_start(line);
+        size_t klen = key_sequence_length(bytes + i, n - i);
+        if (klen == 0) {
+            // Incomplete sequence at the end, wait for more bytes
+            memcpy(line->pending, bytes + i, n - i);
+            line->pending_len = n - i;
+            *used = n;
+            return LINE_PENDING;
         }
-        else {
-            // Regular key
-            if (!make_key_sequence(&c, 1, &seq)) continue;
+
+        KeySequence seq;
+        make_key_sequence(bytes + i, klen, &seq);
+        if (line->metrics) metrics_stop(&line->metrics->decode, start);
+        i += klen;
+
+        LineStatus status = process_key(line, &seq);
+        if (status != LINE_PENDING) {
+            *used = i;
+            return status;
         }
+    }
 
-        // Store the last key
-        line->last_key = seq;
+    *used = n;
+    return LINE_PENDING;
+}
 
-        // Look up action
-        KeyAction action = keymap_lookup(&line->keymap, &seq);
+static LineStatus feed(Line *line, const char *bytes, size_t n, size_t *used) {
+    return decode(line, bytes, n, used, true);
+}
 
-        if (seq.sequence[0] == 4) {  // Ctrl-D (EOF)
-            if (line->len == 0) {
-                putchar('\n');
-                disable_raw_mode();
-                return false;
-            }
+// Ask the terminal what it is with DA1, once per Line, keeping the guess
+// from TERM if it doesn't answer in time.  A reply after that is taken
+// out of input by decode.  Keys typed meanwhile are kept as typeahead.
+// Terminals TERM calls dumb aren't sent escapes at all.
+static void probe_terminal(Line *line) {
+    LineIO *io = &line->io;
+    if (io->probed || !io->is_tty) return;
+    io->probed = true;
+    if (!(io->caps & TERM_CAP_ANSI)) return;
+
+    out_puts(line, TERMPROBE_QUERY);
+    out_flush(line);
+    char buf[256];
+    size_t len = 0;
+    unsigned long long deadline = metrics_now() + TERMPROBE_TIMEOUT_MS * 1000000ull;
+    while (len < sizeof(buf)) {
+        unsigned long long now = metrics_now();
+        if (now >= deadline) break;
+        struct pollfd p = {io->in_fd, POLLIN, 0};
+        int ready = poll(&p, 1, (deadline - now + 999999) / 1000000);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) break;
+        ssize_t n = read(io->in_fd, buf + len, sizeof(buf) - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+
+        unsigned caps;
+        size_t start, end;
+        if (termprobe_parse(buf, len, &caps, &start, &end)) {
+            io->caps = caps;
+            if (start > 0) trace_input(line, buf, start, metrics_now());
+            if (end < len) trace_input(line, buf + end, len - end, metrics_now());
+            save_typeahead(line, buf, start);
+            save_typeahead(line, buf + end, len - end);
+            return;
         }
-        
-        if (action) {
-            // Execute the bound action
-            action(line);
-            
-            // Reset argument after command execution unless it's a digit argument
-            if (action != digit_argument) {
-                building_arg = false;
-                negative_arg = false;
-                line->arg = 1;
-            }
-            
-            // Special handling for keyboard_quit to reset building_arg state
-            if (action == keyboard_quit) {
-                building_arg = false;
-                negative_arg = false;
-            }
-        } else if (seq.sequence[0] == '\n' || seq.sequence[0] == '\r') {
-            // Enter key
-            putchar('\n');
-            break;
-        } else if (isprint(seq.sequence[0])) {  // Printable characters
-            insert(line, seq.sequence[0]);
-            building_arg = false;
-            negative_arg = false;
-            line->arg = 1;
+    }
+    io->probe_late = true;
+    if (len > 0) trace_input(line, buf, len, metrics_now());
+    save_typeahead(line, buf, len);
+}
+
+#define CONFIG_FLAGS 9
+
+// The switches of c, in the order of their bits in TRACE_BEGIN
+static void config_flags(LineConfig *c, bool *flags[CONFIG_FLAGS]) {
+    bool *all[CONFIG_FLAGS] = {
+        &c->mark_word_navigation, &c->show_digit_argument, &c->mark_yank,
+        &c->electric_pair_mode, &c->electric_pair_mode_brackets, &c->show_last_key,
+        &c->show_paren_mode, &c->autosuggestion_mode, &c->use_clipboard,
+    };
+    memcpy(flags, all, sizeof(all));
+}
+
+// Record what a line starts with, enough to start it again
+static void trace_line(Line *line) {
+    Trace *t = line->trace;
+    int cols, rows;
+    get_terminal_size(line, &cols, &rows);
+    bool *flags[CONFIG_FLAGS];
+    config_flags(&line->config, flags);
+    unsigned long long bits = 0;
+    for (int i = 0; i < CONFIG_FLAGS; i++) bits |= (unsigned long long)*flags[i] << i;
+    const char *cont = line->continuation_prompt ? line->continuation_prompt : "";
+
+    trace_begin(t, TRACE_BEGIN, trace_now(line));
+    trace_uint(t, cols);
+    trace_uint(t, rows);
+    trace_uint(t, line->io.caps);
+    trace_uint(t, bits);
+    trace_uint(t, line->config.undo_limit);
+    trace_uint(t, line->config.scroll_margin);
+    trace_uint(t, line->config.max_fps > 0 ? line->config.max_fps : 0);
+    trace_bytes(t, line->prompt_layout.source, line->prompt_layout.source_len);
+    trace_bytes(t, cont, strlen(cont));
+    trace_end(t);
+}
+
+LineStatus line_begin(Line *line, const char *prompt) {
+    if (line->prompt_fn) {
+        line->prompt_dirty = true;
+        update_prompt(line);
+    } else {
+        // Measured again only if the text changed since the last line
+        prompt_set(&line->prompt_layout, prompt);
+        line->prompt = line->prompt_layout.source;
+    }
+    enable_raw_mode(line);
+    begin_output(line);
+    probe_terminal(line);
+    // Text posted since the last line goes above this one
+    apply_mailbox(line);
+    if (line->trace) trace_line(line);
+    line->reading = true;
+
+    clear_line(line);
+    notify_edits(line);
+    trim_buffers(line);
+    line->edited = false;
+    line->screen_edited = false;
+    line->arg = 1; // Reset argument for each new line
+    line->building_arg = false;
+    line->negative_arg = false;
+    line->inserting = false;
+    line->last_command = NULL;
+    line->pending_len = 0;
+    line->chord.length = 0;
+    memset(&line->last_key, 0, sizeof(KeySequence));
+    line->io.lines_used = 1;
+    line->io.cursor_row = 0;
+    line->view_line = line->view_row = 0;
+    line->search.active = false;
+
+    PromptLayout *p = &line->prompt_layout;
+    if (line->io.caps & TERM_CAP_ANSI) {
+        out_append(line, p->text, p->len);
+    } else {
+        int cols, rows;
+        get_terminal_size(line, &cols, &rows);
+        out_append(line, p->visible, p->visible_len);
+        line->io.shown_cols = p->width % cols;
+    }
+    out_flush(line);
+    line->io.shown_plain = true;
+    line->io.shown_lead = p->width;
+    line->io.shown_width = 0;
+    line->io.shown_len = line->io.shown_point = 0;
+
+    // Replay whatever was typed ahead of this prompt.  If this line ends
+    // too, the rest stays where it is for the next one.
+    if (line->typeahead_pos == line->typeahead_len) return LINE_PENDING;
+    size_t used;
+    LineStatus status = feed(line, line->typeahead + line->typeahead_pos,
+                             line->typeahead_len - line->typeahead_pos, &used);
+    line->typeahead_pos += used;
+    if (line->typeahead_pos == line->typeahead_len) {
+        mem_free(&line->allocator, line->typeahead);
+        line->typeahead = NULL;
+        line->typeahead_len = line->typeahead_pos = 0;
+    }
+    if (status == LINE_PENDING) update_screen(line);
+    return status;
+}
+
+LineStatus line_feed(Line *line, const char *bytes, size_t n) {
+    if (n > 0) trace_input(line, bytes, n, metrics_now());
+    if (!line->reading) {
+        save_typeahead(line, bytes, n);
+        return LINE_PENDING;
+    }
+
+    size_t used;
+    LineStatus status = feed(line, bytes, n, &used);
+    if (status != LINE_PENDING) save_typeahead(line, bytes + used, n - used);
+    else update_screen(line);
+    return status;
+}
+
+bool line_escape_pending(Line *line) {
+    return line->reading && (line->pending_len > 0 || line->io.reply_len > 0);
+}
+
+// Take a partial sequence, or what looked like the start of a probe
+// reply, as it is
+static LineStatus flush_pending(Line *line) {
+    LineStatus status = LINE_PENDING;
+    if (line->io.reply_len > 0) status = release_reply(line);
+    if (status == LINE_PENDING && line->pending_len > 0) {
+        KeySequence seq;
+        make_key_sequence(line->pending, line->pending_len, &seq);
+        line->pending_len = 0;
+        status = process_key(line, &seq);
+    }
+    return status;
+}
+
+LineStatus line_escape_timeout(Line *line) {
+    if (!line_escape_pending(line)) return LINE_PENDING;
+
+    // Nothing completed the sequence in time
+    trace_event(line, TRACE_ESCAPE);
+    LineStatus status = flush_pending(line);
+    if (status == LINE_PENDING) update_screen(line);
+    return status;
+}
+
+LineStatus line_run_bytes(Line *line, const char *bytes, size_t n) {
+    if (!line->reading) {
+        LineStatus status = line_begin(line, "");
+        if (status != LINE_PENDING) {
+            save_typeahead(line, bytes, n);
+            return status;
         }
-        
-        // Refresh the line
-        if (building_arg && show_digit_argument) {
-            line_refresh_with_arg(line, prompt, abs(line->arg), line->arg < 0);
-        } else {
-            line_refresh(line, prompt);
+    }
+    LineStatus status = line_feed(line, bytes, n);
+    if (status == LINE_PENDING) status = line_escape_timeout(line);
+    return status;
+}
+
+bool line_run_keys(Line *line, const char *keys, LineStatus *status) {
+    LineStatus s = LINE_PENDING;
+    const char *p = keys;
+    while (*p) {
+        while (*p == ' ') p++;
+        size_t len = strcspn(p, " ");
+        if (len == 0) break;
+
+        char notation[32];
+        KeySequence seq;
+        if (len < sizeof(notation)) {
+            memcpy(notation, p, len);
+            notation[len] = '\0';
         }
+        if (len >= sizeof(notation) || !parse_key_notation(notation, &seq)) {
+            if (status) *status = s;
+            return false;
+        }
+        p += len;
+        trace_input(line, seq.sequence, seq.length, metrics_now());
+
+        if (s == LINE_PENDING && !line->reading) s = line_begin(line, "");
+        if (s != LINE_PENDING) {
+            // Keys after the end of a line wait for the next one
+            save_typeahead(line, seq.sequence, seq.length);
+            continue;
+        }
+        s = process_key(line, &seq);
     }
+    if (status) *status = s;
+    return true;
+}
 
-    disable_raw_mode();
+// The input ended, which ends the line like Ctrl-D
+static LineStatus end_input(Line *line) {
+    trace_input(line, "", 0, metrics_now());
+    if (line->reading) {
+        end_frame(line);
+        out_flush(line);
+        end_read(line);
+    }
+    return LINE_EOF;
+}
+
+LineStatus line_fd_ready(Line *line) {
+    char buf[4096];
+    ssize_t n = read(line->io.in_fd, buf, sizeof(buf));
+    if (line->metrics) {
+        line->metrics->reads++;
+        if (n > 0) line->metrics->read_bytes += n;
+    }
+
+    if (n > 0) return line_feed(line, buf, n);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        line_flush(line);
+        return LINE_PENDING;
+    }
+
+    // End of input or a read error ends the line like Ctrl-D
+    return end_input(line);
+}
+
+bool line_pipeline_enable(Line *line) {
+    if (line->pipeline) return true;
+    if (line->io.headless) return false;
+    Pipeline *p = mem_alloc(&line->allocator, sizeof(Pipeline));
+    if (!p) return false;
+    if (!pipeline_start(p, line->io.in_fd, line->io.out_fd)) {
+        mem_free(&line->allocator, p);
+        return false;
+    }
+    line->pipeline = p;
+    return true;
+}
+
+void line_pipeline_disable(Line *line) {
+    Pipeline *p = line->pipeline;
+    if (!p) return;
+    out_flush(line);
+    char *buf;
+    size_t cap;
+    // Keys read ahead go to the next line read without it
+    pipeline_pause(p);
+    PipelineKey key;
+    while (pipeline_pop(p, &key)) save_typeahead(line, key.key.sequence, key.key.length);
+    pipeline_stop(p, &buf, &cap);
+    save_typeahead(line, p->rbuf + p->rstart, p->rend - p->rstart);
+    mem_free(&line->allocator, buf);
+    mem_free(&line->allocator, p);
+    line->pipeline = NULL;
+}
+
+bool line_trace_start(Line *line, int fd) {
+    line_trace_stop(line);
+    Trace *t = mem_alloc(&line->allocator, sizeof(Trace));
+    if (!t) return false;
+    if (!trace_open(t, fd, &line->allocator)) {
+        mem_free(&line->allocator, t);
+        return false;
+    }
+    line->trace = t;
+    line->trace_clock = metrics_now();
     return true;
 }
 
+void line_trace_stop(Line *line) {
+    if (!line->trace) return;
+    trace_close(line->trace);
+    mem_free(&line->allocator, line->trace);
+    line->trace = NULL;
+}
+
+// A copy of a recorded string that ends in a NUL
+static char *trace_string(Line *line, const char *bytes, size_t n) {
+    char *s = mem_alloc(&line->allocator, n + 1);
+    if (!s) return NULL;
+    memcpy(s, bytes, n);
+    s[n] = '\0';
+    return s;
+}
+
+// Start a line the way TRACE_BEGIN says.  The Line keeps its own copies
+// of the prompts, so those are used once it has them.
+static LineStatus replay_begin(Line *line, const char *p, const char *end) {
+    unsigned long long cols, rows, caps, bits, undo_limit, scroll_margin, max_fps;
+    const char *prompt, *cont;
+    size_t prompt_len, cont_len;
+    if (!trace_get_uint(&p, end, &cols) || !trace_get_uint(&p, end, &rows)
+        || !trace_get_uint(&p, end, &caps) || !trace_get_uint(&p, end, &bits)
+        || !trace_get_uint(&p, end, &undo_limit) || !trace_get_uint(&p, end, &scroll_margin)
+        || !trace_get_uint(&p, end, &max_fps) || !trace_get_bytes(&p, end, &prompt, &prompt_len)
+        || !trace_get_bytes(&p, end, &cont, &cont_len)) {
+        return LINE_PENDING;
+    }
+
+    line_set_columns(line, cols);
+    line_set_rows(line, rows);
+    line_set_terminal_caps(line, caps);
+    bool *flags[CONFIG_FLAGS];
+    bool use_clipboard = line->config.use_clipboard;
+    config_flags(&line->config, flags);
+    for (int i = 0; i < CONFIG_FLAGS; i++) *flags[i] = (bits >> i) & 1;
+    line->config.use_clipboard = use_clipboard;
+    line->config.undo_limit = undo_limit;
+    line->config.scroll_margin = scroll_margin;
+    line->config.max_fps = max_fps;
+
+    char *text = trace_string(line, cont, cont_len);
+    if (text) {
+        line_set_continuation_prompt(line, cont_len > 0 ? text : NULL);
+        if (cont_len > 0) line->continuation_prompt = line->cont_layout.source;
+        mem_free(&line->allocator, text);
+    }
+    text = trace_string(line, prompt, prompt_len);
+    if (!text) return LINE_PENDING;
+    LineStatus status = line_begin(line, text);
+    line->prompt = line->prompt_layout.source;
+    mem_free(&line->allocator, text);
+    return status;
+}
+
+LineStatus line_trace_replay(Line *line, const TraceRecord *rec) {
+    const char *p = rec->data, *end = rec->data + rec->len;
+    unsigned long long cols, rows;
+    char *text;
+
+    switch (rec->kind) {
+        case TRACE_BEGIN:
+            return replay_begin(line, p, end);
+        case TRACE_INPUT:
+            if (rec->len == 0) return end_input(line);
+            return line_feed(line, rec->data, rec->len);
+        case TRACE_ESCAPE:
+            return line_escape_timeout(line);
+        case TRACE_SIZE:
+            if (trace_get_uint(&p, end, &cols) && trace_get_uint(&p, end, &rows)) {
+                line_set_columns(line, cols);
+                line_set_rows(line, rows);
+            }
+            break;
+        case TRACE_PROMPT:
+            text = trace_string(line, rec->data, rec->len);
+            if (!text) break;
+            line_set_prompt(line, text);
+            mem_free(&line->allocator, text);
+            break;
+        case TRACE_ABOVE:
+            // Goes through the mailbox like the text that was printed
+            if (line_async_enable(line) && line_print_above(line, rec->data, rec->len)) line_flush(line);
+            break;
+        case TRACE_HISTORY:
+            text = trace_string(line, rec->data, rec->len);
+            if (!text) break;
+            line_history_add(line, text);
+            mem_free(&line->allocator, text);
+            break;
+        default:
+            break;
+    }
+    return LINE_PENDING;
+}
+
+// A key from the reader thread.  The end of input ends the line like
+// Ctrl-D.
+static LineStatus pipeline_key(Line *line, const PipelineKey *k) {
+    if (k->key.length == 0) return end_input(line);
+    trace_input(line, k->key.sequence, k->key.length, k->read_at);
+    bool partial = key_sequence_length(k->key.sequence, k->key.length) == 0;
+    if (partial) trace_event(line, TRACE_ESCAPE);
+    if (line->metrics) {
+        Pipeline *p = line->pipeline;
+        unsigned long long now = metrics_now();
+        metrics_record(&line->metrics->queued, now - k->read_at);
+        if (!p->first_read_at) {
+            p->first_read_at = k->read_at;
+            p->first_taken_at = now;
+        }
+    }
+    if (!line->io.probe_late) return process_key(line, &k->key);
+
+    // The reader cuts a late probe reply into keys, decode puts it back
+    // together.  A partial key means the reader timed out waiting.
+    size_t used;
+    LineStatus status = feed(line, k->key.sequence, k->key.length, &used);
+    if (status == LINE_PENDING && partial) status = flush_pending(line);
+    if (status != LINE_PENDING) save_typeahead(line, k->key.sequence + used, k->key.length - used);
+    return status;
+}
+
+// line_read with the pipeline on.  The editor only waits for its wake
+// pipe, which keys and finished writes make readable, and the mailbox.
+static bool read_threaded(Line *line, const char *prompt) {
+    Pipeline *p = line->pipeline;
+    LineStatus status = line_begin(line, prompt);
+    if (status == LINE_PENDING) pipeline_resume(p);
+
+    while (status == LINE_PENDING) {
+        pipeline_woken(p);
+        PipelineKey key;
+        while (status == LINE_PENDING && pipeline_pop(p, &key)) status = pipeline_key(line, &key);
+        if (status != LINE_PENDING) break;
+        line_flush(line);
+        if (pipeline_keys_waiting(p)) continue;
+
+        fd_set in_fds;
+        FD_ZERO(&in_fds);
+        int wake = pipeline_wake_fd(p);
+        FD_SET(wake, &in_fds);
+        int mailbox = mailbox_due(line) ? mailbox_fd(&line->mailbox) : -1;
+        if (mailbox >= 0) FD_SET(mailbox, &in_fds);
+        int delay = line_frame_delay(line);
+        struct timeval tv = {delay / 1000, (delay % 1000) * 1000};
+        int nfds = (wake > mailbox ? wake : mailbox) + 1;
+        if (select(nfds, &in_fds, NULL, NULL, delay >= 0 ? &tv : NULL) < 0 && errno != EINTR) {
+            end_read(line);
+            status = LINE_EOF;
+        }
+    }
+    return status == LINE_ACCEPTED;
+}
+
+bool line_read(Line *line, const char *prompt) {
+    if (line->pipeline) return read_threaded(line, prompt);
+    LineStatus status = line_begin(line, prompt);
+
+    while (status == LINE_PENDING) {
+        LineIO *io = &line->io;
+        fd_set in_fds, out_fds;
+        FD_ZERO(&in_fds);
+        FD_ZERO(&out_fds);
+        FD_SET(io->in_fd, &in_fds);
+        // Wait for the terminal to take the rest of a frame
+        if (line_output_pending(line)) FD_SET(io->out_fd, &out_fds);
+        int wakeup = mailbox_due(line) ? mailbox_fd(&line->mailbox) : -1;
+        if (wakeup >= 0) FD_SET(wakeup, &in_fds);
+
+        // Give a lone ESC 10ms to turn into a longer sequence, and wake
+        // up for a frame max_fps held back
+        int delay = line_frame_delay(line);
+        bool escape = line_escape_pending(line) && (delay < 0 || delay >= 10);
+        if (escape) delay = 10;
+        struct timeval tv = {delay / 1000, (delay % 1000) * 1000};
+        int nfds = io->in_fd > io->out_fd ? io->in_fd : io->out_fd;
+        if (wakeup > nfds) nfds = wakeup;
+        nfds++;
+        int ready = select(nfds, &in_fds, &out_fds, NULL, delay >= 0 ? &tv : NULL);
+
+        if (ready > 0 && FD_ISSET(io->in_fd, &in_fds)) {
+            status = line_fd_ready(line);
+        } else if (ready == 0 && escape) {
+            status = line_escape_timeout(line);
+        } else if (ready < 0 && errno != EINTR) {
+            end_read(line);
+            status = LINE_EOF;
+        }
+        if (status == LINE_PENDING) line_flush(line);
+    }
+
+    return status == LINE_ACCEPTED;
+}
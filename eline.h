@@ -3,8 +3,26 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <termios.h>
+#include "alloc.h"
+#include "arena.h"
 #include "keymap.h"
 #include "killring.h"
+#include "history.h"
+#include "undo.h"
+#include "highlight.h"
+#include "posindex.h"
+#include "metrics.h"
+#include "macro.h"
+#include "sharedring.h"
+#include "termprobe.h"
+#include "prompt.h"
+#include "mailbox.h"
+#include "pipeline.h"
+#include "trace.h"
+#include "search.h"
+
+#define LINE_BRACKET_KINDS 4  // () [] {} <>
 
 typedef struct {
     size_t mark;
@@ -15,33 +33,229 @@ typedef struct {
 void yank(Line *line);
 void kill_line(Line *line);
 
+// Terminal state of one editor, so a process can drive many of them
+typedef struct {
+    int in_fd;
+    int out_fd;
+    bool is_tty;         // Both fds are terminals, raw mode and TIOCGWINSZ apply
+    bool raw;            // Raw mode is enabled and original_term must be restored
+    bool headless;       // No terminal at all, nothing is drawn or written
+    struct termios original_term;
+    int cols;            // Width used when the terminal can't report one
+    int rows;            // Height likewise
+    int lines_used;      // Rows drawn by the last refresh
+    int cursor_row;      // Row of the cursor within them
+    char *out;           // Output of the frame being drawn
+    size_t out_len;
+    size_t out_cap;
+    size_t out_sent;     // Bytes of out written, the rest waits for out_fd
+    size_t out_traced;   // Bytes of out recorded by the trace
+    int out_flags;       // out_fd's flags before a line made it non-blocking, or -1
+    bool frame_due;      // The screen is behind the buffer
+    unsigned long long last_frame;  // When it was last drawn, for max_fps
+    unsigned caps;       // TERM_CAP_* bits, from TERM and a probe on the first line
+    bool probed;         // caps are settled, don't ask the terminal
+    bool probe_late;     // The probe timed out, its reply is taken out of input if it comes
+    char reply[TERMPROBE_REPLY_MAX];  // Start of a late reply, waiting for the rest
+    size_t reply_len;
+    // What the last frame left on screen, so the next can be drawn as an edit
+    bool shown_plain;    // Prompt and buffer on one row, no hint, styles or argument
+    size_t shown_lead;   // Width of its prompt
+    int shown_width;
+    size_t shown_len;
+    size_t shown_point;
+    size_t shown_cols;   // Columns after the prompt a dumb terminal frame covered
+} LineIO;
+
+typedef enum {
+    LINE_PENDING,   // Still editing, feed more input
+    LINE_ACCEPTED,  // Enter was pressed, the buffer holds the line
+    LINE_EOF,       // Ctrl-D on an empty line or end of input
+} LineStatus;
+
+// Bytes [start, old_end) of the buffer as it was are now [start, new_end)
+typedef struct {
+    size_t start;
+    size_t old_end;
+    size_t new_end;
+} LineEdit;
+
+// One change of the buffer: removed bytes at offset were replaced by
+// inserted_len bytes at inserted
+typedef struct {
+    size_t offset;
+    size_t removed;
+    const char *inserted;
+    size_t inserted_len;
+} LineDelta;
+
+// Every change one command made, in order, each delta's offset taken
+// in the buffer the ones before it left.  Pointers are valid only
+// during the call.
+typedef struct {
+    const LineDelta *deltas;
+    size_t count;
+    size_t point;        // After the command
+    size_t mark;
+    bool mark_active;
+} LineEditBatch;
+
+typedef void (*LineEditObserver)(const LineEditBatch *batch, void *userdata);
+
+// Asked on Enter whether buf is a whole input, false makes Enter insert
+// a newline.  edit covers every change since the previous call, the
+// first call of each line is relative to an empty buffer.
+typedef bool (*LineInputComplete)(const char *buf, size_t len, const LineEdit *edit, void *userdata);
+
+// A step of incremental search, kept so DEL can take it back
+typedef struct {
+    size_t len;          // Of the query
+    size_t match;        // Start of the match, SEARCH_NONE before the first
+    size_t point;
+    bool failing;
+    bool backward;
+} SearchStep;
+
+// Incremental search state, between C-s or C-r and the key that ends it
+typedef struct {
+    bool active;
+    bool backward;
+    bool failing;        // The query has no match in the search direction
+    char *query;
+    size_t len;
+    size_t cap;
+    char *last;          // Query of the previous search, for C-s C-s
+    size_t last_len;
+    size_t origin;       // Point when the search started
+    size_t match;        // Start of the current match, SEARCH_NONE if none yet
+    SearchStep *steps;
+    size_t step_count;
+    size_t step_cap;
+} LineSearch;
+
+// Gives the prompt when a line starts and after line_prompt_changed.
+// The string only has to last until the next call.
+typedef const char *(*LinePromptFn)(void *userdata);
+
+// Behaviour switches, each Line has its own copy
+typedef struct {
+    bool mark_word_navigation;
+    bool show_digit_argument;
+    bool mark_yank;
+    bool electric_pair_mode;
+    bool electric_pair_mode_brackets;
+    bool show_last_key;
+    bool show_paren_mode;     // Highlight the bracket at point and its match
+    bool autosuggestion_mode;
+    bool use_clipboard;       // Mirror kills to and yank from xclip
+    size_t undo_limit;        // Bytes kept in the undo log, 0 for no limit
+    size_t scroll_margin;     // Rows kept in view above and below point
+    int max_fps;              // Frames drawn per second at most, 0 for no limit
+} LineConfig;
+
+extern const LineConfig line_default_config;
+
 typedef struct Line {
+    LineAllocator allocator;          // Everything the Line owns comes from it
     const char *prompt;
+    const char *continuation_prompt;  // Before each logical line after the first
+    PromptLayout prompt_layout;       // Of prompt, remade only when it changes
+    PromptLayout cont_layout;         // Of continuation_prompt
+    LinePromptFn prompt_fn;           // Overrides the prompt passed to line_read
+    void *prompt_data;
+    bool prompt_dirty;                // prompt_fn has a new prompt
     char *buffer;
     size_t len;
     size_t point;
     size_t cap;
+    size_t high_water;   // Length of recent lines, decaying, sizes cap between lines
     Region region;
     KeyMap keymap;
     int arg;
     KeySequence last_key; // TODO Option to print it
+    LineConfig config;
     KillRing kr;
-} Line;
+    SharedKillRing shared_kr;    // Unmapped unless a shared kill ring is set
+    bool kill_unshared;          // The last kill didn't fit shared_kr
+    uint64_t kill_unshared_head; // shared_kr's head at that kill
+    History history;
+    UndoLog undo;
+    Highlight highlight;
+    PosIndex brackets[LINE_BRACKET_KINDS];  // Bracket positions and depths, per kind
+    PosIndex newlines;   // Offsets of the '\n' bytes that split logical lines
+    const char *hint;    // Autosuggestion shown after the buffer, not part of it
+    size_t hint_len;
+    LineInputComplete input_complete;
+    void *input_complete_data;
+    LineEdit edit;       // Changes since input_complete last ran
+    bool edited;
+    LineEdit screen_edit;  // Changes since the last frame
+    bool screen_edited;
+    LineEditObserver edit_observer;
+    void *edit_observer_data;
+    LineDelta *deltas;   // Changes of the command being run, for edit_observer
+    size_t delta_count;
+    size_t delta_cap;
+    char *delta_text;    // Their inserted bytes, back to back
+    size_t delta_text_len;
+    size_t delta_text_cap;
 
+    // State of the line being read between line_begin and its end
+    bool reading;
+    bool building_arg;
+    bool negative_arg;
+    bool inserting;      // The last command was a self-insert
+    KeyAction last_command;  // Command run by the previous key, NULL for a self-insert
+    size_t goal_column;  // Column kept across consecutive C-p and C-n
+    size_t view_line;    // Top of the viewport: a logical line
+    size_t view_row;     // and a row of its wrapping
+    char pending[8];     // Partial key sequence waiting for more bytes
+    size_t pending_len;
+    KeySequence chord;   // Prefix keys of an unfinished chord
+    KeyMacro macro;
+    LineSearch search;
+    LineStatus macro_status; // How a running macro ended the line
+    char *typeahead;     // Bytes that arrived after the previous line ended
+    size_t typeahead_len;
+    size_t typeahead_pos; // Bytes of typeahead already replayed
 
-extern bool mark_word_navigation;
-extern bool show_digit_argument;
-extern bool mark_yank;
-extern bool electric_pair_mode;
-extern bool electric_pair_mode_brackets;
-extern bool show_last_key;
+    Mailbox mailbox;     // Requests from other threads, once line_async_enable opened it
+    Pipeline *pipeline;  // NULL unless line_pipeline_enable started one
+    Trace *trace;        // NULL unless line_trace_start started one
+    unsigned long long trace_clock;  // Time of the last trace record, where the next command starts
+    LineIO io;
+    LineMetrics *metrics;   // NULL unless metrics are enabled
+} Line;
 
 
 void line_init(Line *line);
+void line_init_fd(Line *line, int in_fd, int out_fd);
+void line_init_headless(Line *line);             // For line_run_keys and line_run_bytes
+// Like line_init_fd and line_init_headless with the buffer, the keymap,
+// the kill ring and everything else the Line owns allocated from a,
+// which is copied.  NULL takes the default allocator.  Text other
+// threads post with line_print_above still comes from malloc, as a
+// needn't be thread safe.  With an arena, a Line that opened no mailbox
+// or shared kill ring owns nothing else, so resetting the arena tears
+// it down without line_free.
+void line_init_with(Line *line, int in_fd, int out_fd, const LineAllocator *a);
+void line_init_headless_with(Line *line, const LineAllocator *a);
+// Allocator of the Lines made without one, malloc for NULL.  Set it
+// before making any.
+void line_set_default_allocator(const LineAllocator *a);
+void line_set_columns(Line *line, int cols);     // Width for fds that aren't terminals
+void line_set_rows(Line *line, int rows);        // Height likewise
+// TERM_CAP_* bits the frames are drawn with.  Setting them skips the
+// probe a terminal gets on the first line_begin.
+unsigned line_terminal_caps(Line *line);
+void line_set_terminal_caps(Line *line, unsigned caps);
+size_t line_memory_usage(const Line *line);      // Heap and struct bytes owned by the Line
 void line_free(Line *line);
-bool should_insert_pair();
-char get_closing_pair(char c);
+bool should_insert_pair(Line *line, char c);
+char get_closing_pair(Line *line, char c);
+void line_replace(Line *line, size_t start, size_t end, const char *text, size_t len);
 void insert(Line *line, char c);
+void insert_text(Line *line, const char *text, size_t len);
 bool should_delete_pair(Line *line);
 void delete_backward_char(Line *line);
 void delete_char(Line *line);
@@ -49,11 +263,109 @@ void backward_char(Line *line);
 void forward_char(Line *line);
 void move_beginning_of_line(Line *line);
 void move_end_of_line(Line *line);
+void previous_line(Line *line);
+void next_line(Line *line);
 void set_mark(Line *line);
 void kill_region(Line *line);
 void clear_line(Line *line);
 bool line_read(Line *line, const char *prompt);
+// Move the finished line to the caller, who frees it with the Line's
+// allocator, free unless it was given one.  The Line keeps
+// reading into a new buffer.  Returns NULL, keeping the buffer, if that
+// can't be allocated.
+char *line_take_buffer(Line *line, size_t *len);
+
+// Non-blocking step API, line_read is a blocking loop around it.  From
+// line_begin until the line ends the terminal is in raw mode and out_fd
+// is O_NONBLOCK.  That flag is on the open file, which stdin, stderr and
+// the parent shell usually share, so a host that writes to them or runs
+// a command in the middle of a line must expect EAGAIN.  Both are put
+// back when the line ends, or by line_free if it never does.
+LineStatus line_begin(Line *line, const char *prompt);
+LineStatus line_feed(Line *line, const char *bytes, size_t n);
+LineStatus line_fd_ready(Line *line);            // Read what is available on the input fd
+bool line_escape_pending(Line *line);            // A lone ESC waits for the rest of its sequence
+LineStatus line_escape_timeout(Line *line);      // Take the pending ESC as it is
+// Batch editing, usually on a headless Line.  Both start a line if none
+// is being read and take the end of input as the end of any partial key.
+LineStatus line_run_bytes(Line *line, const char *bytes, size_t n);
+// Keys in notation separated by spaces, like "C-a M-f C-k".  Returns
+// false at the first key it can't parse, after running the ones before.
+bool line_run_keys(Line *line, const char *keys, LineStatus *status);
 void line_refresh(Line *line, const char *prompt);
+// Frames are drawn once the input that is waiting has been handled and
+// the terminal took the previous one.  A host running its own loop
+// waits for out_fd to be writable while output is pending, and for
+// line_frame_delay ms (-1 for no timeout) otherwise, then calls line_flush.
+bool line_output_pending(Line *line);
+int line_frame_delay(Line *line);
+void line_flush(Line *line);
+void line_history_add(Line *line, const char *entry);
+void line_set_highlighter(Line *line, LineHighlighter fn, void *userdata);
+void line_set_input_complete(Line *line, LineInputComplete fn, void *userdata);
+// Hand fn the changes of each command that changed the buffer, once the
+// command is done.  A keyboard macro counts as one command.  Starting a
+// line and line_take_buffer report the buffer being emptied.
+void line_set_edit_observer(Line *line, LineEditObserver fn, void *userdata);
+void line_set_continuation_prompt(Line *line, const char *prompt);  // NULL for none
+// Prompts may hold escape sequences, they take no columns.  A prompt
+// that changes while a line is read is either set again or comes from
+// a prompt_fn that is asked again once told it changed.
+void line_set_prompt(Line *line, const char *prompt);
+void line_set_prompt_fn(Line *line, LinePromptFn fn, void *userdata);  // NULL for none
+void line_prompt_changed(Line *line);
+// Let other threads print above the line being read and replace its
+// prompt.  What they post wakes line_read and is applied in one batch
+// with one redraw.  A host running its own loop also waits for
+// line_wakeup_fd to be readable and then calls line_flush.
+bool line_async_enable(Line *line);
+int line_wakeup_fd(Line *line);                  // -1 until async is enabled
+// Both are safe from any thread and false until async is enabled.  Text
+// waits for the next line if none is being read.  A prompt replaces the
+// one of the line being read, or of the next if it was posted before
+// that started.  NULL asks prompt_fn again.
+bool line_print_above(Line *line, const char *text, size_t len);
+bool line_post_prompt(Line *line, const char *prompt);
+// Have line_read read and decode keys on one thread and write frames on
+// another, so a slow terminal never holds up commands and a slow command
+// never holds up reading.  Frames are drawn from the latest state
+// whenever the writer is free.  Input is only read while a line is.
+// Call between lines, and drive the Line with line_read alone while it
+// is on.  Starts on line_init if ELINE_PIPELINE is set, not to 0.
+// Metrics time each stage a key goes through.
+bool line_pipeline_enable(Line *line);          // False if headless or threads fail
+void line_pipeline_disable(Line *line);         // Writes what is pending first
+// Record the session to fd, see trace.h: what was read and when, the
+// commands it ran and their times, what they changed and what was
+// written.  Starts on line_init if ELINE_TRACE names a file.  Call
+// between lines.
+bool line_trace_start(Line *line, int fd);
+void line_trace_stop(Line *line);               // Writes what is buffered
+// Drive line with a recorded event the way the session was driven:
+// lines started, input, timeouts, resizes, prompts, text printed above
+// and history.  Records of what the Line did itself are skipped, and
+// config.use_clipboard is left as it is.  LINE_PENDING unless the event
+// ended a line.
+LineStatus line_trace_replay(Line *line, const TraceRecord *rec);
+// Metrics start on line_init if ELINE_METRICS is set, not empty or 0,
+// and are dumped there on line_free: 1 for stderr, else a file to
+// append to
+void line_metrics_enable(Line *line, bool enable);
+// Share kills with every process using the same file, which is created
+// if need be.  Yanks read it instead of the clipboard.  NULL stops sharing.
+// ELINE_KILL_RING names one for line_init, unless it is empty or 0.
+bool line_set_shared_kill_ring(Line *line, const char *path);
+bool line_metrics_snapshot(const Line *line, LineMetrics *out);  // False if disabled
+// Offset of the bracket matching the one at off, false if there is none
+bool line_match_bracket(Line *line, size_t off, size_t *match);
+bool line_bracket_unbalanced(Line *line, size_t off);
+// Logical lines of the buffer, split at '\n' and numbered from 0
+size_t line_line_count(Line *line);
+size_t line_line_start(Line *line, size_t lnum);
+size_t line_line_end(Line *line, size_t lnum);  // Offset of its '\n', or len for the last
+void line_offset_to_line_col(Line *line, size_t off, size_t *lnum, size_t *col);
+// Offset of col in lnum, clamped to the end of that line
+size_t line_line_col_to_offset(Line *line, size_t lnum, size_t col);
 
 bool isWordChar(char c);
 bool isPunctuationChar(char c);
@@ -67,5 +379,14 @@ void open_line(Line *line);
 void keyboard_quit(Line *line);
 
 void kill_word(Line *line);
+void undo(Line *line);
+void redo(Line *line);
+
+void isearch_forward(Line *line);
+void isearch_backward(Line *line);
+
+void start_kbd_macro(Line *line);
+void end_kbd_macro(Line *line);
+void call_last_kbd_macro(Line *line);
 
 #endif // ELINE_H
@@ -0,0 +1,179 @@
+#include "highlight.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIGHLIGHT_INIT_CAP 16
+
+void highlight_init(Highlight *hl, const LineAllocator *a) {
+    memset(hl, 0, sizeof(Highlight));
+    hl->allocator = alloc_resolve(a);
+}
+
+void highlight_free(Highlight *hl) {
+    const LineAllocator *a = hl->allocator;
+    mem_free(a, hl->spans);
+    mem_free(a, hl->restarts);
+    mem_free(a, hl->new_spans);
+    mem_free(a, hl->new_restarts);
+    memset(hl, 0, sizeof(Highlight));
+    hl->allocator = a;
+}
+
+void highlight_reset(Highlight *hl) {
+    hl->count = 0;
+    hl->restart_count = 0;
+    hl->dirty = true;
+    hl->dirty_start = 0;
+    hl->dirty_end = SIZE_MAX;
+}
+
+void highlight_set(Highlight *hl, LineHighlighter fn, void *userdata) {
+    hl->fn = fn;
+    hl->userdata = userdata;
+    highlight_reset(hl);
+}
+
+size_t highlight_memory_usage(const Highlight *hl) {
+    return (hl->capacity + hl->new_capacity) * sizeof(StyleSpan)
+         + (hl->restart_capacity + hl->new_restart_capacity) * sizeof(size_t);
+}
+
+static bool reserve(const LineAllocator *a, void **items, size_t *capacity, size_t need, size_t size) {
+    if (need <= *capacity) return true;
+    size_t cap = *capacity ? *capacity : HIGHLIGHT_INIT_CAP;
+    while (cap < need) cap *= 2;
+    void *p = mem_realloc(a, *items, cap * size);
+    if (!p) return false;
+    *items = p;
+    *capacity = cap;
+    return true;
+}
+
+void highlight_span(Highlight *hl, size_t start, size_t end, unsigned style) {
+    if (hl->new_count > 0) {
+        StyleSpan *last = &hl->new_spans[hl->new_count - 1];
+        if (start < last->end) start = last->end;
+        if (end <= start) return;
+
+        // Adjacent spans of one style are drawn as one
+        if (last->end == start && last->style == style) {
+            last->end = end;
+            return;
+        }
+    }
+    if (end <= start) return;
+    if (!reserve(hl->allocator, (void **)&hl->new_spans, &hl->new_capacity, hl->new_count + 1, sizeof(StyleSpan))) return;
+    hl->new_spans[hl->new_count++] = (StyleSpan){start, end, style};
+}
+
+void highlight_restart(Highlight *hl, size_t offset) {
+    if (hl->new_restart_count > 0 && hl->new_restarts[hl->new_restart_count - 1] >= offset) return;
+    if (!reserve(hl->allocator, (void **)&hl->new_restarts, &hl->new_restart_capacity,
+                 hl->new_restart_count + 1, sizeof(size_t))) return;
+    hl->new_restarts[hl->new_restart_count++] = offset;
+}
+
+// Where an offset of the old buffer ends up after the replacement
+static size_t map_offset(size_t p, size_t start, size_t end, size_t len) {
+    if (p <= start) return p;
+    if (p >= end) return p - (end - start) + len;
+    return start;
+}
+
+void highlight_edit(Highlight *hl, size_t start, size_t end, size_t len) {
+    if (!hl->fn) return;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < hl->count; i++) {
+        StyleSpan s = hl->spans[i];
+        s.start = map_offset(s.start, start, end, len);
+        s.end = map_offset(s.end, start, end, len);
+        if (s.end > s.start) hl->spans[kept++] = s;
+    }
+    hl->count = kept;
+
+    // The state at a restart inside the edit is unknown until the next run
+    kept = 0;
+    for (size_t i = 0; i < hl->restart_count; i++) {
+        size_t r = hl->restarts[i];
+        if (r > start && r <= end) continue;
+        hl->restarts[kept++] = map_offset(r, start, end, len);
+    }
+    hl->restart_count = kept;
+
+    if (hl->dirty) {
+        size_t old_end = hl->dirty_end == SIZE_MAX ? SIZE_MAX : map_offset(hl->dirty_end, start, end, len);
+        if (start < hl->dirty_start) hl->dirty_start = start;
+        hl->dirty_end = old_end > start + len ? old_end : start + len;
+    } else {
+        hl->dirty = true;
+        hl->dirty_start = start;
+        hl->dirty_end = start + len;
+    }
+}
+
+size_t highlight_find(const Highlight *hl, size_t offset) {
+    size_t lo = 0, hi = hl->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (hl->spans[mid].end <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Index of the first restart greater than offset
+static size_t restart_after(const Highlight *hl, size_t offset) {
+    size_t lo = 0, hi = hl->restart_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (hl->restarts[mid] <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void highlight_update(Highlight *hl, const char *buf, size_t len) {
+    if (!hl->fn || !hl->dirty) return;
+
+    // Start from the nearest restart point before the edit
+    size_t r = restart_after(hl, hl->dirty_start);
+    size_t from = r > 0 ? hl->restarts[r - 1] : 0;
+    if (from > len) from = 0;
+
+    hl->new_count = 0;
+    hl->new_restart_count = 0;
+    size_t dirty_end = hl->dirty_end > len ? len : hl->dirty_end;
+    size_t stop = hl->fn(hl, buf, len, from, dirty_end, hl->userdata);
+    if (stop < dirty_end || stop > len) stop = len;
+
+    // Splice the new spans in place of the cached ones in [from, stop)
+    size_t a = highlight_find(hl, from);
+    size_t b = a;
+    while (b < hl->count && hl->spans[b].start < stop) b++;
+    size_t tail = hl->count - b;
+    size_t count = a + hl->new_count + tail;
+    if (!reserve(hl->allocator, (void **)&hl->spans, &hl->capacity, count, sizeof(StyleSpan))) return;
+    if (tail > 0) memmove(hl->spans + a + hl->new_count, hl->spans + b, tail * sizeof(StyleSpan));
+    if (hl->new_count > 0) memcpy(hl->spans + a, hl->new_spans, hl->new_count * sizeof(StyleSpan));
+    hl->count = count;
+
+    // Same for the restart points in (from, stop)
+    a = restart_after(hl, from);
+    b = a;
+    while (b < hl->restart_count && hl->restarts[b] < stop) b++;
+    size_t n = 0;
+    for (size_t i = 0; i < hl->new_restart_count; i++) {
+        size_t off = hl->new_restarts[i];
+        if (off > from && off < stop) hl->new_restarts[n++] = off;
+    }
+    tail = hl->restart_count - b;
+    count = a + n + tail;
+    if (!reserve(hl->allocator, (void **)&hl->restarts, &hl->restart_capacity, count, sizeof(size_t))) return;
+    if (tail > 0) memmove(hl->restarts + a + n, hl->restarts + b, tail * sizeof(size_t));
+    if (n > 0) memcpy(hl->restarts + a, hl->new_restarts, n * sizeof(size_t));
+    hl->restart_count = count;
+
+    hl->dirty = false;
+}
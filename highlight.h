@@ -0,0 +1,71 @@
+#ifndef HIGHLIGHT_H
+#define HIGHLIGHT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "alloc.h"
+
+// A style is an SGR foreground code (30-37, 90-97, 0 for default) plus
+// attribute bits
+#define LINE_STYLE_DEFAULT   0u
+#define LINE_STYLE_FG(code)  ((unsigned)(code) & 0xffu)
+#define LINE_STYLE_BOLD      (1u << 8)
+#define LINE_STYLE_UNDERLINE (1u << 9)
+#define LINE_STYLE_REVERSE   (1u << 10)
+
+typedef struct {
+    size_t start;
+    size_t end;
+    unsigned style;
+} StyleSpan;
+
+typedef struct Highlight Highlight;
+
+// Called with a restart point from and the end of the edited range in
+// the new buffer.  Reports spans with highlight_span and offsets where
+// its state is back to initial with highlight_restart, in increasing
+// order from from.  Returns the offset it stopped at: len, or any
+// restart point past dirty_end after which the old spans still apply.
+typedef size_t (*LineHighlighter)(Highlight *hl, const char *buf, size_t len,
+                                  size_t from, size_t dirty_end, void *userdata);
+
+struct Highlight {
+    LineHighlighter fn;
+    void *userdata;
+
+    StyleSpan *spans;       // Cached spans, sorted and non-overlapping
+    size_t count;
+    size_t capacity;
+    size_t *restarts;       // Offsets the highlighter can start from
+    size_t restart_count;
+    size_t restart_capacity;
+
+    // Output of the highlighter run in progress
+    StyleSpan *new_spans;
+    size_t new_count;
+    size_t new_capacity;
+    size_t *new_restarts;
+    size_t new_restart_count;
+    size_t new_restart_capacity;
+
+    bool dirty;
+    size_t dirty_start;     // Edited range since the last run
+    size_t dirty_end;
+    const LineAllocator *allocator;
+};
+
+void highlight_init(Highlight *hl, const LineAllocator *a);     // NULL for the default
+void highlight_free(Highlight *hl);
+void highlight_set(Highlight *hl, LineHighlighter fn, void *userdata);
+void highlight_span(Highlight *hl, size_t start, size_t end, unsigned style);
+void highlight_restart(Highlight *hl, size_t offset);
+// Shift the cache for a replacement of [start, end) by len bytes
+void highlight_edit(Highlight *hl, size_t start, size_t end, size_t len);
+void highlight_reset(Highlight *hl);
+// Run the highlighter over what changed since the last update
+void highlight_update(Highlight *hl, const char *buf, size_t len);
+// Index of the first span ending after offset
+size_t highlight_find(const Highlight *hl, size_t offset);
+size_t highlight_memory_usage(const Highlight *hl);
+
+#endif // HIGHLIGHT_H
@@ -0,0 +1,174 @@
+#include "history.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HISTORY_INIT_CAP 64
+
+void history_init(History *h, size_t max, const LineAllocator *a) {
+    h->entries = NULL;
+    h->count = 0;
+    h->capacity = 0;
+    h->max = max;
+    h->clock = 0;
+    h->valid = false;
+    h->allocator = alloc_resolve(a);
+}
+
+void history_free(History *h) {
+    for (size_t i = 0; i < h->count; i++) {
+        mem_free(h->allocator, h->entries[i].text);
+    }
+    mem_free(h->allocator, h->entries);
+    h->entries = NULL;
+    h->count = h->capacity = 0;
+    h->valid = false;
+}
+
+size_t history_memory_usage(const History *h) {
+    size_t total = h->capacity * sizeof(HistoryEntry);
+    for (size_t i = 0; i < h->count; i++) {
+        total += h->entries[i].len + 1;
+    }
+    return total;
+}
+
+// Index of the first entry whose text is not less than text
+static size_t lower_bound(History *h, const char *text, bool *found) {
+    size_t lo = 0, hi = h->count;
+    *found = false;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(h->entries[mid].text, text);
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            if (cmp == 0) *found = true;
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void history_add(History *h, const char *text) {
+    if (!text || !*text || h->max == 0) return;
+
+    // Every add may shift or restamp entries
+    h->valid = false;
+
+    bool found;
+    size_t pos = lower_bound(h, text, &found);
+    if (found) {
+        h->entries[pos].stamp = h->clock++;
+        return;
+    }
+
+    if (h->count >= h->max) {
+        // Evict the oldest entry
+        size_t oldest = 0;
+        for (size_t i = 1; i < h->count; i++) {
+            if (h->entries[i].stamp < h->entries[oldest].stamp) oldest = i;
+        }
+        mem_free(h->allocator, h->entries[oldest].text);
+        memmove(&h->entries[oldest], &h->entries[oldest + 1],
+                (h->count - oldest - 1) * sizeof(HistoryEntry));
+        h->count--;
+        if (oldest < pos) pos--;
+    }
+
+    if (h->count >= h->capacity) {
+        h->capacity = h->capacity ? h->capacity * 2 : HISTORY_INIT_CAP;
+        h->entries = mem_realloc(h->allocator, h->entries, h->capacity * sizeof(HistoryEntry));
+    }
+
+    memmove(&h->entries[pos + 1], &h->entries[pos], (h->count - pos) * sizeof(HistoryEntry));
+    h->entries[pos].text = mem_strdup(h->allocator, text);
+    h->entries[pos].len = strlen(text);
+    h->entries[pos].stamp = h->clock++;
+    h->count++;
+}
+
+static unsigned char byte_at(const HistoryEntry *e, size_t p) {
+    return p < e->len ? (unsigned char)e->text[p] : 0;
+}
+
+// Narrow [lo, hi) to the entries whose byte at p is c.  Every entry in
+// the range already shares the first p bytes, so the bytes at p are
+// sorted and two binary searches on a single byte are enough.
+static void narrow(History *h, size_t p, unsigned char c) {
+    size_t lo = h->lo, hi = h->hi;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (byte_at(&h->entries[mid], p) < c) lo = mid + 1;
+        else hi = mid;
+    }
+    size_t first = lo;
+    hi = h->hi;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (byte_at(&h->entries[mid], p) <= c) lo = mid + 1;
+        else hi = mid;
+    }
+    h->lo = first;
+    h->hi = lo;
+}
+
+const HistoryEntry *history_suggest(History *h, const char *buf, size_t len) {
+    if (len == 0 || h->count == 0) {
+        h->valid = false;
+        return NULL;
+    }
+
+    // Reuse the previous range when the buffer only grew past the prefix
+    // it was computed for, otherwise start again from the whole index.
+    bool extend = h->valid && h->prefix_len <= len &&
+                  memcmp(h->entries[h->lo].text, buf, h->prefix_len) == 0;
+    if (!extend) {
+        h->lo = 0;
+        h->hi = h->count;
+        h->prefix_len = 0;
+        h->best = SIZE_MAX;
+        h->missed = false;
+    }
+    h->valid = true;
+
+    // Typing on after a prefix nothing matches finds nothing either
+    if (h->missed) {
+        if (h->prefix_len < len && (unsigned char)buf[h->prefix_len] == h->miss) return NULL;
+        h->missed = false;
+    }
+
+    for (size_t p = h->prefix_len; p < len; p++) {
+        size_t lo = h->lo, hi = h->hi;
+        narrow(h, p, (unsigned char)buf[p]);
+        if (h->lo == h->hi) {
+            // Keep the last range that matched, so the range is never empty
+            h->lo = lo;
+            h->hi = hi;
+            h->prefix_len = p;
+            h->miss = (unsigned char)buf[p];
+            h->missed = true;
+            return NULL;
+        }
+    }
+    h->prefix_len = len;
+
+    // An exact match sorts first and has nothing left to suggest
+    size_t start = h->lo;
+    if (start < h->hi && h->entries[start].len == len) start++;
+    if (start >= h->hi) {
+        h->best = SIZE_MAX;
+        return NULL;
+    }
+
+    // The most recent entry of a wider range stays the most recent of
+    // any narrower range that still contains it.
+    if (h->best == SIZE_MAX || h->best < start || h->best >= h->hi) {
+        h->best = start;
+        for (size_t i = start + 1; i < h->hi; i++) {
+            if (h->entries[i].stamp > h->entries[h->best].stamp) h->best = i;
+        }
+    }
+
+    return &h->entries[h->best];
+}
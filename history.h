@@ -0,0 +1,40 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "alloc.h"
+
+typedef struct {
+    char *text;
+    size_t len;
+    unsigned long stamp; // Higher is more recent
+} HistoryEntry;
+
+typedef struct {
+    HistoryEntry *entries; // Sorted by text, this is the prefix index
+    size_t count;
+    size_t capacity;
+    size_t max;            // Maximum number of entries kept
+    unsigned long clock;   // Stamp given to the next added entry
+
+    // Incremental suggestion state, the range [lo, hi) of entries
+    // sharing the first prefix_len bytes of the last queried buffer
+    size_t lo;
+    size_t hi;
+    size_t prefix_len;
+    size_t best;           // Most recent entry in the range, or SIZE_MAX
+    bool missed;           // No entry goes on from the range with byte miss
+    unsigned char miss;
+    bool valid;
+    const LineAllocator *allocator;
+} History;
+
+void history_init(History *h, size_t max, const LineAllocator *a);  // NULL for the default
+void history_free(History *h);
+void history_add(History *h, const char *text);
+size_t history_memory_usage(const History *h);
+// Return the most recent entry strictly longer than buf that starts with it
+const HistoryEntry *history_suggest(History *h, const char *buf, size_t len);
+
+#endif // HISTORY_H
@@ -6,25 +6,52 @@
 
 #define KEYMAP_INIT_CAP 32
 
-void keymap_init(KeyMap *keymap) {
-    keymap->bindings = malloc(KEYMAP_INIT_CAP * sizeof(KeyBinding));
+void keymap_init(KeyMap *keymap, const LineAllocator *a) {
+    keymap->allocator = alloc_resolve(a);
+    keymap->bindings = mem_alloc(keymap->allocator, KEYMAP_INIT_CAP * sizeof(KeyBinding));
     keymap->count = 0;
     keymap->capacity = KEYMAP_INIT_CAP;
+    memset(keymap->single, 0, sizeof(keymap->single));
+    memset(keymap->prefixes, 0, sizeof(keymap->prefixes));
 }
 
 void keymap_free(KeyMap *keymap) {
     for (size_t i = 0; i < keymap->count; i++) {
-        free(keymap->bindings[i].description);
-        free(keymap->bindings[i].notation);
+        mem_free(keymap->allocator, keymap->bindings[i].description);
+        mem_free(keymap->allocator, keymap->bindings[i].notation);
     }
-    free(keymap->bindings);
+    mem_free(keymap->allocator, keymap->bindings);
     keymap->bindings = NULL;
     keymap->count = keymap->capacity = 0;
+    memset(keymap->single, 0, sizeof(keymap->single));
+    memset(keymap->prefixes, 0, sizeof(keymap->prefixes));
 }
 
 
+// A chord like "C-x (" is its keys one after another
+static bool parse_chord(const char *notation, KeySequence *seq) {
+    memset(seq, 0, sizeof(KeySequence));
+    const char *p = notation;
+    while (*p) {
+        while (*p == ' ') p++;
+        size_t len = strcspn(p, " ");
+        if (len == 0) break;
+
+        char part[32];
+        KeySequence key;
+        if (len >= sizeof(part)) return false;
+        memcpy(part, p, len);
+        part[len] = '\0';
+        if (!parse_key_notation(part, &key)) return false;
+        if (seq->length + key.length >= sizeof(seq->sequence)) return false;
+        memcpy(seq->sequence + seq->length, key.sequence, key.length);
+        seq->length += key.length;
+        p += len;
+    }
+    return seq->length > 0;
+}
+
 // TODO C-M-P doesn't work
-// TODO Keychords
 bool parse_key_notation(const char *notation, KeySequence *seq) {
     if (!notation || !seq) return false;
     
@@ -32,6 +59,7 @@ bool parse_key_notation(const char *notation, KeySequence *seq) {
     size_t len = strlen(notation);
     
     if (len == 0) return false;
+    if (len > 1 && strchr(notation, ' ')) return parse_chord(notation, seq);
     
     // Handle single character keys
     if (len == 1) {
@@ -115,7 +143,7 @@ bool parse_key_notation(const char *notation, KeySequence *seq) {
     }
     
     // At this point, key_part should point to the base key
-    if (len == 0) return false;
+    if (len != 1) return false;
     
     // Handle the base key
     char base_key = key_part[0];
@@ -143,6 +171,7 @@ bool parse_key_notation(const char *notation, KeySequence *seq) {
                 case ']': seq->sequence[pos++] = 29; break;  // C-]
                 case '^': seq->sequence[pos++] = 30; break;  // C-^
                 case '_': seq->sequence[pos++] = 31; break;  // C-_
+                case '/': seq->sequence[pos++] = 31; break;  // C-/ sends the same byte as C-_
                 default: return false; // Unsupported control combination
             }
         }
@@ -165,8 +194,8 @@ bool keymap_bind(KeyMap *keymap, const char *notation, KeyAction action, const c
     for (size_t i = 0; i < keymap->count; i++) {
         if (key_sequence_equal(&keymap->bindings[i].key, &seq)) {
             keymap->bindings[i].action = action;
-            free(keymap->bindings[i].description);
-            keymap->bindings[i].description = description ? strdup(description) : NULL;
+            mem_free(keymap->allocator, keymap->bindings[i].description);
+            keymap->bindings[i].description = description ? mem_strdup(keymap->allocator, description) : NULL;
             return true;
         }
     }
@@ -174,14 +203,17 @@ bool keymap_bind(KeyMap *keymap, const char *notation, KeyAction action, const c
     // Add new binding
     if (keymap->count >= keymap->capacity) {
         keymap->capacity *= 2;
-        keymap->bindings = realloc(keymap->bindings, keymap->capacity * sizeof(KeyBinding));
+        keymap->bindings = mem_realloc(keymap->allocator, keymap->bindings, keymap->capacity * sizeof(KeyBinding));
     }
     
     KeyBinding *binding = &keymap->bindings[keymap->count];
     binding->key = seq;
     binding->action = action;
-    binding->description = description ? strdup(description) : NULL;
-    binding->notation = strdup(notation);
+    binding->description = description ? mem_strdup(keymap->allocator, description) : NULL;
+    binding->notation = mem_strdup(keymap->allocator, notation);
+    unsigned char first = seq.sequence[0];
+    if (seq.length == 1) keymap->single[first] = keymap->count + 1;
+    else keymap->prefixes[first >> 3] |= 1u << (first & 7);
     
     keymap->count++;
     return true;
@@ -195,14 +227,25 @@ bool keymap_unbind(KeyMap *keymap, const char *notation) {
     
     for (size_t i = 0; i < keymap->count; i++) {
         if (key_sequence_equal(&keymap->bindings[i].key, &seq)) {
-            free(keymap->bindings[i].description);
-            free(keymap->bindings[i].notation);
+            mem_free(keymap->allocator, keymap->bindings[i].description);
+            mem_free(keymap->allocator, keymap->bindings[i].notation);
+            if (seq.length == 1) keymap->single[(unsigned char)seq.sequence[0]] = 0;
             
             // Move last binding to this position
             if (i < keymap->count - 1) {
                 keymap->bindings[i] = keymap->bindings[keymap->count - 1];
+                const KeySequence *moved = &keymap->bindings[i].key;
+                if (moved->length == 1) keymap->single[(unsigned char)moved->sequence[0]] = i + 1;
             }
             keymap->count--;
+
+            // Other bindings may still start with the same byte
+            memset(keymap->prefixes, 0, sizeof(keymap->prefixes));
+            for (size_t b = 0; b < keymap->count; b++) {
+                const KeySequence *key = &keymap->bindings[b].key;
+                unsigned char first = key->sequence[0];
+                if (key->length > 1) keymap->prefixes[first >> 3] |= 1u << (first & 7);
+            }
             return true;
         }
     }
@@ -212,6 +255,12 @@ bool keymap_unbind(KeyMap *keymap, const char *notation) {
 
 KeyAction keymap_lookup(KeyMap *keymap, const KeySequence *seq) {
     if (!keymap || !seq) return NULL;
+
+    // Most keys are one byte, those need no scan
+    if (seq->length == 1) {
+        unsigned short i = keymap->single[(unsigned char)seq->sequence[0]];
+        return i ? keymap->bindings[i - 1].action : NULL;
+    }
     
     for (size_t i = 0; i < keymap->count; i++) {
         if (key_sequence_equal(&keymap->bindings[i].key, seq)) {
@@ -222,6 +271,18 @@ KeyAction keymap_lookup(KeyMap *keymap, const KeySequence *seq) {
     return NULL;
 }
 
+bool keymap_is_prefix(KeyMap *keymap, const KeySequence *seq) {
+    unsigned char first = seq->sequence[0];
+    if (!(keymap->prefixes[first >> 3] & (1u << (first & 7)))) return false;
+    for (size_t i = 0; i < keymap->count; i++) {
+        const KeySequence *key = &keymap->bindings[i].key;
+        if (key->length > seq->length && memcmp(key->sequence, seq->sequence, seq->length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 KeyBinding *keymap_find_binding(KeyMap *keymap, const char *notation) {
     if (!keymap || !notation) return NULL;
     
@@ -260,6 +321,15 @@ void keymap_print_bindings(KeyMap *keymap) {
     }
 }
 
+size_t keymap_memory_usage(const KeyMap *keymap) {
+    size_t total = keymap->capacity * sizeof(KeyBinding);
+    for (size_t i = 0; i < keymap->count; i++) {
+        if (keymap->bindings[i].description) total += strlen(keymap->bindings[i].description) + 1;
+        if (keymap->bindings[i].notation) total += strlen(keymap->bindings[i].notation) + 1;
+    }
+    return total;
+}
+
 bool make_key_sequence(const char *raw_input, size_t input_len, KeySequence *seq) {
     if (!raw_input || !seq || input_len == 0 || input_len > 7) return false;
     
@@ -270,6 +340,31 @@ bool make_key_sequence(const char *raw_input, size_t input_len, KeySequence *seq
     return true;
 }
 
+// Length of the key sequence at the start of buf, or 0 if it is incomplete.
+// CSI sequences run up to their final byte, SS3 sequences take one more
+// byte and any other byte after ESC is a Meta key.
+size_t key_sequence_length(const char *buf, size_t n) {
+    if (n == 0) return 0;
+    if (buf[0] != 27) return 1;
+    if (n < 2) return 0;
+
+    if (buf[1] == '[') {
+        for (size_t i = 2; i < n && i < sizeof(((KeySequence *)0)->sequence) - 1; i++) {
+            unsigned char b = buf[i];
+            if (b >= 0x40 && b <= 0x7e) return i + 1;
+        }
+        // Too long to ever fit a KeySequence, take what we have
+        if (n >= sizeof(((KeySequence *)0)->sequence) - 1) {
+            return sizeof(((KeySequence *)0)->sequence) - 1;
+        }
+        return 0;
+    }
+
+    if (buf[1] == 'O') return n >= 3 ? 3 : 0;
+
+    return 2;
+}
+
 bool key_sequence_equal(const KeySequence *a, const KeySequence *b) {
     if (!a || !b) return false;
     
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include "alloc.h"
 
 typedef struct Line Line; // Forward declaration
 
@@ -24,22 +25,29 @@ typedef struct {
     KeyBinding *bindings;
     size_t count;
     size_t capacity;
+    unsigned short single[256];  // Index + 1 of the binding of each one-byte key, 0 if none
+    unsigned char prefixes[32];  // Bit set for the first byte of each longer binding
+    const LineAllocator *allocator;
 } KeyMap;
 
 
-void keymap_init(KeyMap *keymap);
+void keymap_init(KeyMap *keymap, const LineAllocator *a);   // NULL for the default
 void keymap_free(KeyMap *keymap);
 
 bool parse_key_notation(const char *notation, KeySequence *seq);
 bool keymap_bind(KeyMap *keymap, const char *notation, KeyAction action, const char *description);
 bool keymap_unbind(KeyMap *keymap, const char *notation);
 KeyAction keymap_lookup(KeyMap *keymap, const KeySequence *seq); // Find action for a key sequence
+bool keymap_is_prefix(KeyMap *keymap, const KeySequence *seq);  // Starts a longer binding, like C-x
 // Find binding by notation (for debugging/introspection)
 KeyBinding *keymap_find_binding(KeyMap *keymap, const char *notation);
 void keymap_print_bindings(KeyMap *keymap);  // Print all bindings (for debugging)
+size_t keymap_memory_usage(const KeyMap *keymap);
 
 // Helper function to convert raw input to KeySequence
 bool make_key_sequence(const char *raw_input, size_t input_len, KeySequence *seq);
+// Bytes of the key at the start of buf, 0 if it is incomplete
+size_t key_sequence_length(const char *buf, size_t n);
 bool key_sequence_equal(const KeySequence *a, const KeySequence *b);
 
 #endif // KEYMAP_H
@@ -5,21 +5,48 @@
 #include <unistd.h>
 #include <sys/wait.h>
 
-void initKillRing(KillRing* kr, int capacity) {
-    kr->entries = malloc(sizeof(char*) * capacity);
+#define KILLRING_INIT_SLOTS 8
+
+// Entries are allocated as the ring fills, so an unused ring costs nothing
+void initKillRing(KillRing* kr, int capacity, const LineAllocator *a) {
+    kr->entries = NULL;
     kr->size = 0;
     kr->capacity = capacity;
     kr->index = 0;
-    for (int i = 0; i < capacity; i++) {
-        kr->entries[i] = NULL;
-    }
+    kr->allocated = 0;
+    kr->allocator = alloc_resolve(a);
 }
 
 void freeKillRing(KillRing* kr) {
-    for (int i = 0; i < kr->capacity; i++) {
-        free(kr->entries[i]);
+    for (int i = 0; i < kr->allocated; i++) {
+        mem_free(kr->allocator, kr->entries[i]);
+    }
+    mem_free(kr->allocator, kr->entries);
+    kr->entries = NULL;
+    kr->size = kr->index = kr->allocated = 0;
+}
+
+size_t kr_memory_usage(const KillRing* kr) {
+    size_t total = kr->allocated * sizeof(char*);
+    for (int i = 0; i < kr->allocated; i++) {
+        if (kr->entries[i]) total += strlen(kr->entries[i]) + 1;
     }
-    free(kr->entries);
+    return total;
+}
+
+static int kr_reserve(KillRing* kr) {
+    if (kr->index < kr->allocated) return 1;
+
+    int allocated = kr->allocated ? kr->allocated * 2 : KILLRING_INIT_SLOTS;
+    if (allocated > kr->capacity) allocated = kr->capacity;
+    char** entries = mem_realloc(kr->allocator, kr->entries, sizeof(char*) * allocated);
+    if (!entries) return 0;
+    for (int i = kr->allocated; i < allocated; i++) {
+        entries[i] = NULL;
+    }
+    kr->entries = entries;
+    kr->allocated = allocated;
+    return 1;
 }
 
 void copy_to_clipboard(const char* text) {
@@ -80,7 +107,8 @@ void copy_to_clipboard(const char* text) {
     }
 }
 
-char* paste_from_clipboard() {
+char* paste_from_clipboard(const LineAllocator *a) {
+    a = alloc_resolve(a);
     int pipefd[2];
     if (pipe(pipefd) == -1) {
         return NULL;
@@ -108,7 +136,7 @@ char* paste_from_clipboard() {
         char* result = NULL;
         size_t total_size = 0;
         size_t buffer_size = 4096;
-        char* buffer = malloc(buffer_size);
+        char* buffer = mem_alloc(a, buffer_size);
         
         if (!buffer) {
             close(pipefd[0]);
@@ -119,10 +147,10 @@ char* paste_from_clipboard() {
         
         ssize_t bytes_read;
         while ((bytes_read = read(pipefd[0], buffer, buffer_size)) > 0) {
-            char* new_result = realloc(result, total_size + bytes_read + 1);
+            char* new_result = mem_realloc(a, result, total_size + bytes_read + 1);
             if (!new_result) {
-                free(result);
-                free(buffer);
+                mem_free(a, result);
+                mem_free(a, buffer);
                 close(pipefd[0]);
                 int status;
                 waitpid(pid, &status, 0);
@@ -134,7 +162,7 @@ char* paste_from_clipboard() {
         }
         
         close(pipefd[0]);
-        free(buffer);
+        mem_free(a, buffer);
         
         // Wait for child process to complete
         int status;
@@ -149,16 +177,27 @@ char* paste_from_clipboard() {
 }
 
 void kr_kill(KillRing* kr, const char* text) {
+    kr_push(kr, text);
+
+    // Also copy the text to the system clipboard
+    copy_to_clipboard(text);
+}
+
+const char* kr_latest(const KillRing* kr) {
+    if (kr->size == 0) return NULL;
+    return kr->entries[(kr->index + kr->capacity - 1) % kr->capacity];
+}
+
+void kr_push(KillRing* kr, const char* text) {
+    if (kr->capacity <= 0 || !kr_reserve(kr)) return;
+
     if (kr->size >= kr->capacity) {
         // Free the oldest entry if the ring is full
-        free(kr->entries[kr->index]);
+        mem_free(kr->allocator, kr->entries[kr->index]);
     } else {
         kr->size++;
     }
 
-    kr->entries[kr->index] = strdup(text);
+    kr->entries[kr->index] = mem_strdup(kr->allocator, text);
     kr->index = (kr->index + 1) % kr->capacity;
-
-    // Also copy the text to the system clipboard
-    copy_to_clipboard(text);
 }
@@ -1,18 +1,26 @@
 #ifndef KILLRING_H
 #define KILLRING_H
 
+#include <stddef.h>
+#include "alloc.h"
+
 typedef struct {
     char **entries; // Array of strings
     int size;       // Number of entries currently in the kill ring
     int capacity;   // Maximum number of entries
     int index;      // Current index for yanking
+    int allocated;  // Slots of entries allocated so far, grows up to capacity
+    const LineAllocator *allocator;
 } KillRing;
 
-void initKillRing(KillRing* kr, int capacity);
+void initKillRing(KillRing* kr, int capacity, const LineAllocator *a);  // NULL for the default
 void freeKillRing(KillRing* kr);
+size_t kr_memory_usage(const KillRing* kr);
 void copy_to_clipboard(const char* text);
-char* paste_from_clipboard();
+char* paste_from_clipboard(const LineAllocator *a);    // For a to free
 void kr_kill(KillRing* kr, const char* text);
+void kr_push(KillRing* kr, const char* text);   // Like kr_kill without the clipboard
+const char* kr_latest(const KillRing* kr);      // Most recent entry, or NULL
 
 #endif // KILLRING_H
 
@@ -0,0 +1,61 @@
+#include "macro.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MACRO_INIT_CAP 64
+
+void macro_init(KeyMacro *m, const LineAllocator *a) {
+    memset(m, 0, sizeof(KeyMacro));
+    m->allocator = alloc_resolve(a);
+}
+
+void macro_free(KeyMacro *m) {
+    const LineAllocator *a = m->allocator;
+    mem_free(a, m->keys);
+    memset(m, 0, sizeof(KeyMacro));
+    m->allocator = a;
+}
+
+void macro_start(KeyMacro *m) {
+    m->len = 0;
+    m->last = 0;
+    m->defining = true;
+}
+
+void macro_record(KeyMacro *m, const KeySequence *seq) {
+    if (!m->defining || m->executing) return;
+
+    size_t need = m->len + 1 + seq->length;
+    if (need > m->cap) {
+        size_t cap = m->cap ? m->cap : MACRO_INIT_CAP;
+        while (cap < need) cap *= 2;
+        char *keys = mem_realloc(m->allocator, m->keys, cap);
+        if (!keys) return;
+        m->keys = keys;
+        m->cap = cap;
+    }
+    m->last = m->len;
+    m->keys[m->len++] = (char)seq->length;
+    memcpy(m->keys + m->len, seq->sequence, seq->length);
+    m->len += seq->length;
+}
+
+void macro_end(KeyMacro *m) {
+    if (!m->defining) return;
+    m->len = m->last;
+    m->defining = false;
+}
+
+bool macro_next(const KeyMacro *m, size_t *pos, KeySequence *seq) {
+    if (*pos >= m->len) return false;
+    size_t length = (unsigned char)m->keys[*pos];
+    memset(seq, 0, sizeof(KeySequence));
+    memcpy(seq->sequence, m->keys + *pos + 1, length);
+    seq->length = length;
+    *pos += 1 + length;
+    return true;
+}
+
+size_t macro_memory_usage(const KeyMacro *m) {
+    return m->cap;
+}
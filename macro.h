@@ -0,0 +1,30 @@
+#ifndef MACRO_H
+#define MACRO_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "keymap.h"
+#include "alloc.h"
+
+// The last keyboard macro, stored as the keys that were dispatched: a
+// length byte followed by the key's bytes, back to back
+typedef struct {
+    char *keys;
+    size_t len;
+    size_t cap;
+    size_t last;        // Offset of the most recent key
+    bool defining;
+    bool executing;
+    const LineAllocator *allocator;
+} KeyMacro;
+
+void macro_init(KeyMacro *m, const LineAllocator *a);   // NULL for the default
+void macro_free(KeyMacro *m);
+void macro_start(KeyMacro *m);          // Forget the old macro and record a new one
+void macro_record(KeyMacro *m, const KeySequence *seq);
+void macro_end(KeyMacro *m);            // Stop, dropping the key that ended it
+// Key at *pos, advancing *pos, false at the end
+bool macro_next(const KeyMacro *m, size_t *pos, KeySequence *seq);
+size_t macro_memory_usage(const KeyMacro *m);
+
+#endif // MACRO_H
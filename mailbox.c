@@ -0,0 +1,109 @@
+#include "mailbox.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void mailbox_init(Mailbox *m) {
+    memset(m, 0, sizeof(Mailbox));
+    pthread_mutex_init(&m->lock, NULL);
+    m->fds[0] = m->fds[1] = -1;
+    atomic_init(&m->full, false);
+}
+
+void mailbox_free(Mailbox *m) {
+    if (m->fds[0] >= 0) close(m->fds[0]);
+    if (m->fds[1] >= 0) close(m->fds[1]);
+    free(m->text);
+    free(m->prompt);
+    pthread_mutex_destroy(&m->lock);
+    memset(m, 0, sizeof(Mailbox));
+    m->fds[0] = m->fds[1] = -1;
+}
+
+bool mailbox_open(Mailbox *m) {
+    if (m->fds[0] >= 0) return true;
+    if (pipe(m->fds) != 0) {
+        m->fds[0] = m->fds[1] = -1;
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(m->fds[i], F_SETFL, fcntl(m->fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(m->fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+}
+
+int mailbox_fd(const Mailbox *m) {
+    return m->fds[0];
+}
+
+// Called with the lock held after adding to an empty mailbox
+static void wake(Mailbox *m) {
+    if (atomic_exchange(&m->full, true)) return;
+    char b = 0;
+    while (write(m->fds[1], &b, 1) < 0 && errno == EINTR) {}
+}
+
+bool mailbox_print(Mailbox *m, const char *text, size_t len) {
+    if (m->fds[0] < 0) return false;
+    bool newline = len == 0 || text[len - 1] != '\n';
+    pthread_mutex_lock(&m->lock);
+    bool ok = true;
+    if (m->len + len + newline > m->cap) {
+        size_t cap = m->cap ? m->cap : 256;
+        while (cap < m->len + len + newline) cap *= 2;
+        char *grown = realloc(m->text, cap);
+        if (grown) {
+            m->text = grown;
+            m->cap = cap;
+        } else {
+            ok = false;
+        }
+    }
+    if (ok) {
+        memcpy(m->text + m->len, text, len);
+        m->len += len;
+        if (newline) m->text[m->len++] = '\n';
+        wake(m);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return ok;
+}
+
+bool mailbox_prompt(Mailbox *m, const char *prompt) {
+    if (m->fds[0] < 0) return false;
+    char *copy = prompt ? strdup(prompt) : NULL;
+    if (prompt && !copy) return false;
+
+    pthread_mutex_lock(&m->lock);
+    free(m->prompt);
+    m->prompt = copy;
+    // A refetch replaces a posted prompt, a posted prompt a refetch
+    m->refetch = !prompt;
+    wake(m);
+    pthread_mutex_unlock(&m->lock);
+    return true;
+}
+
+bool mailbox_take(Mailbox *m, MailboxBatch *batch) {
+    if (!atomic_load(&m->full)) return false;
+
+    pthread_mutex_lock(&m->lock);
+    batch->text = m->text;
+    batch->len = m->len;
+    batch->prompt = m->prompt;
+    batch->refetch = m->refetch;
+    m->text = NULL;
+    m->len = m->cap = 0;
+    m->prompt = NULL;
+    m->refetch = false;
+    atomic_store(&m->full, false);
+    // wake writes under the lock, so the pipe holds its byte by now and
+    // no other comes until the next post
+    char drain[64];
+    while (read(m->fds[0], drain, sizeof(drain)) > 0) {}
+    pthread_mutex_unlock(&m->lock);
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Requests other threads leave for the thread reading a line: text to
+// print above it and a new prompt.  Posting writes a byte to a pipe
+// only when the mailbox was empty, so a burst of posts wakes the reader
+// once and it takes them all in one go.  Its memory comes from malloc
+// whatever allocator the Line has, since any thread may post.
+typedef struct {
+    pthread_mutex_t lock;
+    int fds[2];             // Self-pipe, -1 until mailbox_open
+    atomic_bool full;       // Something is waiting, checked without the lock
+    char *text;             // Text to print, each piece ending in a newline
+    size_t len;
+    size_t cap;
+    char *prompt;           // Latest prompt posted, NULL for none
+    bool refetch;           // Ask the prompt callback again
+} Mailbox;
+
+// What mailbox_take hands over, for the taker to free
+typedef struct {
+    char *text;
+    size_t len;
+    char *prompt;
+    bool refetch;
+} MailboxBatch;
+
+void mailbox_init(Mailbox *m);
+void mailbox_free(Mailbox *m);
+bool mailbox_open(Mailbox *m);      // Create the pipe, once
+int mailbox_fd(const Mailbox *m);   // Readable while something waits, -1 if not open
+// Safe from any thread, false if the mailbox isn't open or memory ran out.
+// Text without a newline at the end gets one.
+bool mailbox_print(Mailbox *m, const char *text, size_t len);
+bool mailbox_prompt(Mailbox *m, const char *prompt);  // NULL to refetch
+// Take everything posted so far, false if there was nothing
+bool mailbox_take(Mailbox *m, MailboxBatch *batch);
+
+#endif // MAILBOX_H
@@ -1,17 +1,28 @@
 #include "eline.h"
 #include <stdio.h>
 
-Line line;
+// A trailing backslash continues the input on the next line
+static bool input_complete(const char *buf, size_t len, const LineEdit *edit, void *userdata) {
+    (void)edit;
+    (void)userdata;
+    return len == 0 || buf[len - 1] != '\\';
+}
 
 int main() {
+    Line line;
     line_init(&line);
+    line_set_input_complete(&line, input_complete, NULL);
+    line_set_continuation_prompt(&line, ".. ");
+    keymap_print_bindings(&line.keymap);
 
     printf("ELines REPL (Press Ctrl-D to exit)\n");
     while (1) {
-        bool success = line_read(&line, ">> ");
+        // Escapes in the prompt take no columns
+        bool success = line_read(&line, "\033[1;34m>>\033[0m ");
         if (!success) break;  // Ctrl-D on empty line exits
 
         printf("You entered: '%s'\n", line.buffer);
+        line_history_add(&line, line.buffer);
     }
 
     line_free(&line);
@@ -0,0 +1,86 @@
+#include "metrics.h"
+#include <time.h>
+
+unsigned long long metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metrics_stop(MetricsTimer *t, unsigned long long start) {
+    metrics_record(t, metrics_now() - start);
+}
+
+void metrics_record(MetricsTimer *t, unsigned long long ns) {
+    t->count++;
+    t->ns += ns;
+    if (ns > t->max_ns) t->max_ns = ns;
+
+    unsigned long long us = ns / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < METRICS_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    t->histogram[bucket]++;
+}
+
+MetricsTimer *metrics_action(LineMetrics *m, KeyAction action) {
+    for (size_t i = 0; i < m->action_count; i++) {
+        if (m->actions[i].action == action) return &m->actions[i].time;
+    }
+    if (m->action_count == METRICS_MAX_ACTIONS) return &m->other_actions;
+
+    ActionMetrics *a = &m->actions[m->action_count++];
+    a->action = action;
+    return &a->time;
+}
+
+unsigned long long metrics_percentile_us(const MetricsTimer *t, int p) {
+    unsigned long need = (t->count * p + 99) / 100;
+    unsigned long seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+        seen += t->histogram[i];
+        if (seen >= need) return 1ull << i;
+    }
+    return 0;
+}
+
+static void dump_timer(FILE *f, const char *key, const char *name, const MetricsTimer *t) {
+    if (t->count == 0) return;
+    unsigned long long p99 = metrics_percentile_us(t, 99);
+    fprintf(f, "  %-8s %-32.32s %8lu %12.1f %9.2f %9.1f ", key, name, t->count,
+            t->ns / 1000.0, t->ns / 1000.0 / t->count, t->max_ns / 1000.0);
+    if (p99) fprintf(f, "%8llu\n", p99);
+    else fprintf(f, "%8s\n", "-");
+}
+
+void metrics_dump(const LineMetrics *m, const KeyMap *keymap, FILE *f) {
+    fprintf(f, "eline metrics: %lu keys, %lu reads (%llu bytes), %lu writes (%llu bytes), "
+               "%lu refreshes (%llu bytes, %lu skipped), %lu clipboard spawns\n",
+            m->keys, m->reads, m->read_bytes, m->writes, m->write_bytes,
+            m->refresh.count, m->refresh_bytes, m->skipped_frames, m->clipboard_spawns);
+    fprintf(f, "  %-8s %-32s %8s %12s %9s %9s %8s\n",
+            "key", "phase", "count", "total us", "mean us", "max us", "p99 <us");
+
+    dump_timer(f, "", "decode", &m->decode);
+    dump_timer(f, "", "keymap lookup", &m->lookup);
+    dump_timer(f, "", "refresh", &m->refresh);
+    dump_timer(f, "", "pipeline: read to taken", &m->queued);
+    dump_timer(f, "", "pipeline: taken to frame", &m->frame_wait);
+    dump_timer(f, "", "pipeline: frame to written", &m->write);
+    dump_timer(f, "", "pipeline: read to written", &m->key_to_screen);
+    dump_timer(f, "", "self-insert", &m->self_insert);
+    for (size_t i = 0; i < m->action_count; i++) {
+        const char *key = "?", *name = "";
+        for (size_t b = 0; b < keymap->count; b++) {
+            if (keymap->bindings[b].action == m->actions[i].action) {
+                key = keymap->bindings[b].notation;
+                name = keymap->bindings[b].description;
+                break;
+            }
+        }
+        dump_timer(f, key, name, &m->actions[i].time);
+    }
+    dump_timer(f, "", "other commands", &m->other_actions);
+}
@@ -0,0 +1,59 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "keymap.h"
+
+#define METRICS_BUCKETS 20      // Bucket 0 is below 1us, bucket i below 2^i us
+#define METRICS_MAX_ACTIONS 64
+
+// Times of one phase or command
+typedef struct {
+    unsigned long count;
+    unsigned long long ns;      // Total
+    unsigned long long max_ns;
+    unsigned long histogram[METRICS_BUCKETS];
+} MetricsTimer;
+
+typedef struct {
+    KeyAction action;
+    MetricsTimer time;
+} ActionMetrics;
+
+// What a Line spent its time on.  The refresh timer covers drawing and
+// the write; command timers only cover the command itself.
+typedef struct {
+    unsigned long keys;             // Decoded keys
+    MetricsTimer decode;            // Splitting input into keys
+    MetricsTimer lookup;            // keymap_lookup
+    MetricsTimer self_insert;       // Printable keys without a binding
+    MetricsTimer refresh;
+    unsigned long long refresh_bytes;
+    unsigned long skipped_frames;   // Refreshes folded into a later frame
+    ActionMetrics actions[METRICS_MAX_ACTIONS];
+    size_t action_count;
+    MetricsTimer other_actions;     // Commands past METRICS_MAX_ACTIONS
+    unsigned long reads;
+    unsigned long long read_bytes;
+    unsigned long writes;
+    unsigned long long write_bytes;
+    unsigned long clipboard_spawns; // xclip runs for copy and paste
+    // Stages of the threaded pipeline, see line_pipeline_enable
+    MetricsTimer queued;            // A key read until the editor takes it
+    MetricsTimer frame_wait;        // A key taken until a frame showing it goes to the writer
+    MetricsTimer write;             // A frame handed to the writer until it is written
+    MetricsTimer key_to_screen;     // A key read until a frame showing it is written
+} LineMetrics;
+
+unsigned long long metrics_now(void);                   // Monotonic ns
+void metrics_stop(MetricsTimer *t, unsigned long long start);
+void metrics_record(MetricsTimer *t, unsigned long long ns);   // A time measured elsewhere
+MetricsTimer *metrics_action(LineMetrics *m, KeyAction action);
+// Upper bound of the time below which p percent of the samples fall,
+// 0 if the last, unbounded bucket is needed
+unsigned long long metrics_percentile_us(const MetricsTimer *t, int p);
+// Commands are named after their first binding in keymap
+void metrics_dump(const LineMetrics *m, const KeyMap *keymap, FILE *f);
+
+#endif // METRICS_H
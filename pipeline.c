@@ -0,0 +1,331 @@
+#include "pipeline.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+static bool open_pipe(int fds[2]) {
+    if (pipe(fds) != 0) {
+        fds[0] = fds[1] = -1;
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+}
+
+static void close_pipe(int fds[2]) {
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+    fds[0] = fds[1] = -1;
+}
+
+static void poke(int fd) {
+    char b = 0;
+    while (write(fd, &b, 1) < 0 && errno == EINTR) {}
+}
+
+static void drain(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+}
+
+static void wake_editor(Pipeline *p) {
+    if (!atomic_exchange(&p->woken, true)) poke(p->wake[1]);
+}
+
+static bool ring_full(Pipeline *p) {
+    size_t tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    return tail - atomic_load_explicit(&p->head, memory_order_acquire) == PIPELINE_KEYS;
+}
+
+// Only called by the reader once ring_full said there is room
+static void push(Pipeline *p, const char *bytes, size_t len) {
+    size_t tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    PipelineKey *k = &p->keys[tail & (PIPELINE_KEYS - 1)];
+    memset(&k->key, 0, sizeof(KeySequence));
+    memcpy(k->key.sequence, bytes, len);
+    k->key.length = len;
+    k->read_at = p->read_at;
+    atomic_store_explicit(&p->tail, tail + 1, memory_order_release);
+}
+
+// Decode whole keys from rbuf into the ring while it has room
+static void decode(Pipeline *p) {
+    bool pushed = false;
+    while (p->rstart < p->rend && !ring_full(p)) {
+        size_t k = key_sequence_length(p->rbuf + p->rstart, p->rend - p->rstart);
+        if (k == 0) break;
+        push(p, p->rbuf + p->rstart, k);
+        p->rstart += k;
+        pushed = true;
+    }
+    if (p->rstart == p->rend) p->rstart = p->rend = 0;
+    if (pushed) wake_editor(p);
+}
+
+// Decode what was read, then wait for more input or for a lone ESC to
+// time out.  False at the end of input.
+static bool reader_step(Pipeline *p) {
+    decode(p);
+    if (ring_full(p)) return true;
+
+    // The start of a key stays at the front until the rest arrives
+    if (p->rstart > 0) {
+        memmove(p->rbuf, p->rbuf + p->rstart, p->rend - p->rstart);
+        p->rend -= p->rstart;
+        p->rstart = 0;
+    }
+    bool partial = p->rend > 0;
+    struct pollfd fds[2] = {{p->in_fd, POLLIN, 0}, {p->ctl[0], POLLIN, 0}};
+    int ready = poll(fds, 2, partial ? PIPELINE_ESCAPE_MS : -1);
+    if (ready < 0) return errno == EINTR || errno == EAGAIN;
+    if (fds[1].revents) drain(p->ctl[0]);
+    if (ready == 0 && partial) {
+        // Nothing completed it in time, take it as it is
+        push(p, p->rbuf, p->rend);
+        p->rend = 0;
+        wake_editor(p);
+        return true;
+    }
+    if (!fds[0].revents) return true;
+
+    ssize_t n = read(p->in_fd, p->rbuf + p->rend, sizeof(p->rbuf) - p->rend);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (n <= 0) return false;
+    p->read_at = metrics_now();
+    p->rend += n;
+    pthread_mutex_lock(&p->lock);
+    p->reads++;
+    p->read_bytes += n;
+    pthread_mutex_unlock(&p->lock);
+    return true;
+}
+
+static void *reader_main(void *arg) {
+    Pipeline *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        if (p->reading && p->eof && !p->eof_sent && !ring_full(p)) {
+            push(p, "", 0);
+            p->eof_sent = true;
+            wake_editor(p);
+        }
+        if (!p->reading || p->eof || ring_full(p)) {
+            p->parked = true;
+            pthread_cond_broadcast(&p->changed);
+            pthread_cond_wait(&p->changed, &p->lock);
+            continue;
+        }
+        p->parked = false;
+        pthread_mutex_unlock(&p->lock);
+        bool more = reader_step(p);
+        pthread_mutex_lock(&p->lock);
+        if (!more) p->eof = true;
+    }
+    p->parked = true;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// Write all of buf, waiting for out_fd when it is backed up.  Returns
+// the number of writes.
+static unsigned long write_all(int fd, const char *buf, size_t len) {
+    unsigned long writes = 0;
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = write(fd, buf + sent, len - sent);
+        writes++;
+        if (n >= 0) {
+            sent += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    return writes;
+}
+
+static void *writer_main(void *arg) {
+    Pipeline *p = arg;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->busy && !p->stop) pthread_cond_wait(&p->changed, &p->lock);
+        if (!p->busy) break;
+        char *buf = p->job;
+        size_t len = p->job_len;
+        pthread_mutex_unlock(&p->lock);
+
+        unsigned long writes = write_all(p->out_fd, buf, len);
+
+        pthread_mutex_lock(&p->lock);
+        p->busy = false;
+        p->done = true;
+        p->done_at = metrics_now();
+        p->writes += writes;
+        p->write_bytes += len;
+        pthread_cond_broadcast(&p->changed);
+        wake_editor(p);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+bool pipeline_start(Pipeline *p, int in_fd, int out_fd) {
+    memset(p, 0, sizeof(Pipeline));
+    atomic_init(&p->head, 0);
+    atomic_init(&p->tail, 0);
+    atomic_init(&p->woken, false);
+    p->in_fd = in_fd;
+    p->out_fd = out_fd;
+    p->ctl[0] = p->ctl[1] = -1;
+    if (!open_pipe(p->wake) || !open_pipe(p->ctl)) {
+        close_pipe(p->wake);
+        close_pipe(p->ctl);
+        return false;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+
+    bool started = pthread_create(&p->reader, NULL, reader_main, p) == 0;
+    if (started && pthread_create(&p->writer, NULL, writer_main, p) != 0) {
+        pthread_mutex_lock(&p->lock);
+        p->stop = true;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->reader, NULL);
+        started = false;
+    }
+    if (!started) {
+        pthread_cond_destroy(&p->changed);
+        pthread_mutex_destroy(&p->lock);
+        close_pipe(p->wake);
+        close_pipe(p->ctl);
+    }
+    return started;
+}
+
+void pipeline_stop(Pipeline *p, char **buf, size_t *cap) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+    poke(p->ctl[1]);
+    pthread_join(p->reader, NULL);
+    pthread_join(p->writer, NULL);
+
+    *buf = p->job;
+    *cap = p->job_cap;
+    p->job = NULL;
+    p->job_cap = 0;
+    pthread_cond_destroy(&p->changed);
+    pthread_mutex_destroy(&p->lock);
+    close_pipe(p->wake);
+    close_pipe(p->ctl);
+}
+
+void pipeline_resume(Pipeline *p) {
+    pthread_mutex_lock(&p->lock);
+    p->reading = true;
+    // Every line read after the end of input ends with it
+    p->eof_sent = false;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pipeline_pause(Pipeline *p) {
+    pthread_mutex_lock(&p->lock);
+    if (p->reading) {
+        p->reading = false;
+        poke(p->ctl[1]);
+        while (!p->parked) pthread_cond_wait(&p->changed, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+bool pipeline_pop(Pipeline *p, PipelineKey *key) {
+    size_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    if (head == tail) return false;
+    *key = p->keys[head & (PIPELINE_KEYS - 1)];
+    atomic_store_explicit(&p->head, head + 1, memory_order_release);
+    // A reader waiting for room waits on the lock
+    if (tail - head == PIPELINE_KEYS) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return true;
+}
+
+bool pipeline_keys_waiting(Pipeline *p) {
+    return atomic_load_explicit(&p->head, memory_order_relaxed)
+        != atomic_load_explicit(&p->tail, memory_order_acquire);
+}
+
+int pipeline_wake_fd(const Pipeline *p) {
+    return p->wake[0];
+}
+
+void pipeline_woken(Pipeline *p) {
+    drain(p->wake[0]);
+    atomic_store(&p->woken, false);
+}
+
+bool pipeline_send(Pipeline *p, char **buf, size_t *len, size_t *cap, PipelineWrite *w) {
+    pthread_mutex_lock(&p->lock);
+    w->done = p->done;
+    w->handed_at = p->handed_at;
+    w->done_at = p->done_at;
+    w->writes = p->writes;
+    w->write_bytes = p->write_bytes;
+    p->done = false;
+    p->writes = 0;
+    p->write_bytes = 0;
+
+    bool idle = !p->busy;
+    if (idle && *len > 0) {
+        char *job = p->job;
+        size_t job_cap = p->job_cap;
+        p->job = *buf;
+        p->job_cap = *cap;
+        p->job_len = *len;
+        *buf = job;
+        *cap = job_cap;
+        *len = 0;
+        p->busy = true;
+        p->handed_at = metrics_now();
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return idle;
+}
+
+bool pipeline_busy(Pipeline *p) {
+    pthread_mutex_lock(&p->lock);
+    bool busy = p->busy;
+    pthread_mutex_unlock(&p->lock);
+    return busy;
+}
+
+void pipeline_wait(Pipeline *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->busy) pthread_cond_wait(&p->changed, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pipeline_reads(Pipeline *p, unsigned long *reads, unsigned long long *bytes) {
+    pthread_mutex_lock(&p->lock);
+    *reads = p->reads;
+    *bytes = p->read_bytes;
+    p->reads = 0;
+    p->read_bytes = 0;
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,104 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "keymap.h"
+
+#define PIPELINE_KEYS 1024          // Keys the reader runs ahead, a power of two
+#define PIPELINE_READ_SIZE 4096
+#define PIPELINE_ESCAPE_MS 10       // Wait for the rest of a lone ESC
+
+// A decoded key and when its last byte was read.  A key of length 0
+// marks the end of input.
+typedef struct {
+    KeySequence key;
+    unsigned long long read_at;
+} PipelineKey;
+
+// Three threads around one Line.  The reader reads the input fd and
+// decodes keys into a ring only it fills and only the editor empties,
+// so neither takes a lock per key.  The editor applies them and draws a
+// frame whenever the writer is free, which writes it out however long
+// the terminal takes.  Keys and finished writes wake the editor through
+// a pipe, written only when it isn't already readable.
+typedef struct {
+    PipelineKey keys[PIPELINE_KEYS];
+    atomic_size_t head;         // Next key to take, moved by the editor
+    atomic_size_t tail;         // Next slot to fill, moved by the reader
+    atomic_bool woken;          // A byte waits in wake
+    int wake[2];                // Readable when the editor has something to do
+    int ctl[2];                 // Interrupts the reader's poll
+    int in_fd;
+    int out_fd;
+    pthread_t reader;
+    pthread_t writer;
+
+    pthread_mutex_t lock;       // Guards the rest
+    pthread_cond_t changed;
+    bool stop;
+    bool reading;               // The editor wants input read
+    bool parked;                // The reader is waiting, not reading
+    bool eof;                   // The reader hit the end of input
+    bool eof_sent;              // and queued it for the line being read
+    unsigned long reads;
+    unsigned long long read_bytes;
+
+    // The frame being written, a buffer swapped with the editor's
+    char *job;
+    size_t job_len;
+    size_t job_cap;
+    bool busy;                  // job is being written
+    bool done;                  // A write finished since pipeline_send last looked
+    unsigned long long handed_at;   // When job was handed over
+    unsigned long long done_at;
+    unsigned long writes;
+    unsigned long long write_bytes;
+
+    // Owned by the reader thread
+    char rbuf[PIPELINE_READ_SIZE];  // Read, not yet decoded
+    size_t rstart;
+    size_t rend;
+    unsigned long long read_at;     // When rbuf was last filled
+
+    // Owned by the editor thread, for metrics
+    unsigned long long first_read_at;   // Oldest key taken since the last frame, 0 if none
+    unsigned long long first_taken_at;
+    unsigned long long job_read_at;     // Oldest key in job
+} Pipeline;
+
+// What the writer did with the frame handed over before
+typedef struct {
+    bool done;
+    unsigned long long handed_at;
+    unsigned long long done_at;
+    unsigned long writes;
+    unsigned long long write_bytes;
+} PipelineWrite;
+
+// Start the threads with input paused.  p must stay put until
+// pipeline_stop.
+bool pipeline_start(Pipeline *p, int in_fd, int out_fd);
+// Join the threads after writing what was handed over.  Hands back the
+// writer's buffer for the caller to free.
+void pipeline_stop(Pipeline *p, char **buf, size_t *cap);
+
+void pipeline_resume(Pipeline *p);      // Read input
+void pipeline_pause(Pipeline *p);       // Returns once the reader stopped reading
+bool pipeline_pop(Pipeline *p, PipelineKey *key);
+bool pipeline_keys_waiting(Pipeline *p);
+int pipeline_wake_fd(const Pipeline *p);
+void pipeline_woken(Pipeline *p);       // Drain the wake pipe before looking for work
+
+// Hand len bytes of *buf to the writer, taking its empty buffer in
+// exchange, unless it is still busy.  Reports in *w a write that
+// finished since the last call.  len may be 0 to only collect that.
+bool pipeline_send(Pipeline *p, char **buf, size_t *len, size_t *cap, PipelineWrite *w);
+bool pipeline_busy(Pipeline *p);
+void pipeline_wait(Pipeline *p);        // Until the writer is free
+// Reads made and bytes read since the last call
+void pipeline_reads(Pipeline *p, unsigned long *reads, unsigned long long *bytes);
+
+#endif // PIPELINE_H
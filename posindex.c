@@ -0,0 +1,385 @@
+#include "posindex.h"
+#include <limits.h>
+#include <stdlib.h>
+
+#define POSINDEX_INIT_CAP 16
+
+void posindex_init(PosIndex *x, int open, int close, const LineAllocator *a) {
+    x->nodes = NULL;
+    x->capacity = 0;
+    x->used = 0;
+    x->free_list = -1;
+    x->root = -1;
+    x->seed = 2463534242u;
+    x->open = open;
+    x->close = close;
+    x->allocator = alloc_resolve(a);
+}
+
+void posindex_free(PosIndex *x) {
+    mem_free(x->allocator, x->nodes);
+    x->nodes = NULL;
+    x->capacity = x->used = 0;
+    x->free_list = -1;
+    x->root = -1;
+}
+
+void posindex_clear(PosIndex *x) {
+    x->used = 0;
+    x->free_list = -1;
+    x->root = -1;
+}
+
+void posindex_trim(PosIndex *x, size_t capacity) {
+    if (x->used > 0 || capacity >= x->capacity) return;
+    if (capacity == 0) {
+        mem_free(x->allocator, x->nodes);
+        x->nodes = NULL;
+        x->capacity = 0;
+        return;
+    }
+    PosNode *nodes = mem_realloc(x->allocator, x->nodes, capacity * sizeof(PosNode));
+    if (!nodes) return;
+    x->nodes = nodes;
+    x->capacity = capacity;
+}
+
+size_t posindex_memory_usage(const PosIndex *x) {
+    return x->capacity * sizeof(PosNode);
+}
+
+static unsigned next_priority(PosIndex *x) {
+    // xorshift32, per index so separate Lines share no state
+    unsigned s = x->seed;
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    x->seed = s;
+    return s;
+}
+
+static int alloc_node(PosIndex *x, int delta, size_t gap) {
+    int t;
+    if (x->free_list >= 0) {
+        t = x->free_list;
+        x->free_list = x->nodes[t].left;
+    } else {
+        if (x->used >= x->capacity) {
+            size_t capacity = x->capacity ? x->capacity * 2 : POSINDEX_INIT_CAP;
+            PosNode *nodes = mem_realloc(x->allocator, x->nodes, capacity * sizeof(PosNode));
+            if (!nodes) return -1;
+            x->nodes = nodes;
+            x->capacity = capacity;
+        }
+        t = (int)x->used++;
+    }
+
+    PosNode *n = &x->nodes[t];
+    n->left = n->right = -1;
+    n->priority = next_priority(x);
+    n->delta = delta;
+    n->gap = gap;
+    n->span = gap + 1;
+    n->count = 1;
+    n->sum = delta;
+    n->min_prefix = delta;
+    return t;
+}
+
+static void free_subtree(PosIndex *x, int t) {
+    if (t < 0) return;
+    free_subtree(x, x->nodes[t].left);
+    free_subtree(x, x->nodes[t].right);
+    x->nodes[t].left = x->free_list;
+    x->free_list = t;
+}
+
+static void pull(PosIndex *x, int t) {
+    PosNode *n = &x->nodes[t];
+    size_t span = 0, count = 0;
+    long sum = 0, min_prefix = LONG_MAX;
+
+    if (n->left >= 0) {
+        const PosNode *l = &x->nodes[n->left];
+        span = l->span;
+        count = l->count;
+        sum = l->sum;
+        min_prefix = l->min_prefix;
+    }
+
+    span += n->gap + 1;
+    count++;
+    sum += n->delta;
+    if (sum < min_prefix) min_prefix = sum;
+
+    if (n->right >= 0) {
+        const PosNode *r = &x->nodes[n->right];
+        span += r->span;
+        count += r->count;
+        if (sum + r->min_prefix < min_prefix) min_prefix = sum + r->min_prefix;
+        sum += r->sum;
+    }
+
+    n->span = span;
+    n->count = count;
+    n->sum = sum;
+    n->min_prefix = min_prefix;
+}
+
+static size_t span_of(const PosIndex *x, int t) {
+    return t < 0 ? 0 : x->nodes[t].span;
+}
+
+static size_t count_of(const PosIndex *x, int t) {
+    return t < 0 ? 0 : x->nodes[t].count;
+}
+
+static long sum_of(const PosIndex *x, int t) {
+    return t < 0 ? 0 : x->nodes[t].sum;
+}
+
+// Nodes at offsets below off go to *l, the rest to *r.  Offsets are
+// relative to the start of t.
+static void split(PosIndex *x, int t, size_t off, int *l, int *r) {
+    if (t < 0) {
+        *l = *r = -1;
+        return;
+    }
+    PosNode *n = &x->nodes[t];
+    size_t left_span = span_of(x, n->left);
+    if (left_span + n->gap < off) {
+        split(x, n->right, off - left_span - n->gap - 1, &n->right, r);
+        *l = t;
+    } else {
+        split(x, n->left, off, l, &n->left);
+        *r = t;
+    }
+    pull(x, t);
+}
+
+static int merge(PosIndex *x, int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    if (x->nodes[a].priority > x->nodes[b].priority) {
+        x->nodes[a].right = merge(x, x->nodes[a].right, b);
+        pull(x, a);
+        return a;
+    }
+    x->nodes[b].left = merge(x, a, x->nodes[b].left);
+    pull(x, b);
+    return b;
+}
+
+static void adjust_first_gap(PosIndex *x, int t, long delta) {
+    if (t < 0) return;
+    if (x->nodes[t].left >= 0) {
+        adjust_first_gap(x, x->nodes[t].left, delta);
+    } else {
+        x->nodes[t].gap += delta;
+    }
+    pull(x, t);
+}
+
+// An edit without tracked bytes only resizes the gap it falls in, which
+// is found and updated along one path without restructuring the tree
+static void shift(PosIndex *x, size_t offset, size_t len, bool grow) {
+    // Untracked bytes after the last node aren't stored
+    if (offset >= span_of(x, x->root)) return;
+
+    int t = x->root;
+    while (t >= 0) {
+        PosNode *n = &x->nodes[t];
+        size_t left_span = span_of(x, n->left);
+        n->span = grow ? n->span + len : n->span - len;
+        if (offset < left_span) {
+            t = n->left;
+        } else if (offset <= left_span + n->gap) {
+            n->gap = grow ? n->gap + len : n->gap - len;
+            return;
+        } else {
+            offset -= left_span + n->gap + 1;
+            t = n->right;
+        }
+    }
+}
+
+void posindex_insert(PosIndex *x, size_t offset, const char *text, size_t len) {
+    if (len == 0) return;
+
+    size_t i = 0;
+    while (i < len && (unsigned char)text[i] != x->open && (unsigned char)text[i] != x->close) i++;
+    if (i == len) {
+        shift(x, offset, len, true);
+        return;
+    }
+
+    int l, r;
+    split(x, x->root, offset, &l, &r);
+
+    // Untracked bytes between the last node before offset and offset
+    size_t lead = offset - span_of(x, l);
+    int mid = -1;
+    size_t last = 0;
+    bool any = false;
+    for (size_t i = 0; i < len; i++) {
+        int c = (unsigned char)text[i];
+        int w = c == x->open ? 1 : c == x->close ? -1 : 0;
+        if (w == 0) continue;
+        size_t gap = any ? i - last - 1 : lead + i;
+        int t = alloc_node(x, w, gap);
+        if (t < 0) break;
+        mid = merge(x, mid, t);
+        last = i;
+        any = true;
+    }
+
+    // The first node after the insertion now has the tail of text (or
+    // all of it) in front of it
+    if (any) adjust_first_gap(x, r, (long)(len - last - 1) - (long)lead);
+    else adjust_first_gap(x, r, (long)len);
+
+    x->root = merge(x, merge(x, l, mid), r);
+}
+
+void posindex_delete(PosIndex *x, size_t offset, size_t len) {
+    if (len == 0) return;
+    if (posindex_rank(x, offset) == posindex_rank(x, offset + len)) {
+        shift(x, offset, len, false);
+        return;
+    }
+
+    int l, m, r;
+    split(x, x->root, offset, &l, &r);
+    size_t base = span_of(x, l);
+    split(x, r, offset + len - base, &m, &r);
+
+    // Bytes removed in front of the first node after the deletion
+    long removed = (long)len - (long)span_of(x, m);
+    adjust_first_gap(x, r, -removed);
+
+    free_subtree(x, m);
+    x->root = merge(x, l, r);
+}
+
+size_t posindex_count(const PosIndex *x) {
+    return count_of(x, x->root);
+}
+
+size_t posindex_rank(const PosIndex *x, size_t offset) {
+    size_t rank = 0;
+    int t = x->root;
+    while (t >= 0) {
+        const PosNode *n = &x->nodes[t];
+        size_t left_span = span_of(x, n->left);
+        if (left_span + n->gap < offset) {
+            rank += count_of(x, n->left) + 1;
+            offset -= left_span + n->gap + 1;
+            t = n->right;
+        } else {
+            t = n->left;
+        }
+    }
+    return rank;
+}
+
+size_t posindex_select(const PosIndex *x, size_t rank) {
+    size_t offset = 0;
+    int t = x->root;
+    while (t >= 0) {
+        const PosNode *n = &x->nodes[t];
+        size_t left_count = count_of(x, n->left);
+        if (rank < left_count) {
+            t = n->left;
+        } else if (rank == left_count) {
+            return offset + span_of(x, n->left) + n->gap;
+        } else {
+            rank -= left_count + 1;
+            offset += span_of(x, n->left) + n->gap + 1;
+            t = n->right;
+        }
+    }
+    return POSINDEX_NONE;
+}
+
+long posindex_prefix(const PosIndex *x, size_t rank) {
+    long sum = 0;
+    int t = x->root;
+    while (t >= 0 && rank > 0) {
+        const PosNode *n = &x->nodes[t];
+        size_t left_count = count_of(x, n->left);
+        if (rank <= left_count) {
+            t = n->left;
+        } else {
+            sum += sum_of(x, n->left) + n->delta;
+            rank -= left_count + 1;
+            t = n->right;
+        }
+    }
+    return sum;
+}
+
+long posindex_min_prefix(const PosIndex *x, size_t rank) {
+    long min = 0, sum = 0;
+    int t = x->root;
+    while (t >= 0 && rank > 0) {
+        const PosNode *n = &x->nodes[t];
+        size_t left_count = count_of(x, n->left);
+        if (rank <= left_count) {
+            t = n->left;
+            continue;
+        }
+        if (n->left >= 0) {
+            const PosNode *l = &x->nodes[n->left];
+            if (sum + l->min_prefix < min) min = sum + l->min_prefix;
+            sum += l->sum;
+        }
+        sum += n->delta;
+        if (sum < min) min = sum;
+        rank -= left_count + 1;
+        t = n->right;
+    }
+    return min;
+}
+
+static size_t first_below(const PosIndex *x, int t, long before, size_t base,
+                          size_t from, long threshold) {
+    if (t < 0) return POSINDEX_NONE;
+    const PosNode *n = &x->nodes[t];
+    if (base + n->count <= from) return POSINDEX_NONE;
+    if (before + n->min_prefix >= threshold) return POSINDEX_NONE;
+
+    size_t found = first_below(x, n->left, before, base, from, threshold);
+    if (found != POSINDEX_NONE) return found;
+
+    size_t rank = base + count_of(x, n->left);
+    long value = before + sum_of(x, n->left) + n->delta;
+    if (rank >= from && value < threshold) return rank;
+
+    return first_below(x, n->right, value, rank + 1, from, threshold);
+}
+
+size_t posindex_first_below(const PosIndex *x, size_t from, long threshold) {
+    return first_below(x, x->root, 0, 0, from, threshold);
+}
+
+static size_t last_at_most(const PosIndex *x, int t, long before, size_t base,
+                           size_t to, long threshold) {
+    if (t < 0) return POSINDEX_NONE;
+    const PosNode *n = &x->nodes[t];
+    if (base >= to) return POSINDEX_NONE;
+    if (before + n->min_prefix > threshold) return POSINDEX_NONE;
+
+    size_t rank = base + count_of(x, n->left);
+    long value = before + sum_of(x, n->left) + n->delta;
+
+    size_t found = last_at_most(x, n->right, value, rank + 1, to, threshold);
+    if (found != POSINDEX_NONE) return found;
+
+    if (rank < to && value <= threshold) return rank;
+
+    return last_at_most(x, n->left, before, base, to, threshold);
+}
+
+size_t posindex_last_at_most(const PosIndex *x, size_t to, long threshold) {
+    return last_at_most(x, x->root, 0, 0, to, threshold);
+}
@@ -0,0 +1,61 @@
+#ifndef POSINDEX_H
+#define POSINDEX_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "alloc.h"
+
+#define POSINDEX_NONE ((size_t)-1)
+
+// Positions of selected bytes of a buffer, kept in an implicit treap.
+// A node stands for one tracked byte and stores how many untracked bytes
+// come before it, so inserting or deleting anywhere only touches
+// O(log n) nodes.  Each tracked byte has a weight (+1 for an opening
+// bracket, -1 for a closing one) and subtrees keep the sum and the
+// minimum prefix sum of their weights.
+typedef struct {
+    int left;
+    int right;
+    unsigned priority;
+    int delta;          // Weight of this byte
+    size_t gap;         // Untracked bytes between the previous node and this one
+    size_t span;        // Bytes covered by the subtree, sum of gap + 1
+    size_t count;       // Nodes in the subtree
+    long sum;           // Sum of the weights in the subtree
+    long min_prefix;    // Minimum prefix sum of the weights in the subtree
+} PosNode;
+
+typedef struct {
+    PosNode *nodes;
+    size_t capacity;
+    size_t used;
+    int free_list;
+    int root;
+    unsigned seed;
+    int open;           // Byte with weight +1, or -1
+    int close;          // Byte with weight -1, or -1
+    const LineAllocator *allocator;
+} PosIndex;
+
+// Track the bytes open and close, either of which may be -1.  a is NULL
+// for the default allocator.
+void posindex_init(PosIndex *x, int open, int close, const LineAllocator *a);
+void posindex_free(PosIndex *x);
+void posindex_clear(PosIndex *x);
+void posindex_trim(PosIndex *x, size_t capacity);   // Drop spare nodes of an empty index
+// Keep the index in sync with a buffer edit
+void posindex_insert(PosIndex *x, size_t offset, const char *text, size_t len);
+void posindex_delete(PosIndex *x, size_t offset, size_t len);
+
+size_t posindex_count(const PosIndex *x);
+size_t posindex_rank(const PosIndex *x, size_t offset);     // Nodes before offset
+size_t posindex_select(const PosIndex *x, size_t rank);     // Offset of a node
+long posindex_prefix(const PosIndex *x, size_t rank);       // Weight of the nodes before rank
+long posindex_min_prefix(const PosIndex *x, size_t rank);   // min(0, prefix sums before rank)
+// First rank >= from whose inclusive prefix sum is below threshold
+size_t posindex_first_below(const PosIndex *x, size_t from, long threshold);
+// Last rank < to whose inclusive prefix sum is at most threshold
+size_t posindex_last_at_most(const PosIndex *x, size_t to, long threshold);
+size_t posindex_memory_usage(const PosIndex *x);
+
+#endif // POSINDEX_H
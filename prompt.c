@@ -0,0 +1,120 @@
+#include "prompt.h"
+#include <stdlib.h>
+#include <string.h>
+
+void prompt_init(PromptLayout *p, const LineAllocator *a) {
+    memset(p, 0, sizeof(PromptLayout));
+    p->allocator = alloc_resolve(a);
+}
+
+void prompt_free(PromptLayout *p) {
+    const LineAllocator *a = p->allocator;
+    mem_free(a, p->source);
+    mem_free(a, p->text);
+    mem_free(a, p->visible);
+    mem_free(a, p->wraps);
+    memset(p, 0, sizeof(PromptLayout));
+    p->allocator = a;
+}
+
+// Bytes of the escape sequence at s: a CSI sequence up to its final
+// byte, an OSC string up to BEL or ST, or ESC and one more byte
+static size_t escape_length(const char *s, size_t n) {
+    if (n < 2) return n;
+    size_t i = 2;
+    if (s[1] == '[') {
+        while (i < n && !((unsigned char)s[i] >= 0x40 && (unsigned char)s[i] <= 0x7e)) i++;
+        return i < n ? i + 1 : n;
+    }
+    if (s[1] == ']') {
+        for (; i < n; i++) {
+            if (s[i] == '\a') return i + 1;
+            if (s[i] == '\033' && i + 1 < n && s[i + 1] == '\\') return i + 2;
+        }
+        return n;
+    }
+    return 2;
+}
+
+bool prompt_set(PromptLayout *p, const char *prompt) {
+    if (!prompt) prompt = "";
+    if (prompt == p->source) return false;
+    size_t n = strlen(prompt);
+    if (p->source && n == p->source_len && memcmp(prompt, p->source, n) == 0) return false;
+
+    const LineAllocator *a = p->allocator;
+    char *source = mem_alloc(a, n + 1), *text = mem_alloc(a, n + 1), *visible = mem_alloc(a, n + 1);
+    if (!source || !text || !visible) {
+        mem_free(a, source);
+        mem_free(a, text);
+        mem_free(a, visible);
+        return false;
+    }
+    memcpy(source, prompt, n + 1);
+
+    size_t len = 0, visible_len = 0, width = 0;
+    bool hidden = false;
+    for (size_t i = 0; i < n;) {
+        unsigned char c = prompt[i];
+        if (c == '\001' || c == '\002') {
+            hidden = c == '\001';
+            i++;
+            continue;
+        }
+        size_t k = c == '\033' && !hidden ? escape_length(prompt + i, n - i) : 1;
+        memcpy(text + len, prompt + i, k);
+        len += k;
+        if (!hidden && k == 1 && c >= 0x20 && c != 0x7f) {
+            visible[visible_len++] = c;
+            if ((c & 0xc0) != 0x80) width++;
+        }
+        i += k;
+    }
+    text[len] = visible[visible_len] = '\0';
+
+    mem_free(a, p->source);
+    mem_free(a, p->text);
+    mem_free(a, p->visible);
+    p->source = source;
+    p->source_len = n;
+    p->text = text;
+    p->len = len;
+    p->visible = visible;
+    p->visible_len = visible_len;
+    p->width = width;
+    p->wrap_width = 0;
+    return true;
+}
+
+// Split visible into rows of width columns
+static void compute_wraps(PromptLayout *p, int width) {
+    p->wrap_count = 0;
+    p->wrap_width = width;
+    size_t rows = p->width / width;
+    if (rows > p->wrap_cap) {
+        size_t *wraps = mem_realloc(p->allocator, p->wraps, rows * sizeof(size_t));
+        if (!wraps) return;
+        p->wraps = wraps;
+        p->wrap_cap = rows;
+    }
+
+    size_t col = 0;
+    for (size_t i = 0; i < p->visible_len && p->wrap_count < rows; i++) {
+        if (((unsigned char)p->visible[i] & 0xc0) == 0x80) continue;
+        if (col > 0 && col % width == 0) p->wraps[p->wrap_count++] = i;
+        col++;
+    }
+    // An exactly full last row leaves an empty one after it
+    while (p->wrap_count < rows) p->wraps[p->wrap_count++] = p->visible_len;
+}
+
+size_t prompt_last_row(PromptLayout *p, int width) {
+    if (width <= 0) return 0;
+    if (p->wrap_width != width) compute_wraps(p, width);
+    return p->wrap_count > 0 ? p->wraps[p->wrap_count - 1] : 0;
+}
+
+size_t prompt_memory_usage(const PromptLayout *p) {
+    size_t strings = p->source ? p->source_len + p->len + p->visible_len + 3 : 0;
+    return strings + p->wrap_cap * sizeof(size_t);
+}
@@ -0,0 +1,36 @@
+#ifndef PROMPT_H
+#define PROMPT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "alloc.h"
+
+// A prompt measured once for every frame that draws it.  Escape
+// sequences (CSI, OSC and two byte ones), other control bytes and
+// readline style \001 ... \002 spans take no columns, neither do UTF-8
+// continuation bytes.
+typedef struct {
+    char *source;       // Copy of the prompt it was made from
+    size_t source_len;
+    char *text;         // What is printed, without the \001 and \002 markers
+    size_t len;
+    char *visible;      // text without the bytes that take no columns
+    size_t visible_len;
+    size_t width;       // Columns the prompt takes
+    size_t *wraps;      // Offset in visible of each row after the first,
+    size_t wrap_count;  // at wrap_width
+    int wrap_width;
+    size_t wrap_cap;
+    const LineAllocator *allocator;
+} PromptLayout;
+
+void prompt_init(PromptLayout *p, const LineAllocator *a);  // NULL for the default
+void prompt_free(PromptLayout *p);
+// Measure prompt unless it is the one p was made from.  Returns whether
+// the layout changed, false too if it couldn't be allocated.
+bool prompt_set(PromptLayout *p, const char *prompt);
+// Offset in visible where the last row of the prompt starts at width
+size_t prompt_last_row(PromptLayout *p, int width);
+size_t prompt_memory_usage(const PromptLayout *p);
+
+#endif // PROMPT_H
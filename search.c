@@ -0,0 +1,62 @@
+#include "search.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+size_t search_forward(const char *hay, size_t n, const char *needle, size_t k, size_t from) {
+    if (k == 0) return from <= n ? from : SEARCH_NONE;
+    if (k > n || from > n - k) return SEARCH_NONE;
+    size_t last = n - k;    // Last offset a match can start at
+    size_t i = from;
+
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i final = _mm_set1_epi8(needle[k - 1]);
+    for (; last - i >= 15 && i <= last; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + k - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, final)));
+        for (; mask; mask &= mask - 1) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(hay + at, needle, k) == 0) return at;
+        }
+    }
+#endif
+
+    for (; i <= last; i++) {
+        if (hay[i] == needle[0] && memcmp(hay + i, needle, k) == 0) return i;
+    }
+    return SEARCH_NONE;
+}
+
+size_t search_backward(const char *hay, size_t n, const char *needle, size_t k, size_t at) {
+    if (k > n) return SEARCH_NONE;
+    if (at > n - k) at = n - k;
+    if (k == 0) return at;
+    size_t end = at + 1;    // Offsets before this are left to try
+
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i final = _mm_set1_epi8(needle[k - 1]);
+    for (; end >= 16; end -= 16) {
+        size_t i = end - 16;
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + k - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, final)));
+        while (mask) {
+            unsigned bit = 31 - __builtin_clz(mask);
+            if (memcmp(hay + i + bit, needle, k) == 0) return i + bit;
+            mask &= ~(1u << bit);
+        }
+    }
+#endif
+
+    while (end > 0) {
+        end--;
+        if (hay[end] == needle[0] && memcmp(hay + end, needle, k) == 0) return end;
+    }
+    return SEARCH_NONE;
+}
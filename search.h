@@ -0,0 +1,18 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEARCH_NONE SIZE_MAX
+
+// Substring search over the first n bytes of hay.  With SSE2 each step
+// tests 16 starting offsets at once, comparing the needle's first and
+// last bytes and checking only the offsets where both match.
+
+// First occurrence of needle starting at from or later
+size_t search_forward(const char *hay, size_t n, const char *needle, size_t k, size_t from);
+// Last occurrence of needle starting at at or before
+size_t search_backward(const char *hay, size_t n, const char *needle, size_t k, size_t at);
+
+#endif // SEARCH_H
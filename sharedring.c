@@ -0,0 +1,161 @@
+#include "sharedring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if ATOMIC_LLONG_LOCK_FREE != 2
+#error "the shared kill ring needs lock-free 64-bit atomics"
+#endif
+
+#define SKR_MAGIC 0x524b4c45u     // "ELKR"
+#define SKR_VERSION 2             // 1 marked busy slots with the entry number
+#define SKR_READ_TRIES 8
+
+typedef struct {
+    uint32_t magic;             // Written last, the file is ready once it's set
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    _Atomic uint64_t next;      // Entry numbers claimed by writers
+    _Atomic uint64_t head;      // Entries published, the latest is head - 1
+} SkrHeader;
+
+typedef struct {
+    _Atomic uint64_t seq;       // 2 * n + 2 once entry n is in, 2 * pid + 1 while
+                                // process pid writes it
+    uint32_t len;
+    char text[];
+} SkrSlot;
+
+static SkrHeader *header(SharedKillRing *r) {
+    return r->map;
+}
+
+static SkrSlot *slot(SharedKillRing *r, uint64_t n) {
+    return (SkrSlot *)((char *)r->map + sizeof(SkrHeader) + (n % r->slots) * r->stride);
+}
+
+// Slots are cache line aligned so writers of neighbours don't share lines
+static size_t slot_stride(size_t slot_size) {
+    return (sizeof(SkrSlot) + slot_size + 63) & ~(size_t)63;
+}
+
+bool skr_open(SharedKillRing *r, const char *path) {
+    memset(r, 0, sizeof(SharedKillRing));
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+
+    // Whoever finds the file empty lays it out, the others wait for that
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return false;
+    }
+    struct stat st;
+    SkrHeader h;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size == 0) {
+        size_t size = sizeof(SkrHeader) + SKR_DEFAULT_SLOTS * slot_stride(SKR_DEFAULT_SLOT_SIZE);
+        memset(&h, 0, sizeof(h));
+        h.magic = SKR_MAGIC;
+        h.version = SKR_VERSION;
+        h.slots = SKR_DEFAULT_SLOTS;
+        h.slot_size = SKR_DEFAULT_SLOT_SIZE;
+        ok = ftruncate(fd, size) == 0 && pwrite(fd, &h, sizeof(h), 0) == sizeof(h);
+        st.st_size = size;
+    } else if (ok) {
+        ok = pread(fd, &h, sizeof(h), 0) == sizeof(h) && h.magic == SKR_MAGIC
+             && h.version == SKR_VERSION && h.slots > 0
+             && (size_t)st.st_size >= sizeof(SkrHeader) + h.slots * slot_stride(h.slot_size);
+    }
+    flock(fd, LOCK_UN);
+
+    void *map = ok ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    r->map = map;
+    r->map_size = st.st_size;
+    r->slots = h.slots;
+    r->slot_size = h.slot_size;
+    r->stride = slot_stride(h.slot_size);
+    return true;
+}
+
+void skr_close(SharedKillRing *r) {
+    if (r->map) munmap(r->map, r->map_size);
+    memset(r, 0, sizeof(SharedKillRing));
+}
+
+// A writer that died inside its slot left it busy for good, the file
+// outlives it.  Processes sharing a ring must share a pid namespace.
+static bool writer_alive(uint64_t pid) {
+    return pid > INT32_MAX || kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+}
+
+bool skr_push(SharedKillRing *r, const char *text, size_t len) {
+    if (!r->map || len > r->slot_size) return false;
+    SkrHeader *h = header(r);
+    uint64_t n = atomic_fetch_add(&h->next, 1);
+    SkrSlot *s = slot(r, n);
+
+    // Take the slot unless a live writer is in it or it already holds a
+    // newer entry, which only happens when the ring laps a stalled writer
+    uint64_t busy = 2 * (uint64_t)getpid() + 1;
+    uint64_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    do {
+        if ((seq & 1) ? writer_alive(seq >> 1) : seq > 2 * n) return false;
+    } while (!atomic_compare_exchange_weak_explicit(&s->seq, &seq, busy,
+                                                    memory_order_acquire, memory_order_relaxed));
+    atomic_thread_fence(memory_order_release);
+    s->len = len;
+    memcpy(s->text, text, len);
+    atomic_store_explicit(&s->seq, 2 * n + 2, memory_order_release);
+
+    // Publish, unless a later entry got there first
+    uint64_t head = atomic_load_explicit(&h->head, memory_order_relaxed);
+    while (head < n + 1 && !atomic_compare_exchange_weak_explicit(&h->head, &head, n + 1,
+                                                                  memory_order_release,
+                                                                  memory_order_relaxed)) {
+    }
+    return true;
+}
+
+char *skr_latest(SharedKillRing *r, size_t *len, const LineAllocator *a) {
+    if (!r->map) return NULL;
+    SkrHeader *h = header(r);
+    a = alloc_resolve(a);
+    char *copy = mem_alloc(a, r->slot_size + 1);
+    if (!copy) return NULL;
+
+    for (int tries = 0; tries < SKR_READ_TRIES; tries++) {
+        uint64_t head = atomic_load_explicit(&h->head, memory_order_acquire);
+        if (head == 0) break;
+        SkrSlot *s = slot(r, head - 1);
+        uint64_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (seq != 2 * head) continue;      // Being rewritten, look again
+
+        size_t n = s->len;
+        if (n > r->slot_size) continue;
+        memcpy(copy, s->text, n);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq) continue;
+
+        copy[n] = '\0';
+        if (len) *len = n;
+        return copy;
+    }
+    mem_free(a, copy);
+    return NULL;
+}
+
+uint64_t skr_head(SharedKillRing *r) {
+    if (!r->map) return 0;
+    return atomic_load_explicit(&header(r)->head, memory_order_acquire);
+}
@@ -0,0 +1,38 @@
+#ifndef SHAREDRING_H
+#define SHAREDRING_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "alloc.h"
+
+#define SKR_DEFAULT_SLOTS 64
+#define SKR_DEFAULT_SLOT_SIZE 16384   // Longest text one entry holds
+
+// A kill ring in a file mapped by every process that opens it, so text
+// killed in one is yanked in another and outlives them.  Entries go in
+// fixed slots.  A writer claims the next entry number, fills its slot
+// between an odd sequence number holding its pid and an even one and
+// then publishes it; readers copy a slot and keep the copy only if its
+// sequence number didn't move.  A slot left odd by a writer that died
+// is taken over by the next one.  Nobody takes a lock after the file
+// is set up.
+typedef struct {
+    void *map;          // NULL when not open
+    size_t map_size;
+    size_t slots;
+    size_t slot_size;
+    size_t stride;      // Bytes from one slot to the next
+} SharedKillRing;
+
+// Map path, creating it with the default layout if it doesn't exist
+bool skr_open(SharedKillRing *r, const char *path);
+void skr_close(SharedKillRing *r);
+// False if the text doesn't fit a slot or a live writer is in its slot
+bool skr_push(SharedKillRing *r, const char *text, size_t len);
+// Copy of the latest entry, allocated from a for the caller to free, NULL
+// if there is none
+char *skr_latest(SharedKillRing *r, size_t *len, const LineAllocator *a);
+uint64_t skr_head(SharedKillRing *r);   // Entries published so far
+
+#endif // SHAREDRING_H
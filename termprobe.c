@@ -0,0 +1,62 @@
+#include "termprobe.h"
+#include <string.h>
+
+static bool has_prefix(const char *s, const char *prefix) {
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+// Unknown names get what every VT102 descendant has, only the names
+// known to lack something are downgraded
+unsigned termprobe_env(const char *term) {
+    if (!term || !*term) return 0;
+    if (strcmp(term, "dumb") == 0 || strcmp(term, "unknown") == 0
+        || strcmp(term, "cons25") == 0 || has_prefix(term, "vt52")) {
+        return 0;
+    }
+    if (strcmp(term, "vt100") == 0 || has_prefix(term, "vt100-")) return TERM_CAP_ANSI;
+    return TERM_CAP_ANSI | TERM_CAP_ICH_DCH;
+}
+
+// The reply is ESC [ ? followed by ';' separated numbers and 'c'.  The
+// first number is the terminal class: 1 for a VT100, which has no
+// ICH or DCH, 6 for a VT102 and 62 and up for a VT220 or later.
+size_t termprobe_reply(const char *buf, size_t len, unsigned *caps, bool *partial) {
+    static const char intro[] = "\033[?";
+    *partial = false;
+    size_t j = 0;
+    for (; j < sizeof(intro) - 1; j++) {
+        if (j == len) {
+            *partial = true;
+            return 0;
+        }
+        if (buf[j] != intro[j]) return 0;
+    }
+
+    unsigned class = 0;
+    bool first = true;
+    while (j < len && ((buf[j] >= '0' && buf[j] <= '9') || buf[j] == ';')) {
+        if (buf[j] == ';') first = false;
+        else if (first && class < 1000) class = class * 10 + (buf[j] - '0');
+        j++;
+    }
+    if (j == len) {
+        *partial = true;
+        return 0;
+    }
+    if (buf[j] != 'c') return 0;
+
+    *caps = TERM_CAP_ANSI | (class == 0 || class == 1 ? 0 : TERM_CAP_ICH_DCH);
+    return j + 1;
+}
+
+bool termprobe_parse(const char *buf, size_t len, unsigned *caps, size_t *start, size_t *end) {
+    for (size_t i = 0; i < len; i++) {
+        bool partial;
+        size_t n = buf[i] == '\033' ? termprobe_reply(buf + i, len - i, caps, &partial) : 0;
+        if (n == 0) continue;
+        *start = i;
+        *end = i + n;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,26 @@
+#ifndef TERMPROBE_H
+#define TERMPROBE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// What a terminal can do beyond printing text, as bits
+#define TERM_CAP_ANSI     (1u << 0)   // Cursor movement and erase (CUU, CUF, EL, ED)
+#define TERM_CAP_ICH_DCH  (1u << 1)   // Insert and delete characters (ICH, DCH)
+
+#define TERMPROBE_QUERY "\033[c"      // DA1, answered by ESC [ ? class ; ... c
+#define TERMPROBE_TIMEOUT_MS 100
+#define TERMPROBE_REPLY_MAX 64        // Longest reply taken out of input after the timeout
+
+// Guess from the TERM environment variable, 0 for a dumb terminal
+unsigned termprobe_env(const char *term);
+
+// Find a DA1 reply in buf.  On success stores the capabilities it
+// implies and the reply's [start, end) in buf.
+bool termprobe_parse(const char *buf, size_t len, unsigned *caps, size_t *start, size_t *end);
+// Length of the DA1 reply buf starts with, storing its capabilities, or
+// 0 if it doesn't start with one.  *partial tells whether it still
+// might once more bytes come.
+size_t termprobe_reply(const char *buf, size_t len, unsigned *caps, bool *partial);
+
+#endif // TERMPROBE_H
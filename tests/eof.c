@@ -0,0 +1,40 @@
+// Every line_read after the end of input returns false at once, with
+// the pipeline off and on.  alarm fails a read that hangs instead.
+#include "eline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EOF_READS 3
+#define EOF_SECONDS 5
+
+static int run(const char *pipeline) {
+    int in[2], out[2];
+    if (pipe(in) != 0 || pipe(out) != 0) return 1;
+    static const char keys[] = "one\r";
+    if (write(in[1], keys, strlen(keys)) != (ssize_t)strlen(keys)) return 1;
+    close(in[1]);
+
+    setenv("ELINE_PIPELINE", pipeline, 1);
+    Line line;
+    line_init_fd(&line, in[0], out[1]);
+    line.config.use_clipboard = false;
+    int failed = !line_read(&line, "> ") || strcmp(line.buffer, "one") != 0;
+    for (int i = 0; i < EOF_READS; i++) {
+        if (line_read(&line, "> ")) failed++;
+    }
+    printf("eof: pipeline %s, %d of %d reads wrong\n", pipeline, failed, EOF_READS + 1);
+    line_free(&line);
+    close(in[0]);
+    close(out[0]);
+    close(out[1]);
+    return failed;
+}
+
+int main(void) {
+    alarm(EOF_SECONDS);
+    int failed = run("0");
+    failed += run("1");
+    return failed > 0;
+}
@@ -0,0 +1,97 @@
+// The shared kill ring under several processes at once.
+//
+// SHARED_PROCS processes push entries and read the latest one back at
+// the same time, and check that every copy they read is whole.  Then
+// writers are killed at random moments, some of them inside a slot, and
+// every slot must still take a push.
+#include "sharedring.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHARED_PROCS 4
+#define SHARED_ROUNDS 200000
+#define SHARED_KILLS 40
+
+// An entry says how long it is and what fills it, so a torn copy shows
+static size_t make_entry(char *buf, unsigned seed, size_t max) {
+    size_t len = 16 + seed % (max - 16);
+    snprintf(buf, 17, "%08zx%08x", len, seed);
+    for (size_t i = 16; i < len; i++) buf[i] = 'a' + (seed + i) % 26;
+    return len;
+}
+
+static bool entry_whole(const char *text, size_t len) {
+    size_t want;
+    unsigned seed;
+    if (len < 16 || sscanf(text, "%8zx%8x", &want, &seed) != 2 || want != len) return false;
+    for (size_t i = 16; i < len; i++) {
+        if (text[i] != (char)('a' + (seed + i) % 26)) return false;
+    }
+    return true;
+}
+
+// Push and read back, exits with the number of torn reads
+static void hammer(const char *path, int id, size_t max) {
+    SharedKillRing r;
+    if (!skr_open(&r, path)) exit(255);
+    char *buf = malloc(r.slot_size);
+    unsigned long torn = 0;
+    for (unsigned i = 0; i < SHARED_ROUNDS; i++) {
+        skr_push(&r, buf, make_entry(buf, id * SHARED_ROUNDS + i, max));
+        size_t len;
+        char *text = skr_latest(&r, &len, NULL);
+        if (text && !entry_whole(text, len)) torn++;
+        free(text);
+    }
+    free(buf);
+    skr_close(&r);
+    exit(torn > 254 ? 254 : torn);
+}
+
+int main(void) {
+    char path[] = "/tmp/eline-sharedring-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return 1;
+    close(fd);
+    int failed = 0;
+
+    // Small entries, so processes often meet in the same slot
+    for (int i = 0; i < SHARED_PROCS; i++) {
+        if (fork() == 0) hammer(path, i, 256);
+    }
+    for (int i = 0; i < SHARED_PROCS; i++) {
+        int status;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    printf("sharedring: %d processes, %d rounds each, %d saw torn reads\n",
+           SHARED_PROCS, SHARED_ROUNDS, failed);
+
+    // Big entries, so a writer is often killed inside its slot
+    srand(time(NULL));
+    for (int i = 0; i < SHARED_KILLS; i++) {
+        pid_t pid = fork();
+        if (pid == 0) hammer(path, SHARED_PROCS + i, 16384);
+        usleep(1000 + rand() % 5000);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    SharedKillRing r;
+    if (!skr_open(&r, path)) return 1;
+    char *buf = malloc(r.slot_size);
+    size_t stuck = 0;
+    for (size_t i = 0; i < 2 * r.slots; i++) {
+        if (!skr_push(&r, buf, make_entry(buf, i, 256))) stuck++;
+    }
+    printf("sharedring: %d writers killed, %zu of %zu pushes after failed\n",
+           SHARED_KILLS, stuck, 2 * r.slots);
+    free(buf);
+    skr_close(&r);
+    unlink(path);
+    return failed > 0 || stuck > 0;
+}
@@ -0,0 +1,83 @@
+// Lines on separate threads share no mutable state.  Built with
+// ThreadSanitizer by make test, which fails on any race it reports.
+//
+// Each thread drives its own Line over a socketpair with its own config
+// and checks every accepted line against what that config should give.
+#include "eline.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define THREADS 8
+#define THREAD_LINES 300
+
+// Type a line, kill its first word and yank it back at the end
+static const char keys[] = "alpha beta f(a\001\033d\005\031\r";
+
+typedef struct {
+    int id;
+    bool failed;
+} Worker;
+
+static void drain(int fd) {
+    char buf[4096];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+}
+
+static void *run(void *arg) {
+    Worker *w = arg;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        w->failed = true;
+        return NULL;
+    }
+    Line line;
+    line_init_fd(&line, sv[0], sv[0]);
+    line_set_columns(&line, 40 + w->id);
+    line.config.use_clipboard = false;
+    line.config.electric_pair_mode = w->id & 1;
+    line.config.mark_yank = w->id & 2;
+    line.config.show_paren_mode = w->id & 4;
+    line.config.autosuggestion_mode = !(w->id & 1);
+    const char *want = line.config.electric_pair_mode ? " beta f(a)alpha" : " beta f(aalpha";
+
+    for (int i = 0; i < THREAD_LINES && !w->failed; i++) {
+        LineStatus status = line_begin(&line, "> ");
+        if (write(sv[1], keys, sizeof(keys) - 1) != (ssize_t)(sizeof(keys) - 1)) w->failed = true;
+        while (status == LINE_PENDING && !w->failed) {
+            status = line_fd_ready(&line);
+            drain(sv[1]);
+        }
+        size_t len;
+        char *text = line_take_buffer(&line, &len);
+        if (status != LINE_ACCEPTED || !text || strcmp(text, want) != 0) {
+            fprintf(stderr, "thread %d line %d: got \"%s\", want \"%s\"\n", w->id, i, text ? text : "", want);
+            w->failed = true;
+        }
+        line_history_add(&line, text);
+        free(text);
+    }
+    line_free(&line);
+    close(sv[0]);
+    close(sv[1]);
+    return NULL;
+}
+
+int main(void) {
+    pthread_t threads[THREADS];
+    Worker workers[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        workers[i] = (Worker){i, false};
+        pthread_create(&threads[i], NULL, run, &workers[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        failed += workers[i].failed;
+    }
+    printf("threads: %d threads, %d lines each, %d failed\n", THREADS, THREAD_LINES, failed);
+    return failed > 0;
+}
@@ -0,0 +1,204 @@
+#include "trace.h"
+#include "metrics.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Room for n more bytes.  Running out of memory ends the recording
+// with the records before this one.
+static bool reserve(Trace *t, size_t n) {
+    if (t->failed) return false;
+    if (t->len + n <= t->cap) return true;
+    size_t cap = t->cap ? t->cap : 4096;
+    while (cap < t->len + n) cap *= 2;
+    char *buf = mem_realloc(t->allocator, t->buf, cap);
+    if (!buf) {
+        t->len = t->record;
+        trace_flush(t);
+        t->failed = true;
+        return false;
+    }
+    t->buf = buf;
+    t->cap = cap;
+    return true;
+}
+
+static size_t varint_size(unsigned long long v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static void put_varint(char *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *p = (char)v;
+}
+
+bool trace_open(Trace *t, int fd, const LineAllocator *a) {
+    memset(t, 0, sizeof(Trace));
+    t->fd = fd;
+    t->allocator = alloc_resolve(a);
+    t->last = metrics_now();
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (!reserve(t, sizeof(TRACE_MAGIC) + 10)) return false;
+    memcpy(t->buf, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+    t->len = sizeof(TRACE_MAGIC) - 1;
+    t->buf[t->len++] = TRACE_VERSION;
+    trace_uint(t, (unsigned long long)now.tv_sec * 1000000000ull + now.tv_nsec);
+    t->record = t->len;
+    trace_flush(t);
+    if (!t->failed) return true;
+    mem_free(t->allocator, t->buf);
+    return false;
+}
+
+void trace_close(Trace *t) {
+    trace_flush(t);
+    if (t->owns_fd) close(t->fd);
+    mem_free(t->allocator, t->buf);
+    mem_free(t->allocator, t->commands);
+    memset(t, 0, sizeof(Trace));
+    t->fd = -1;
+}
+
+void trace_flush(Trace *t) {
+    size_t sent = 0;
+    while (!t->failed && sent < t->len) {
+        ssize_t n = write(t->fd, t->buf + sent, t->len - sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) t->failed = true;
+        else sent += n;
+    }
+    t->written += sent;
+    t->len = t->record = 0;
+}
+
+size_t trace_memory_usage(const Trace *t) {
+    return t->cap + t->command_cap * sizeof(KeyAction);
+}
+
+void trace_begin(Trace *t, TraceKind kind, unsigned long long at) {
+    if (at < t->last) at = t->last;
+    t->record = t->len;
+    if (!reserve(t, 1 + 10 + 1)) return;
+    t->buf[t->len++] = (char)kind;
+    trace_uint(t, at - t->last);
+    t->last = at;
+    // One byte for the length, moved over if the payload needs more
+    t->buf[t->len++] = 0;
+    t->payload = t->len;
+}
+
+void trace_uint(Trace *t, unsigned long long v) {
+    if (!reserve(t, 10)) return;
+    put_varint(t->buf + t->len, v);
+    t->len += varint_size(v);
+}
+
+void trace_bytes(Trace *t, const void *bytes, size_t n) {
+    trace_uint(t, n);
+    trace_raw(t, bytes, n);
+}
+
+void trace_raw(Trace *t, const void *bytes, size_t n) {
+    if (n == 0 || !reserve(t, n)) return;
+    memcpy(t->buf + t->len, bytes, n);
+    t->len += n;
+}
+
+void trace_end(Trace *t) {
+    if (t->failed) return;
+    size_t n = t->len - t->payload;
+    size_t size = varint_size(n);
+    if (size > 1) {
+        if (!reserve(t, size - 1)) return;
+        memmove(t->buf + t->payload + size - 1, t->buf + t->payload, n);
+        t->len += size - 1;
+    }
+    put_varint(t->buf + t->payload - 1, n);
+    t->record = t->len;
+    if (t->len >= TRACE_FLUSH) trace_flush(t);
+}
+
+size_t trace_command(Trace *t, KeyAction action, bool *fresh) {
+    *fresh = false;
+    if (!action) return TRACE_SELF_INSERT;
+    for (size_t i = 0; i < t->command_count; i++) {
+        if (t->commands[i] == action) return i + 1;
+    }
+    if (t->command_count == t->command_cap) {
+        size_t cap = t->command_cap ? t->command_cap * 2 : 16;
+        KeyAction *grown = mem_realloc(t->allocator, t->commands, cap * sizeof(KeyAction));
+        if (!grown) return TRACE_SELF_INSERT;
+        t->commands = grown;
+        t->command_cap = cap;
+    }
+    t->commands[t->command_count++] = action;
+    *fresh = true;
+    return t->command_count;
+}
+
+bool trace_get_uint(const char **p, const char *end, unsigned long long *v) {
+    unsigned long long value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        value |= (unsigned long long)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool trace_get_bytes(const char **p, const char *end, const char **bytes, size_t *n) {
+    unsigned long long len;
+    if (!trace_get_uint(p, end, &len) || len > (unsigned long long)(end - *p)) return false;
+    *bytes = *p;
+    *n = len;
+    *p += len;
+    return true;
+}
+
+bool trace_reader_init(TraceReader *r, const char *buf, size_t len) {
+    size_t magic = sizeof(TRACE_MAGIC) - 1;
+    if (len < magic + 1 || memcmp(buf, TRACE_MAGIC, magic) != 0 || buf[magic] != TRACE_VERSION) {
+        return false;
+    }
+    r->p = buf + magic + 1;
+    r->end = buf + len;
+    r->at = 0;
+    return trace_get_uint(&r->p, r->end, &r->started);
+}
+
+bool trace_next(TraceReader *r, TraceRecord *rec) {
+    const char *p = r->p;
+    if (p >= r->end) return false;
+    unsigned char kind = *p++;
+    unsigned long long dt;
+    if (!trace_get_uint(&p, r->end, &dt)) return false;
+    if (!trace_get_bytes(&p, r->end, &rec->data, &rec->len)) return false;
+    r->at += dt;
+    r->p = p;
+    rec->kind = (TraceKind)kind;
+    rec->at = r->at;
+    return true;
+}
+
+unsigned long long trace_hash(const char *bytes, size_t n) {
+    unsigned long long h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)bytes[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
@@ -0,0 +1,107 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "alloc.h"
+#include "keymap.h"
+
+#define TRACE_MAGIC "eltrace"       // Then a version byte
+#define TRACE_VERSION 1
+#define TRACE_FLUSH 65536           // Buffered bytes that force a write mid-line
+
+// What a session did, as records of
+//
+//     kind (1 byte), ns since the previous record, payload length, payload
+//
+// with the numbers as LEB128 varints, after a header of TRACE_MAGIC, the
+// version and the wall clock time it started in ns.  Payloads are made
+// of varints and byte strings, each a varint length and the bytes, or
+// are bytes and nothing else.  Readers skip kinds they don't know.
+typedef enum {
+    TRACE_BEGIN = 1,    // A line starts: cols, rows, caps, config flags, undo_limit,
+                        // scroll_margin, max_fps, prompt, continuation prompt
+    TRACE_INPUT,        // Bytes read, none at the end of input
+    TRACE_ESCAPE,       // A partial key taken as it is after the timeout
+    TRACE_NAME,         // Gives the next command index a key and a description
+    TRACE_COMMAND,      // A command ran: its index and ns
+    TRACE_EDIT,         // What one command changed: delta count, each delta's
+                        // offset, removed bytes and inserted text, then point
+    TRACE_OUTPUT,       // Bytes written to the terminal
+    TRACE_SIZE,         // The terminal changed size: cols, rows
+    TRACE_PROMPT,       // The prompt was replaced during a line
+    TRACE_ABOVE,        // Text printed above the line
+    TRACE_HISTORY,      // An entry added to the history
+    TRACE_COMPLETE,     // input_complete answered, 1 for complete
+    TRACE_END,          // The line ended: its length and FNV-1a hash
+    TRACE_KINDS
+} TraceKind;
+
+// Index of self-inserted characters among the commands
+#define TRACE_SELF_INSERT 0
+
+// A recorder.  Records are built in memory and written when the
+// buffer passes TRACE_FLUSH or trace_flush is called, so recording
+// costs a clock read and a few bytes of copying per event.
+typedef struct {
+    int fd;
+    bool owns_fd;               // Closed by trace_close
+    bool failed;                // A write or allocation failed, nothing more is recorded
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t record;              // Start of the record being built
+    size_t payload;             // Start of its payload
+    unsigned long long last;    // Time of the previous record
+    KeyAction *commands;        // Commands given an index, after self-insert
+    size_t command_count;
+    size_t command_cap;
+    int cols;                   // Terminal size last recorded
+    int rows;
+    unsigned long long written; // Bytes written to fd
+    const LineAllocator *allocator;
+} Trace;
+
+// Start recording to fd with the header.  False if it can't be written.
+bool trace_open(Trace *t, int fd, const LineAllocator *a);
+void trace_close(Trace *t);     // Flush, then free and maybe close
+void trace_flush(Trace *t);
+size_t trace_memory_usage(const Trace *t);
+
+// A record is built by trace_begin, the fields, then trace_end.  at is
+// a metrics_now() time, taken as the previous one if it is earlier.
+void trace_begin(Trace *t, TraceKind kind, unsigned long long at);
+void trace_uint(Trace *t, unsigned long long v);
+void trace_bytes(Trace *t, const void *bytes, size_t n);
+void trace_raw(Trace *t, const void *bytes, size_t n);     // Without the length
+void trace_end(Trace *t);
+// Index of action among the commands, and whether it was just given one
+// and needs its TRACE_NAME.  NULL is self-insert.
+size_t trace_command(Trace *t, KeyAction action, bool *fresh);
+
+// A record read back.  data points into the trace being read.
+typedef struct {
+    TraceKind kind;
+    unsigned long long at;      // ns since the trace started
+    const char *data;
+    size_t len;
+} TraceRecord;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    unsigned long long at;
+    unsigned long long started; // Wall clock ns, from the header
+} TraceReader;
+
+// False unless buf starts with a header of this version
+bool trace_reader_init(TraceReader *r, const char *buf, size_t len);
+// The next record, false at the end or at a truncated one
+bool trace_next(TraceReader *r, TraceRecord *rec);
+// Fields of a payload, advancing *p.  False past end.
+bool trace_get_uint(const char **p, const char *end, unsigned long long *v);
+bool trace_get_bytes(const char **p, const char *end, const char **bytes, size_t *n);
+
+unsigned long long trace_hash(const char *bytes, size_t n);    // FNV-1a
+
+#endif // TRACE_H
@@ -0,0 +1,162 @@
+#include "undo.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define UNDO_INIT_RECORDS 16
+#define UNDO_INIT_DATA 256
+
+static void stack_init(UndoStack *s, const LineAllocator *a) {
+    s->records = NULL;
+    s->count = s->capacity = 0;
+    s->data = NULL;
+    s->data_len = s->data_cap = 0;
+    s->allocator = a;
+}
+
+static void stack_free(UndoStack *s) {
+    mem_free(s->allocator, s->records);
+    mem_free(s->allocator, s->data);
+    stack_init(s, s->allocator);
+}
+
+static size_t stack_bytes(const UndoStack *s) {
+    return s->data_len + s->count * sizeof(UndoRecord);
+}
+
+void undo_init(UndoLog *u, const LineAllocator *a) {
+    a = alloc_resolve(a);
+    stack_init(&u->undo, a);
+    stack_init(&u->redo, a);
+    u->group = 0;
+    u->applying = false;
+}
+
+void undo_free(UndoLog *u) {
+    stack_free(&u->undo);
+    stack_free(&u->redo);
+}
+
+// Forget every record but keep the memory for the next line
+void undo_clear(UndoLog *u) {
+    u->undo.count = u->undo.data_len = 0;
+    u->redo.count = u->redo.data_len = 0;
+    u->group++;
+}
+
+static void stack_shrink(UndoStack *s, size_t bytes) {
+    if (s->count > 0) return;
+    size_t capacity = bytes / sizeof(UndoRecord);
+    if (s->capacity > capacity) {
+        UndoRecord *records = mem_realloc(s->allocator, s->records, capacity * sizeof(UndoRecord));
+        if (records) {
+            s->records = records;
+            s->capacity = capacity;
+        }
+    }
+    if (s->data_cap > bytes) {
+        char *data = mem_realloc(s->allocator, s->data, bytes);
+        if (data) {
+            s->data = data;
+            s->data_cap = bytes;
+        }
+    }
+}
+
+void undo_shrink(UndoLog *u, size_t bytes) {
+    stack_shrink(&u->undo, bytes);
+    stack_shrink(&u->redo, bytes);
+}
+
+void undo_boundary(UndoLog *u) {
+    u->group++;
+}
+
+size_t undo_memory_usage(const UndoLog *u) {
+    return u->undo.capacity * sizeof(UndoRecord) + u->undo.data_cap
+         + u->redo.capacity * sizeof(UndoRecord) + u->redo.data_cap;
+}
+
+bool undo_push(UndoStack *s, size_t offset, const char *removed, size_t removed_len,
+               size_t inserted_len, size_t point, unsigned long group) {
+    if (s->count >= s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : UNDO_INIT_RECORDS;
+        UndoRecord *records = mem_realloc(s->allocator, s->records, capacity * sizeof(UndoRecord));
+        if (!records) return false;
+        s->records = records;
+        s->capacity = capacity;
+    }
+
+    if (s->data_len + removed_len > s->data_cap) {
+        size_t cap = s->data_cap ? s->data_cap : UNDO_INIT_DATA;
+        while (cap < s->data_len + removed_len) cap *= 2;
+        char *data = mem_realloc(s->allocator, s->data, cap);
+        if (!data) return false;
+        s->data = data;
+        s->data_cap = cap;
+    }
+
+    UndoRecord *r = &s->records[s->count++];
+    r->offset = offset;
+    r->removed_len = removed_len;
+    r->inserted_len = inserted_len;
+    r->data = s->data_len;
+    r->point = point;
+    r->group = group;
+    if (removed_len > 0) memcpy(s->data + s->data_len, removed, removed_len);
+    s->data_len += removed_len;
+    return true;
+}
+
+bool undo_pop(UndoStack *s, UndoRecord *out, const char **bytes) {
+    if (s->count == 0) return false;
+    *out = s->records[--s->count];
+    s->data_len = out->data;
+    *bytes = s->data + out->data;
+    return true;
+}
+
+// Drop whole groups from the bottom until the stack is down to half the
+// limit, so trimming is amortized over many edits
+static void stack_trim(UndoStack *s, size_t limit) {
+    if (limit == 0 || stack_bytes(s) <= limit) return;
+
+    size_t drop = 0;
+    size_t bytes = stack_bytes(s);
+    while (drop < s->count && bytes > limit / 2) {
+        unsigned long group = s->records[drop].group;
+        while (drop < s->count && s->records[drop].group == group) {
+            bytes -= s->records[drop].removed_len + sizeof(UndoRecord);
+            drop++;
+        }
+    }
+
+    size_t data_drop = drop < s->count ? s->records[drop].data : s->data_len;
+    memmove(s->records, s->records + drop, (s->count - drop) * sizeof(UndoRecord));
+    s->count -= drop;
+    memmove(s->data, s->data + data_drop, s->data_len - data_drop);
+    s->data_len -= data_drop;
+    for (size_t i = 0; i < s->count; i++) {
+        s->records[i].data -= data_drop;
+    }
+}
+
+void undo_record(UndoLog *u, size_t offset, const char *removed, size_t removed_len,
+                 size_t inserted_len, size_t point, size_t limit) {
+    if (u->applying) return;
+
+    // A new change makes the undone ones unreachable
+    u->redo.count = u->redo.data_len = 0;
+
+    // Runs of insertions in one group grow a single record
+    if (removed_len == 0 && u->undo.count > 0) {
+        UndoRecord *top = &u->undo.records[u->undo.count - 1];
+        if (top->group == u->group && top->removed_len == 0 &&
+            top->offset + top->inserted_len == offset) {
+            top->inserted_len += inserted_len;
+            return;
+        }
+    }
+
+    if (!undo_push(&u->undo, offset, removed, removed_len, inserted_len, point, u->group)) return;
+    stack_trim(&u->undo, limit);
+}
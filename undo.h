@@ -0,0 +1,56 @@
+#ifndef UNDO_H
+#define UNDO_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "alloc.h"
+
+// One change of the buffer: the inserted_len bytes now at offset replaced
+// removed_len bytes kept in the stack's arena.  A record only stores the
+// bytes that are not in the buffer, so inserting text costs no copy until
+// it is undone.
+typedef struct {
+    size_t offset;
+    size_t removed_len;
+    size_t inserted_len;
+    size_t data;            // Arena offset of the removed bytes
+    size_t point;           // Point to restore once the group is applied
+    unsigned long group;    // Records of one command share a group
+} UndoRecord;
+
+// A stack of records whose bytes live in one arena, both grow and
+// shrink at the top only
+typedef struct {
+    UndoRecord *records;
+    size_t count;
+    size_t capacity;
+    char *data;
+    size_t data_len;
+    size_t data_cap;
+    const LineAllocator *allocator;
+} UndoStack;
+
+typedef struct {
+    UndoStack undo;
+    UndoStack redo;
+    unsigned long group;    // Group of the command being run
+    bool applying;          // An undo or redo is changing the buffer
+} UndoLog;
+
+void undo_init(UndoLog *u, const LineAllocator *a);     // NULL for the default
+void undo_free(UndoLog *u);
+void undo_clear(UndoLog *u);
+// Shrink empty stacks to at most bytes of text and bytes of records
+void undo_shrink(UndoLog *u, size_t bytes);
+void undo_boundary(UndoLog *u);     // Start a new group
+// Record a change before it is made, removed points at the bytes about
+// to be replaced.  Keeps the undo stack under limit bytes, 0 for no limit.
+void undo_record(UndoLog *u, size_t offset, const char *removed, size_t removed_len,
+                 size_t inserted_len, size_t point, size_t limit);
+bool undo_push(UndoStack *s, size_t offset, const char *removed, size_t removed_len,
+               size_t inserted_len, size_t point, unsigned long group);
+// Pop the top record, its bytes stay valid until the next push to s
+bool undo_pop(UndoStack *s, UndoRecord *out, const char **bytes);
+size_t undo_memory_usage(const UndoLog *u);
+
+#endif // UNDO_H